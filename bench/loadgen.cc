@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2020-2021 Aisha Tammy <purrito@bsd.ac>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+/*
+ * HTTP load generator for a running purrito
+ * every connection sends POST and GET requests back to back on a kept
+ * alive connection, fetching back pastes it created itself, and at the
+ * end the throughput and the latency percentiles of both are reported
+ */
+
+#include <arpa/inet.h>
+#include <err.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// clang-format off
+void print_help() {
+  std::printf("usage: loadgen [-hl] [-a address] [-c connections] [-d duration]\n"
+              "               [-g get_percentage] [-n server_name] [-p port]\n"
+              "               [-s size[:max_size]] [-u post_path]\n");
+}
+// clang-format on
+
+/* a single client connection, with or without TLS */
+class connection {
+       public:
+	connection(const addrinfo *address, SSL_CTX *tls,
+	           const std::string &server_name)
+	    : address(address), tls(tls), server_name(server_name) {}
+	~connection() { disconnect(); }
+
+	/*
+	 * send a request and wait for the whole response, returns the
+	 * status code, or 0 if the connection failed
+	 */
+	int exchange(const std::string &request, std::string &body) {
+		if (fd == -1 && !connect()) return 0;
+		if (!send(request)) {
+			disconnect();
+			return 0;
+		}
+		int status = receive(body);
+		if (status == 0 || close_after) disconnect();
+		return status;
+	}
+
+	std::uint_fast64_t received = 0;
+
+       private:
+	const addrinfo *address;
+	SSL_CTX *tls;
+	const std::string server_name;
+	int fd = -1;
+	SSL *ssl = nullptr;
+	std::string input;
+	bool close_after = false;
+
+	bool connect() {
+		fd = socket(address->ai_family, address->ai_socktype,
+		            address->ai_protocol);
+		if (fd == -1) return false;
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if (::connect(fd, address->ai_addr, address->ai_addrlen) != 0) {
+			disconnect();
+			return false;
+		}
+		if (tls) {
+			ssl = SSL_new(tls);
+			SSL_set_fd(ssl, fd);
+			SSL_set_tlsext_host_name(ssl, server_name.c_str());
+			if (SSL_connect(ssl) != 1) {
+				disconnect();
+				return false;
+			}
+		}
+		input.clear();
+		return true;
+	}
+
+	void disconnect() {
+		if (ssl) {
+			SSL_free(ssl);
+			ssl = nullptr;
+		}
+		if (fd != -1) close(fd);
+		fd = -1;
+	}
+
+	bool send(const std::string &data) {
+		std::size_t sent = 0;
+		while (sent < data.size()) {
+			int w = ssl ? SSL_write(ssl, data.data() + sent,
+			                        data.size() - sent)
+			            : ::send(fd, data.data() + sent,
+			                     data.size() - sent, MSG_NOSIGNAL);
+			if (w <= 0) return false;
+			sent += w;
+		}
+		return true;
+	}
+
+	/* read more of the response into the input buffer */
+	bool fill() {
+		char buffer[65536];
+		int r = ssl ? SSL_read(ssl, buffer, sizeof(buffer))
+		            : recv(fd, buffer, sizeof(buffer), 0);
+		if (r <= 0) return false;
+		input.append(buffer, r);
+		received += r;
+		return true;
+	}
+
+	/* make sure the input buffer holds at least the given size */
+	bool fill(const std::size_t size) {
+		while (input.size() < size)
+			if (!fill()) return false;
+		return true;
+	}
+
+	int receive(std::string &body) {
+		std::size_t end;
+		while ((end = input.find("\r\n\r\n")) == std::string::npos)
+			if (!fill()) return 0;
+		std::string head = input.substr(0, end + 2);
+		input.erase(0, end + 4);
+		for (auto &c : head) c = std::tolower(c);
+
+		int status = 0;
+		if (std::sscanf(head.c_str(), "http/1.%*d %d", &status) != 1)
+			return 0;
+		close_after =
+		    head.find("\r\nconnection: close\r\n") != std::string::npos;
+
+		body.clear();
+		auto length = head.find("\r\ncontent-length:");
+		if (length != std::string::npos) {
+			std::size_t size =
+			    std::strtoull(head.c_str() + length + 17, nullptr, 10);
+			if (!fill(size)) return 0;
+			body = input.substr(0, size);
+			input.erase(0, size);
+			return status;
+		}
+		if (head.find("\r\ntransfer-encoding: chunked\r\n") !=
+		    std::string::npos) {
+			while (true) {
+				std::size_t line;
+				while ((line = input.find("\r\n")) ==
+				       std::string::npos)
+					if (!fill()) return 0;
+				std::size_t size =
+				    std::strtoull(input.c_str(), nullptr, 16);
+				if (!fill(line + 2 + size + 2)) return 0;
+				body.append(input, line + 2, size);
+				input.erase(0, line + 2 + size + 2);
+				if (size == 0) return status;
+			}
+		}
+		/* no length, the body ends with the connection */
+		close_after = true;
+		while (fill())
+			;
+		body.swap(input);
+		input.clear();
+		return status;
+	}
+};
+
+/* latencies and counts of a single kind of request */
+struct purrito_results {
+	std::vector<std::uint64_t> latencies;
+	std::uint_fast64_t errors = 0, bytes = 0;
+
+	void merge(const purrito_results &other) {
+		latencies.insert(latencies.end(), other.latencies.begin(),
+		                 other.latencies.end());
+		errors += other.errors;
+		bytes += other.bytes;
+	}
+
+	void print(const char *method, const double seconds) {
+		std::sort(latencies.begin(), latencies.end());
+		auto percentile = [&](const double p) {
+			if (latencies.empty()) return 0.0;
+			auto index = std::min<std::size_t>(
+			    latencies.size() - 1, p * latencies.size());
+			return latencies[index] / 1e6;
+		};
+		std::printf("%-4s %10zu requests %8" PRIuFAST64
+		            " errors %10.1f req/s %8.2f MB/s"
+		            "   p50 %8.3f ms   p99 %8.3f ms   p999 %8.3f ms\n",
+		            method, latencies.size(), errors,
+		            latencies.size() / seconds, bytes / seconds / 1e6,
+		            percentile(0.5), percentile(0.99),
+		            percentile(0.999));
+	}
+};
+
+int main(int argc, char **argv) {
+	int opt;
+	std::string address = "127.0.0.1", port = "42069",
+	            server_name = "localhost", post_path = "/";
+	unsigned int connections = 16, duration = 10, get_percentage = 50;
+	std::size_t min_size = 1024, max_size = 1024;
+	bool use_tls = false;
+
+	while ((opt = getopt(argc, argv, "a:c:d:g:hln:p:s:u:")) != EOF)
+		switch (opt) {
+			case 'a':
+				address = optarg;
+				break;
+			case 'c':
+				connections = std::stoul(optarg);
+				break;
+			case 'd':
+				duration = std::stoul(optarg);
+				break;
+			case 'g':
+				get_percentage = std::stoul(optarg);
+				break;
+			case 'h':
+				print_help();
+				return 0;
+			case 'l':
+				use_tls = true;
+				break;
+			case 'n':
+				server_name = optarg;
+				break;
+			case 'p':
+				port = optarg;
+				break;
+			case 's': {
+				std::string sizes = optarg;
+				auto colon = sizes.find(':');
+				min_size = std::stoull(sizes.substr(0, colon));
+				max_size = colon == std::string::npos
+				               ? min_size
+				               : std::stoull(sizes.substr(colon + 1));
+				break;
+			}
+			case 'u':
+				post_path = optarg;
+				break;
+			default:
+				print_help();
+				errx(1, "ERROR: incorrect parameters");
+		}
+	if (connections == 0 || min_size == 0 || max_size < min_size ||
+	    get_percentage > 100)
+		errx(1, "ERROR: incorrect parameters");
+
+	addrinfo hints = {}, *resolved = nullptr;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(address.c_str(), port.c_str(), &hints, &resolved) != 0)
+		errx(1, "ERROR: could not resolve %s", address.c_str());
+
+	SSL_CTX *tls = nullptr;
+	if (use_tls) {
+		tls = SSL_CTX_new(TLS_client_method());
+		if (!tls) errx(1, "ERROR: could not create a TLS context");
+		/* the server is a local one, usually with a test certificate */
+		SSL_CTX_set_verify(tls, SSL_VERIFY_NONE, nullptr);
+	}
+
+	/* pastes are slices of the same random printable data */
+	std::string data(max_size, ' ');
+	{
+		std::mt19937_64 rng(42);
+		for (auto &c : data) c = ' ' + rng() % 95;
+	}
+
+	std::atomic<bool> stop{false};
+	std::vector<purrito_results> posts(connections), gets(connections);
+	std::vector<std::uint_fast64_t> received(connections);
+	std::vector<std::thread> clients;
+	for (unsigned int c = 0; c < connections; c++)
+		clients.emplace_back([&, c]() {
+			connection client(resolved, tls, server_name);
+			std::mt19937_64 rng(c);
+			std::uniform_int_distribution<std::size_t> size(min_size,
+			                                                 max_size);
+			std::vector<std::string> slugs;
+			std::string body;
+			while (!stop) {
+				bool get = !slugs.empty() &&
+				           rng() % 100 < get_percentage;
+				std::string request;
+				std::size_t paste_size = 0;
+				if (get)
+					request = "GET /" + slugs[rng() % slugs.size()] +
+					          " HTTP/1.1\r\nHost: " + server_name +
+					          "\r\n\r\n";
+				else {
+					paste_size = size(rng);
+					request = "POST " + post_path +
+					          " HTTP/1.1\r\nHost: " + server_name +
+					          "\r\nContent-Length: " +
+					          std::to_string(paste_size) + "\r\n\r\n";
+					request.append(data, rng() % (max_size -
+					                              paste_size + 1),
+					               paste_size);
+				}
+				auto start = std::chrono::steady_clock::now();
+				int status = client.exchange(request, body);
+				auto taken = std::chrono::duration_cast<
+				                 std::chrono::nanoseconds>(
+				                 std::chrono::steady_clock::now() -
+				                 start)
+				                 .count();
+				auto &results = get ? gets[c] : posts[c];
+				if (status != 200) {
+					results.errors++;
+					continue;
+				}
+				results.latencies.push_back(taken);
+				if (get) {
+					results.bytes += body.size();
+					continue;
+				}
+				results.bytes += paste_size;
+				/* the reply is the url of the new paste */
+				while (!body.empty() && std::isspace(body.back()))
+					body.pop_back();
+				slugs.push_back(body.substr(body.rfind('/') + 1));
+			}
+			received[c] = client.received;
+		});
+
+	auto start = std::chrono::steady_clock::now();
+	std::this_thread::sleep_for(std::chrono::seconds(duration));
+	stop = true;
+	for (auto &client : clients) client.join();
+	double seconds = std::chrono::duration<double>(
+	                     std::chrono::steady_clock::now() - start)
+	                     .count();
+
+	purrito_results post, get;
+	for (unsigned int c = 0; c < connections; c++) {
+		post.merge(posts[c]);
+		get.merge(gets[c]);
+	}
+	std::printf("%u connections%s for %.1f s, pastes of %zu to %zu bytes\n",
+	            connections, use_tls ? " over TLS" : "", seconds,
+	            min_size, max_size);
+	post.print("POST", seconds);
+	get.print("GET", seconds);
+
+	freeaddrinfo(resolved);
+	if (tls) SSL_CTX_free(tls);
+	/* nothing got through at all */
+	return post.latencies.empty();
+}
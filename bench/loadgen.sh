@@ -0,0 +1,82 @@
+#!/bin/sh
+
+# start a throwaway purrito and drive it with the load generator,
+# first over plain http and then over TLS, then over plain http again
+# sweeping the number of workers, the number of concurrent clients, and
+# with small pastes stored as files against stored inline
+
+: ${PURRITO=../purrito}
+: ${LOADGEN=../loadgen}
+: ${L_PORT=$(shuf -i 1500-65535 -n 1)}
+: ${L_DURATION=10}
+: ${L_CONNECTIONS=32}
+: ${L_SIZES=64:65536}
+: ${L_MAX_WORKERS=$(nproc 2> /dev/null || echo 4)}
+: ${L_CLIENTS=1 10 100}
+: ${L_INLINE_SIZE=4096}
+: ${L_TMPDIR=$(mktemp -d -t)}
+
+set -e
+
+trap_exit() {
+    [ "${L_ID}" ] && kill "${L_ID}"
+    [ -e "${L_TMPDIR}" ] && rm -rf "${L_TMPDIR}"
+}
+
+trap trap_exit EXIT INT TERM
+
+run() {
+    L_DIR="${L_TMPDIR}/${1}"
+    printf '\n== %s\n' "${1}"
+    shift
+    mkdir "${L_DIR}" "${L_DIR}/db"
+    ${PURRITO} -d "http://localhost:${L_PORT}/" -s "${L_DIR}" -z "${L_DIR}/db" \
+               -i 127.0.0.1 -p "${L_PORT}" -t -n localhost "$@" &
+    L_ID=$!
+    sleep 2
+}
+
+finish() {
+    kill "${L_ID}"
+    wait "${L_ID}" || true
+    L_ID=
+}
+
+run plain
+${LOADGEN} -p "${L_PORT}" -c "${L_CONNECTIONS}" -d "${L_DURATION}" -s "${L_SIZES}"
+finish
+
+openssl req -x509 -out "${L_TMPDIR}/bench.crt" -keyout "${L_TMPDIR}/bench.key" \
+        -newkey rsa:2048 -nodes -sha256 -subj /CN=localhost 2> /dev/null
+run tls -c "${L_TMPDIR}/bench.crt" -k "${L_TMPDIR}/bench.key" -l
+${LOADGEN} -l -p "${L_PORT}" -c "${L_CONNECTIONS}" -d "${L_DURATION}" -s "${L_SIZES}"
+finish
+
+# requests per second from a single worker up to all of the cores
+L_WORKERS=1
+while [ "${L_WORKERS}" -le "${L_MAX_WORKERS}" ]; do
+    run "workers-${L_WORKERS}" -W "${L_WORKERS}"
+    ${LOADGEN} -p "${L_PORT}" -c "${L_CONNECTIONS}" -d "${L_DURATION}" -s "${L_SIZES}"
+    finish
+    # doubling, but always ending with all of them
+    if [ "${L_WORKERS}" -lt "${L_MAX_WORKERS}" ] && \
+       [ $((L_WORKERS * 2)) -gt "${L_MAX_WORKERS}" ]; then
+        L_WORKERS="${L_MAX_WORKERS}"
+    else
+        L_WORKERS=$((L_WORKERS * 2))
+    fi
+done
+
+# throughput and latency as more uploaders write at once
+for clients in ${L_CLIENTS}; do
+    run "clients-${clients}"
+    ${LOADGEN} -p "${L_PORT}" -c "${clients}" -d "${L_DURATION}" -s "${L_SIZES}"
+    finish
+done
+
+# pastes below the inline size, as files and then in the database
+for inline in 0 "${L_INLINE_SIZE}"; do
+    run "inline-${inline}" -I "${inline}"
+    ${LOADGEN} -p "${L_PORT}" -c "${L_CONNECTIONS}" -d "${L_DURATION}" -s "64:${L_INLINE_SIZE}"
+    finish
+done
@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2020-2021 Aisha Tammy <purrito@bsd.ac>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+
+/*
+ * microbenchmarks of the hot paths of a paste
+ * - slug allocation
+ * - expiry keys
+ * - creating and removing a paste file
+ * - expiry inserts, one transaction each and through the group commit
+ * - hashing and compressing paste data
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+
+#include "../src/purrito.h"
+
+static void report(const char *name, const std::size_t iterations,
+                   const std::chrono::steady_clock::time_point start) {
+	double taken = std::chrono::duration<double, std::nano>(
+	                   std::chrono::steady_clock::now() - start)
+	                   .count();
+	std::printf("%-36s %12.1f ns/op %14.0f ops/s\n", name,
+	            taken / iterations, iterations * 1e9 / taken);
+}
+
+template <typename F>
+static void measure(const char *name, const std::size_t iterations, F &&f) {
+	auto start = std::chrono::steady_clock::now();
+	for (std::size_t i = 0; i < iterations; i++) f(i);
+	report(name, iterations, start);
+}
+
+int main() {
+	char storage[] = "/tmp/purrito-bench-storage-XXXXXX";
+	char database[] = "/tmp/purrito-bench-database-XXXXXX";
+	if (!mkdtemp(storage) || !mkdtemp(database)) return 1;
+	{
+		purrito_settings settings(
+		    "http://localhost/", std::string(storage) + "/",
+		    std::string(database) + "/", {"127.0.0.1"}, {42069}, 65536,
+		    268435456, 7, "0123456789abcdefghijklmnopqrstuvwxyz",
+		    604800000000000, {}, {}, false, "index.html", 5, 2000, 64,
+		    false, 0, 0, 0, 0, "127.0.0.1", 0, 0, 10, 0, "", 0, 0);
+
+		measure("slug allocation", 1000000,
+		        [&](std::size_t) { settings.slugs->next(); });
+
+		{
+			purrito_rate_limiter limiter(1000, 10,
+			                             purrito_settings::rate_clients);
+			std::uint_fast64_t retry_after;
+			measure("rate limiter", 1000000, [&](std::size_t i) {
+				std::uint32_t address = i % 100000;
+				limiter.allow(std::string_view((char *)&address,
+				                               sizeof(address)),
+				              retry_after);
+			});
+		}
+
+		measure("expiry key", 1000000, [&](std::size_t) {
+			expiry_key(time_since_epoch(86400), "abcdefg");
+		});
+
+		measure("paste file create and discard", 10000, [&](std::size_t) {
+			purrito_paste_file file(settings);
+			file.to_remove = true;
+		});
+
+		/* both records of a paste with a lifetime */
+		auto put_expiry = [](lmdb::txn &wtxn,
+		                     const std::string &slug) {
+			purrito_paste_record record;
+			record.expiry = time_since_epoch(86400);
+			auto expiry = lmdb::dbi::open(wtxn, "expiry");
+			expiry.put(wtxn, expiry_key(record.expiry, slug), "");
+			auto slugs = lmdb::dbi::open(wtxn, "slugs");
+			slugs.put(wtxn, slug, record.serialize());
+		};
+
+		measure("expiry insert, own transaction", 1000,
+		        [&](std::size_t) {
+			        auto wtxn = lmdb::txn::begin(settings.env);
+			        put_expiry(wtxn, settings.slugs->next(wtxn));
+			        wtxn.commit();
+		        });
+
+		/* all of them are submitted at once, as by many clients */
+		const std::size_t records = 100000;
+		std::atomic<std::size_t> committed{0};
+		auto start = std::chrono::steady_clock::now();
+		for (std::size_t i = 0; i < records; i++)
+			settings.writer->submit(
+			    [&](lmdb::txn &wtxn) {
+				    auto slug = settings.slugs->next(wtxn);
+				    put_expiry(wtxn, slug);
+			    },
+			    [&](bool) { committed++; });
+		while (committed < records)
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		report("expiry insert, group commit", records, start);
+
+		std::string data;
+		while (data.size() < 65536)
+			data += "line " + std::to_string(data.size()) +
+			        " of a log\n";
+		measure("sha256 of 64KB", 10000, [&](std::size_t) {
+			purrito_hash hash;
+			hash.update(data);
+			hash.final();
+		});
+		measure("gzip level 6 of 64KB", 1000, [&](std::size_t) {
+			purrito_deflate deflater(6);
+			deflater.update(data);
+			deflater.finish();
+		});
+	}
+	unlink((std::string(database) + "/data.mdb").c_str());
+	unlink((std::string(database) + "/lock.mdb").c_str());
+	rmdir(database);
+	rmdir(storage);
+	return 0;
+}
@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2020-2021 Aisha Tammy <purrito@bsd.ac>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+
+/*
+ * microbenchmark of the slug allocator
+ * - slugs per second handed out by the allocator, from one and from
+ *   several threads sharing it
+ * - collision behaviour as the slug space fills up, compared with
+ *   picking random slugs and probing until a free one is found
+ */
+
+#include <lmdb++.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "../src/purrito_slugs.h"
+
+static const std::string slug_characters =
+    "0123456789abcdefghijklmnopqrstuvwxyz";
+
+static lmdb::env open_env(const std::string &directory) {
+	auto env = lmdb::env::create();
+	env.set_mapsize(16777216);
+	env.set_max_dbs(8);
+	env.open(directory.c_str(), 0, 0640);
+	return env;
+}
+
+static void throughput(MDB_env *env, const unsigned int threads) {
+	const std::size_t per_thread = 1000000;
+	purrito_slug_allocator slugs(env, slug_characters, 7);
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> workers;
+	for (unsigned int t = 0; t < threads; t++)
+		workers.emplace_back([&]() {
+			std::size_t length = 0;
+			for (std::size_t i = 0; i < per_thread; i++)
+				length += slugs.next().size();
+			if (length != per_thread * 7) std::abort();
+		});
+	for (auto &worker : workers) worker.join();
+	std::chrono::duration<double> taken =
+	    std::chrono::steady_clock::now() - start;
+	std::printf("allocator, %u thread(s): %.0f slugs/s\n", threads,
+	            threads * per_thread / taken.count());
+}
+
+/*
+ * fill a small slug space up to the given ratios, counting repeated
+ * slugs from the allocator and the probes needed by random slugs
+ */
+static void fill(MDB_env *env) {
+	const std::string::size_type slug_size = 3;
+	const std::uint64_t space = 36 * 36 * 36;
+	purrito_slug_allocator slugs(env, slug_characters, slug_size);
+	std::mt19937_64 rng(42);
+	std::uniform_int_distribution<std::size_t> pick(
+	    0, slug_characters.size() - 1);
+	std::unordered_set<std::string> allocated, randomized;
+	std::uint64_t repeats = 0, probes = 0;
+	std::string slug(slug_size, '0');
+	for (double ratio : {0.5, 0.9, 0.99, 1.0}) {
+		std::uint64_t target = ratio * space, ratio_probes = 0,
+		              ratio_slugs = 0;
+		while (allocated.size() < target) {
+			if (!allocated.insert(slugs.next()).second) repeats++;
+			do {
+				for (auto &c : slug) c = slug_characters[pick(rng)];
+				ratio_probes++;
+			} while (!randomized.insert(slug).second);
+			ratio_slugs++;
+		}
+		probes += ratio_probes;
+		std::printf("fill %5.1f%%: allocator repeats %" PRIu64
+		            ", random probes per slug %.2f\n",
+		            ratio * 100, repeats,
+		            ratio_slugs ? (double)ratio_probes / ratio_slugs
+		                        : 0.0);
+	}
+	std::printf("random probes in total: %" PRIu64 " for %" PRIu64
+	            " slugs\n",
+	            probes, space);
+}
+
+int main() {
+	char directory[] = "/tmp/purrito-bench-XXXXXX";
+	if (!mkdtemp(directory)) return 1;
+	{
+		auto env = open_env(directory);
+		throughput(env, 1);
+		throughput(env, std::max(2u, std::thread::hardware_concurrency()));
+		fill(env);
+	}
+	unlink((std::string(directory) + "/data.mdb").c_str());
+	unlink((std::string(directory) + "/lock.mdb").c_str());
+	rmdir(directory);
+	return 0;
+}
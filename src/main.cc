@@ -17,9 +17,15 @@
 
 #include <err.h>
 #include <errno.h>
+#include <signal.h>
 #include <syslog.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 #include <cstdlib>
 #include <fstream>
 #include <string>
@@ -32,7 +38,16 @@
 
 // clang-format off
 void print_help() {
-  std::printf("usage: purrito [-abcdefghijklmnpqrstvwxz] -d domain [-a slug_characters]\n"
+  std::printf("usage: purrito [-ABCEGIJKLMNOPRSTUWYZabcdefghijklmnpqrstvwxz] -d domain [-A io_threads]\n"
+              "               [-B rate_burst] [-C cache_size] [-E log_destination]\n"
+              "               [-G commit_interval]\n"
+              "               [-I inline_size] [-J clean_batch_size] [-K session_lifetime]\n"
+              "               [-L log_level]\n"
+              "               [-M metrics_port] [-N commit_batch_size] [-O metrics_ip]\n"
+              "               [-P] [-R rate_limit] [-S storage_levels] [-T ticket_key_file]\n"
+              "               [-U] [-W workers] [-Y upload_timeout]\n"
+              "               [-Z compression_level]\n"
+              "               [-a slug_characters]\n"
               "               [-b max_database_size] [-c public_cert_file] [-e dhparams_file]\n"
               "               [-f index_file] [-g slug_size] [-h] [-i bind_ip]\n"
               "               [-j autoclean_interval] [-k private_key_file] [-l]\n"
@@ -46,21 +61,42 @@ void print_help() {
 int main(int argc, char **argv) {
 	int opt;
 	std::string domain, storage_directory, database_directory,
-	    slug_characters, index_file, server_name;
+	    slug_characters, index_file, metrics_ip, log_destination,
+	    ticket_key_file;
 	std::vector<std::uint_fast16_t> bind_port;
+	std::uint_fast16_t metrics_port;
 	std::map<std::string, std::string> headers;
-	std::vector<std::string> bind_ip, header_names, header_values;
+	std::vector<std::string> bind_ip, header_names, header_values,
+	    server_name_list;
+	std::vector<const char *> cert_files, key_files;
 	std::uint_fast8_t slug_size;
-	std::uint_fast32_t max_retries;
-	bool enable_httpserver, ssl_server;
+	std::uint_fast32_t max_retries, commit_batch_size, clean_batch_size,
+	    rate_limit, rate_burst;
+	unsigned int workers, io_threads, storage_levels;
+	int compression_level, log_level;
+	bool enable_httpserver, ssl_server, pin_workers, dedup;
 	uWS::SocketContextOptions ssl_options;
 	std::string::size_type max_paste_size;
 	std::uint_fast64_t max_database_size, default_time_limit,
-	    autoclean_interval;
+	    autoclean_interval, cache_size, commit_interval, inline_size,
+	    session_lifetime, upload_timeout;
+
+	/*
+	 * the signals are only ever taken by the signal thread, they have to
+	 * be blocked before any other thread is started, to be inherited
+	 */
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGHUP);
+	sigaddset(&signals, SIGQUIT);
+	sigaddset(&signals, SIGUSR1);
+	sigaddset(&signals, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+	/* copies started for a restart which fail are not waited for */
+	signal(SIGCHLD, SIG_IGN);
 
 	/* open syslog with purritobin identity */
 	openlog("purritobin", LOG_PERROR | LOG_PID, LOG_DAEMON);
-	setlogmask (LOG_UPTO (LOG_WARNING));
 	/* we should define the default values for variables not
 	 * considered essential
 	 */
@@ -76,9 +112,28 @@ int main(int argc, char **argv) {
 	ssl_server = false;
 	default_time_limit = 604800;  // 1 week in seconds \o/
 	autoclean_interval = 300;     // 5 mins in seconds
+	workers = 1;
+	cache_size = 0;               // no caching
+	commit_interval = 2000;       // 2 ms in microseconds
+	commit_batch_size = 64;
+	clean_batch_size = 1024;
+	pin_workers = false;
+	dedup = false;
+	inline_size = 0;              // everything goes to files
+	io_threads = 0;               // write from the event loop
+	compression_level = 0;        // store pastes as they are
+	metrics_ip = "127.0.0.1";
+	metrics_port = 0;             // no metrics
+	log_level = LOG_WARNING;
+	log_destination = "syslog";
+	rate_limit = 0;               // no rate limiting
+	rate_burst = 10;
+	storage_levels = 0;           // all pastes in one directory
+	session_lifetime = 3600;      // 1 hour in seconds
+	upload_timeout = 0;           // no resumable uploads
 
 	while ((opt = getopt(argc, argv,
-	                     "a:b:c:d:e:f:g:hi:j:k:lm:n:p:q:r:s:tv:w:x:z:")) !=
+	                     "A:B:C:E:G:I:J:K:L:M:N:O:PR:S:T:UW:Y:Z:a:b:c:d:e:f:g:hi:j:k:lm:n:p:q:r:s:tv:w:x:z:")) !=
 	       EOF)
 		switch (opt) {
 			case 'h':
@@ -110,13 +165,13 @@ int main(int argc, char **argv) {
 				ssl_server = true;
 				break;
 			case 'n':
-				server_name = optarg;
+				server_name_list.push_back(optarg);
 				break;
 			case 'c':
-				ssl_options.cert_file_name = optarg;
+				cert_files.push_back(optarg);
 				break;
 			case 'k':
-				ssl_options.key_file_name = optarg;
+				key_files.push_back(optarg);
 				break;
 			case 'e':
 				ssl_options.dh_params_file_name = optarg;
@@ -152,6 +207,78 @@ int main(int argc, char **argv) {
 			case 'j':
 				autoclean_interval = std::stoull(optarg);
 				break;
+			case 'A':
+				io_threads = std::stoul(optarg);
+				break;
+			case 'B':
+				rate_burst = std::stoul(optarg);
+				if (rate_burst == 0)
+					errx(1, "ERROR: rate burst can't be 0");
+				break;
+			case 'C':
+				cache_size = std::stoull(optarg);
+				break;
+			case 'E':
+				log_destination = optarg;
+				break;
+			case 'G':
+				commit_interval = std::stoull(optarg);
+				break;
+			case 'I':
+				inline_size = std::stoull(optarg);
+				break;
+			case 'J':
+				clean_batch_size = std::stoul(optarg);
+				if (clean_batch_size == 0)
+					errx(1, "ERROR: clean batch size "
+					        "can't be 0");
+				break;
+			case 'K':
+				session_lifetime = std::stoull(optarg);
+				break;
+			case 'L':
+				log_level = purrito_logger::priority(optarg);
+				if (log_level == -1)
+					errx(1, "ERROR: unknown log level: %s",
+					     optarg);
+				break;
+			case 'M':
+				metrics_port = std::stoul(optarg);
+				break;
+			case 'O':
+				metrics_ip = optarg;
+				break;
+			case 'N':
+				commit_batch_size = std::stoul(optarg);
+				break;
+			case 'T':
+				ticket_key_file = optarg;
+				break;
+			case 'U':
+				dedup = true;
+				break;
+			case 'W':
+				workers = std::stoul(optarg);
+				break;
+			case 'Y':
+				upload_timeout = std::stoull(optarg);
+				break;
+			case 'P':
+				pin_workers = true;
+				break;
+			case 'R':
+				rate_limit = std::stoul(optarg);
+				break;
+			case 'S':
+				storage_levels = std::stoul(optarg);
+				break;
+			case 'Z':
+				compression_level = std::stoi(optarg);
+				if (compression_level < 0 ||
+				    compression_level > 9)
+					errx(1, "ERROR: compression level must "
+					        "be between 0 and 9");
+				break;
 			default:
 				print_help();
 				errx(1, "ERROR: incorrect parameters");
@@ -174,13 +301,35 @@ int main(int argc, char **argv) {
 		errx(1, "ERROR: slug character set is empty");
 	}
 
-	if (ssl_server && ((ssl_options.cert_file_name != NULL &&
-	                    strlen(ssl_options.cert_file_name) == 0) ||
-	                   (ssl_options.key_file_name != NULL &&
-	                    strlen(ssl_options.key_file_name) == 0))) {
-		print_help();
-		errx(1,
-		     "ERROR: public certificate or private key not specified");
+	/*
+	 * every server name gets the certificate and key given in the same
+	 * position, the last ones are reused by the names after them
+	 */
+	std::vector<purrito_server_name> server_names;
+	if (ssl_server) {
+		if (cert_files.empty() || key_files.empty() ||
+		    std::any_of(cert_files.begin(), cert_files.end(),
+		                [](auto file) { return strlen(file) == 0; }) ||
+		    std::any_of(key_files.begin(), key_files.end(),
+		                [](auto file) { return strlen(file) == 0; })) {
+			print_help();
+			errx(1, "ERROR: public certificate or private key not "
+			        "specified");
+		}
+		if (server_name_list.empty()) server_name_list.push_back("");
+		if (cert_files.size() > server_name_list.size() ||
+		    key_files.size() > server_name_list.size())
+			errx(1, "ERROR: more certificates or keys than server "
+			        "names");
+		for (std::vector<std::string>::size_type i = 0;
+		     i < server_name_list.size(); i++) {
+			auto options = ssl_options;
+			options.cert_file_name =
+			    cert_files[std::min(i, cert_files.size() - 1)];
+			options.key_file_name =
+			    key_files[std::min(i, key_files.size() - 1)];
+			server_names.push_back({server_name_list[i], options});
+		}
 	}
 
 	/*
@@ -223,6 +372,27 @@ int main(int argc, char **argv) {
 			     "ERROR: could not remove __init__ test file");
 	}
 
+	/* identical pastes are all linked to a single stored copy */
+	if (dedup) {
+		auto dpath = storage_directory + ".dedup";
+		if (mkdir(dpath.c_str(), 0755) != 0 && errno != EEXIST)
+			err(1, "ERROR: could not create deduplication "
+			       "directory");
+	}
+
+	/* unfinished resumable uploads are kept in files of their own */
+	if (upload_timeout != 0) {
+		auto upath = storage_directory + purrito_upload::directory;
+		if (mkdir(upath.c_str(), 0755) != 0 && errno != EEXIST)
+			err(1, "ERROR: could not create uploads directory");
+	}
+
+	/* from here on, log messages are written out by the drain thread */
+	purrito_log_level = log_level;
+	if (!purrito_logger::instance().start(log_destination))
+		err(1, "ERROR: could not open log file: %s",
+		    log_destination.c_str());
+
 #if defined(__OpenBSD__)
 	/* the only directory we need access to is the storage directory */
 	int unveil_err = unveil(storage_directory.c_str(), "rwc");
@@ -241,17 +411,28 @@ int main(int argc, char **argv) {
 	}
 
 	if (ssl_server) {
-		unveil_err = unveil(ssl_options.cert_file_name, "r");
-		if (unveil_err != 0)
-			errx(unveil_err,
-			     "ERROR: could not unveil public certificate file: "
-			     "%s",
-			     ssl_options.cert_file_name);
-		unveil_err = unveil(ssl_options.key_file_name, "r");
-		if (unveil_err != 0)
-			errx(unveil_err,
-			     "ERROR: could not unveil private key file: %s",
-			     ssl_options.key_file_name);
+		for (auto &server : server_names) {
+			unveil_err = unveil(server.options.cert_file_name, "r");
+			if (unveil_err != 0)
+				errx(unveil_err,
+				     "ERROR: could not unveil public "
+				     "certificate file: %s",
+				     server.options.cert_file_name);
+			unveil_err = unveil(server.options.key_file_name, "r");
+			if (unveil_err != 0)
+				errx(unveil_err,
+				     "ERROR: could not unveil private key "
+				     "file: %s",
+				     server.options.key_file_name);
+		}
+		if (!ticket_key_file.empty()) {
+			unveil_err = unveil(ticket_key_file.c_str(), "r");
+			if (unveil_err != 0)
+				errx(unveil_err,
+				     "ERROR: could not unveil ticket key "
+				     "file: %s",
+				     ticket_key_file.c_str());
+		}
 		if (ssl_options.dh_params_file_name != NULL &&
 		    strlen(ssl_options.dh_params_file_name) != 0) {
 			unveil_err =
@@ -294,130 +475,331 @@ int main(int argc, char **argv) {
 	     i < header_names.size(); i++)
 		headers[header_names[i]] = header_values[i];
 
-	syslog(LOG_INFO,
-	       "Starting PurritoBin with settings - "
-	       "{ "
-	       "domain: %s, "
-	       "slug_size: %" PRIuFAST8
-	       ", storage_directory: %s"
-	       ", database_directory: %s"
-	       ", max_paste_size: %" PRIuFAST64
-	       ", max_database_size: %" PRIuFAST64
-	       ", autoclean_interval: %" PRIuFAST64
-	       ", default_time_limit: %" PRIuFAST64
-	       ", max_retries: %" PRIuFAST32 " }",
-	       domain.c_str(), slug_size, storage_directory.c_str(),
-	       database_directory.c_str(), max_paste_size, max_database_size,
-	       autoclean_interval, default_time_limit, max_retries);
+	/* every level takes two characters, some have to be left over */
+	if (2 * storage_levels >= slug_size)
+		errx(1, "ERROR: too many storage levels for the slug size");
+
+	/* zero workers means one event loop per available core */
+	if (workers == 0) workers = std::thread::hardware_concurrency();
+	if (workers == 0) workers = 1;
+
+	PLOG(LOG_INFO,
+	     "Starting PurritoBin with settings - "
+	     "{ "
+	     "domain: %s, "
+	     "slug_size: %" PRIuFAST8
+	     ", storage_directory: %s"
+	     ", database_directory: %s"
+	     ", max_paste_size: %" PRIuFAST64
+	     ", max_database_size: %" PRIuFAST64
+	     ", autoclean_interval: %" PRIuFAST64
+	     ", default_time_limit: %" PRIuFAST64
+	     ", max_retries: %" PRIuFAST32
+	     ", commit_interval: %" PRIuFAST64
+	     ", commit_batch_size: %" PRIuFAST32
+	     ", dedup: %d"
+	     ", inline_size: %" PRIuFAST64
+	     ", cache_size: %" PRIuFAST64
+	     ", io_threads: %u"
+	     ", compression_level: %d"
+	     ", metrics: %s:%" PRIuFAST16
+	     ", rate_limit: %" PRIuFAST32
+	     ", rate_burst: %" PRIuFAST32
+	     ", storage_levels: %u"
+	     ", session_lifetime: %" PRIuFAST64
+	     ", upload_timeout: %" PRIuFAST64
+	     ", workers: %u }",
+	     domain.c_str(), slug_size, storage_directory.c_str(),
+	     database_directory.c_str(), max_paste_size, max_database_size,
+	     autoclean_interval, default_time_limit, max_retries,
+	     commit_interval, commit_batch_size, dedup, inline_size,
+	     cache_size, io_threads, compression_level, metrics_ip.c_str(),
+	     metrics_port, rate_limit, rate_burst, storage_levels,
+	     session_lifetime, upload_timeout, workers);
 
 	/* initialize the settings to be passed to the server */
 	purrito_settings settings(domain, storage_directory, database_directory,
 	                          bind_ip, bind_port, max_paste_size,
 	                          max_database_size, slug_size, slug_characters,
-	                          default_time_limit, headers, ssl_options,
-	                          enable_httpserver, index_file, max_retries);
+	                          default_time_limit, headers, server_names,
+	                          enable_httpserver, index_file, max_retries,
+	                          commit_interval, commit_batch_size, dedup,
+	                          inline_size, cache_size, io_threads,
+	                          compression_level, metrics_ip, metrics_port,
+	                          rate_limit, rate_burst, storage_levels,
+	                          ticket_key_file, session_lifetime,
+	                          upload_timeout);
 
-	/* create the server and start running it */
-	std::thread purrito_thread;
-	if (ssl_server) {
-		syslog(LOG_INFO, "Listening with SSL");
-		purrito_thread = std::thread([&]() {
-			auto purrito = purr<true>(settings);
-			purrito.addServerName(server_name, ssl_options);
-			purrito.run();
-		});
-	} else {
-		syslog(LOG_INFO, "Listening without SSL");
-		purrito_thread = std::thread([&]() {
-			auto purrito = purr<false>(settings);
-			purrito.run();
-		});
+	if (settings.tls) {
+		auto error = settings.tls->load_keys();
+		if (!error.empty())
+			errx(1, "ERROR: %s: %s", error.c_str(),
+			     ticket_key_file.c_str());
 	}
-	auto cleaner = std::thread([&]() {
-		while (1) {
-			syslog(LOG_INFO, "(cleaner) Starting a new run...");
-			auto current_time = time_since_epoch();
-			std::vector<std::string> files_to_clean, timestamps;
-			try {
-				{
-					auto rtxn = lmdb::txn::begin(
-					    settings.env, nullptr, MDB_RDONLY);
-					auto dbi =
-					    lmdb::dbi::open(rtxn, nullptr);
-					std::string_view timestamp, slug;
-					auto cursor =
-					    lmdb::cursor::open(rtxn, dbi);
-					if (cursor.get(timestamp, slug,
-					               MDB_FIRST)) {
-						do {
-							if (timestamp <
-							    current_time) {
-								timestamps
-								    .emplace_back(
-								        timestamp);
-								files_to_clean
-								    .emplace_back(
-								        slug);
-							} else
-								continue;
-						} while (cursor.get(
-						    timestamp, slug, MDB_NEXT));
-					}
+
+	/* the frontend is served from memory, read once up front */
+	if (settings.assets)
+		PLOG(LOG_INFO, "Loaded %zu frontend file(s)",
+		     load_assets(settings));
+
+	/*
+	 * create the servers and start running them, every worker gets its
+	 * own event loop listening on the same addresses, the listen sockets
+	 * are opened with SO_REUSEPORT so the kernel spreads the incoming
+	 * connections over all the workers
+	 */
+	std::vector<std::thread> purrito_threads;
+	std::vector<purrito_worker> worker_handles(workers);
+	std::mutex worker_lock;
+	purrito_handover handover;
+	handover.inherit();
+	std::atomic<unsigned int> started(0), listening(0);
+	PLOG(LOG_INFO, "Listening %s SSL with %u worker(s)",
+	     ssl_server ? "with" : "without", workers);
+	for (unsigned int w = 0; w < workers; w++) {
+		if (ssl_server) {
+			purrito_threads.emplace_back([&, w]() {
+				run_worker<true>(settings, worker_handles[w],
+				                 worker_lock, handover,
+				                 started, listening);
+			});
+		} else {
+			purrito_threads.emplace_back([&, w]() {
+				run_worker<false>(settings, worker_handles[w],
+				                  worker_lock, handover,
+				                  started, listening);
+			});
+		}
+		if (pin_workers) {
+#if defined(__linux__)
+			cpu_set_t cpuset;
+			CPU_ZERO(&cpuset);
+			auto cores =
+			    std::max(1u, std::thread::hardware_concurrency());
+			CPU_SET(w % cores, &cpuset);
+			int pinned = pthread_setaffinity_np(
+			    purrito_threads.back().native_handle(),
+			    sizeof(cpu_set_t), &cpuset);
+			if (pinned != 0)
+				PLOG(LOG_WARNING,
+				     "WARNING: could not pin worker %u - %s",
+				     w, strerror(pinned));
+#else
+			PLOG(LOG_WARNING,
+			     "WARNING: pinning workers is only supported on "
+			     "linux, ignoring");
+			pin_workers = false;
+#endif
+		}
+	}
+	/*
+	 * SIGUSR1 switches between the configured log level and debug
+	 * logging, SIGHUP reloads the frontend files and the certificate,
+	 * SIGUSR2 starts a new copy which takes over the addresses and
+	 * SIGQUIT stops listening and exits once all connections are done
+	 */
+	std::atomic<bool> draining(false);
+	auto on_workers = [&](std::function<void()> purrito_worker::*action) {
+		std::lock_guard<std::mutex> guard(worker_lock);
+		for (auto &worker : worker_handles)
+			if (worker.loop && worker.*action)
+				worker.loop->defer(
+				    [run = worker.*action]() { run(); });
+	};
+	std::thread signal_thread([&]() {
+		int signal_number;
+		while (sigwait(&signals, &signal_number) == 0) {
+			if (signal_number == SIGHUP) {
+				if (settings.assets)
+					PLOG(LOG_NOTICE,
+					     "Reloaded %zu frontend file(s)",
+					     load_assets(settings));
+				if (!ssl_server) continue;
+				if (!ticket_key_file.empty()) {
+					auto error = settings.tls->load_keys();
+					if (!error.empty())
+						PLOG(LOG_WARNING,
+						     "WARNING: keeping the old "
+						     "ticket keys, %s",
+						     error.c_str());
+				}
+				/* a broken one would fail every handshake */
+				std::string error;
+				for (auto &server : server_names) {
+					error = check_certificate(
+					    server.options);
+					if (!error.empty()) break;
+				}
+				if (!error.empty()) {
+					PLOG(LOG_WARNING,
+					     "WARNING: keeping the old "
+					     "certificates, %s",
+					     error.c_str());
+					continue;
 				}
-			} catch (lmdb::error &ex) {
-				syslog(LOG_WARNING,
-				       "(cleaner) Caught an error while "
-				       "cursoring - { %d, %s )",
-				       ex.code(), ex.what());
-			} catch (...) {
+				on_workers(&purrito_worker::reload);
+				PLOG(LOG_NOTICE,
+				     "Reloaded %zu certificate(s)",
+				     server_names.size());
+				continue;
 			}
-			syslog(LOG_INFO,
-			       "(cleaner) Number of pastes to clean = %zu",
-			       files_to_clean.size());
-			for (std::string &paste : files_to_clean)
-				syslog(LOG_INFO, "(cleaner) - %s",
-				       paste.c_str());
-			try {
-				auto wtxn = lmdb::txn::begin(settings.env);
-				auto dbi = lmdb::dbi::open(wtxn, nullptr);
-
-				for (std::size_t i = 0; i < timestamps.size();
-				     i++) {
-					std::string file_path =
-					    settings.storage_directory +
-					    files_to_clean[i];
-					int fd =
-					    open(file_path.c_str(), O_WRONLY);
-					if (fd != -1) {
-						int locked = flock(
-						    fd, LOCK_EX | LOCK_NB);
-						if (locked == -1) {
-							close(fd);
-							continue;
-						} else {
-							close(fd);
-							flock(fd, LOCK_UN);
-						}
-						std::remove(file_path.c_str());
-					}
-					dbi.del(wtxn, timestamps[i]);
+			if (signal_number == SIGQUIT) {
+				if (draining.exchange(true)) continue;
+				PLOG(LOG_NOTICE,
+				     "Draining the open connections...");
+				on_workers(&purrito_worker::drain);
+				continue;
+			}
+			if (signal_number == SIGUSR2) {
+#if defined(__OpenBSD__)
+				PLOG(LOG_WARNING,
+				     "WARNING: restarting is not allowed by "
+				     "the pledge, ignoring");
+#else
+				if (draining) {
+					PLOG(LOG_WARNING,
+					     "WARNING: already draining, "
+					     "not restarting");
+					continue;
 				}
-				wtxn.commit();
-			} catch (lmdb::error &ex) {
-				syslog(LOG_WARNING,
-				       "(cleaner) Caught an error while "
-				       "cleaning - { %d, %s )",
-				       ex.code(), ex.what());
-			} catch (...) {
+				std::vector<int> listen_fds;
+				{
+					std::lock_guard<std::mutex> guard(
+					    worker_lock);
+					for (auto &worker : worker_handles)
+						listen_fds.insert(
+						    listen_fds.end(),
+						    worker.listen_fds.begin(),
+						    worker.listen_fds.end());
+				}
+				pid_t successor =
+				    spawn_successor(argv, listen_fds);
+				if (successor == -1)
+					PLOG(LOG_WARNING,
+					     "WARNING: could not start a new "
+					     "copy - %s",
+					     strerror(errno));
+				else
+					PLOG(LOG_NOTICE,
+					     "Started pid %d to take over",
+					     (int)successor);
+#endif
+				continue;
 			}
-			syslog(LOG_INFO, "(cleaner) Sleeping...");
+			if (signal_number != SIGUSR1) continue;
+			int level = purrito_log_level == LOG_DEBUG ? log_level
+			                                           : LOG_DEBUG;
+			purrito_log_level = level;
+			PLOG(LOG_NOTICE, "Log level changed to %s",
+			     purrito_logger::name(level));
+		}
+	});
+
+	/* the metrics get an event loop of their own */
+	std::thread metrics_thread;
+	if (settings.metrics)
+		metrics_thread =
+		    std::thread([&]() { purr_metrics(settings).run(); });
+
+	/* pastes from before the sharding are moved in the background */
+	std::thread migrator;
+	if (settings.migrating)
+		migrator = std::thread([&]() {
+			PLOG(LOG_INFO, "(migrator) Moving pastes into %u "
+			               "directory levels...",
+			     storage_levels);
+			auto moved = migrate_pastes(settings);
+			PLOG(LOG_INFO, "(migrator) Moved %zu pastes", moved);
+		});
+
+	auto cleaner = std::thread([&]() {
+		while (1) {
+			PLOG(LOG_INFO, "(cleaner) Starting a new run...");
+			auto stats = clean_pastes(settings, clean_batch_size);
+			PLOG(LOG_INFO,
+			     "(cleaner) Cleaned %zu pastes in %zu transactions"
+			     ", backlog of %zu records, took %lld ms",
+			     stats.cleaned, stats.transactions, stats.backlog,
+			     (long long)stats.duration.count());
+			if (settings.metrics) {
+				settings.metrics->cleaner_runs.add();
+				settings.metrics->cleaner_cleaned.add(
+				    stats.cleaned);
+				settings.metrics->cleaner_backlog.set(
+				    stats.backlog);
+				settings.metrics->cleaner_milliseconds.set(
+				    stats.duration.count());
+			}
+			/* anonymous files vanish with the process */
+			if (!settings.anonymous_files) {
+				auto removed = clean_temporary_files(settings);
+				PLOG(LOG_INFO,
+				     "(cleaner) Removed %zu stale temporary "
+				     "files",
+				     removed);
+			}
+			if (settings.dedup) {
+				auto removed = clean_dedup(settings);
+				PLOG(LOG_INFO,
+				     "(cleaner) Removing %zu unreferenced "
+				     "deduplicated copies",
+				     removed);
+			}
+			if (settings.upload_timeout != 0) {
+				auto removed = clean_uploads(settings);
+				PLOG(LOG_INFO,
+				     "(cleaner) Removed %zu abandoned uploads",
+				     removed);
+			}
+			if (settings.cache)
+				PLOG(LOG_INFO,
+				     "(cleaner) Cache hits = %" PRIuFAST64
+				     ", misses = %" PRIuFAST64,
+				     settings.cache->hits.load(),
+				     settings.cache->misses.load());
+			PLOG(LOG_INFO, "(cleaner) Sleeping...");
 			std::this_thread::sleep_for(
 			    std::chrono::seconds(autoclean_interval));
 		}
 	});
-	cleaner.join();
-	purrito_thread.join();
 
-	/* it should not be possible to reach here */
-	return 0;
+	/*
+	 * once all the workers listen, the service manager is told that it
+	 * is ready, while a copy started for a restart takes over, by
+	 * telling it that it is the main process now and asking the one
+	 * which started it to drain
+	 */
+	while (started < workers)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	handover.close_rest();
+	auto parent = std::getenv("PURRITO_PARENT_PID");
+	if (parent == nullptr)
+		notify_service("READY=1");
+	else {
+		pid_t parent_pid = std::atoi(parent);
+		if (listening == workers && parent_pid == getppid()) {
+			PLOG(LOG_NOTICE, "Taking over from pid %d",
+			     (int)parent_pid);
+			notify_service("MAINPID=" + std::to_string(getpid()) +
+			               "\nREADY=1");
+			kill(parent_pid, SIGQUIT);
+		} else
+			PLOG(LOG_WARNING,
+			     "WARNING: not listening on all addresses, "
+			     "leaving pid %d running",
+			     (int)parent_pid);
+	}
+
+	/* the workers only stop once drained, or if they could not listen */
+	for (auto &purrito_thread : purrito_threads) purrito_thread.join();
+	if (!draining)
+		PLOG(LOG_ERR, "ERROR: all the workers stopped, exiting");
+	else
+		PLOG(LOG_NOTICE, "All connections are done, exiting");
+	purrito_logger::instance().stop();
+	/*
+	 * the other threads never stop on their own, nothing is lost with
+	 * them, as every paste is only answered once it is committed
+	 */
+	std::_Exit(draining ? 0 : 1);
 }
@@ -18,36 +18,76 @@
 #ifndef _PURRITO
 #define _PURRITO
 
-#if __has_include(<sys/file.h>)
-#include <sys/file.h>
-#endif
-
 #if __has_include(<sys/stat.h>)
 #include <sys/stat.h>
 #endif
 
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <lmdb++.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <strings.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <syslog.h>
 #include <uWebSockets/App.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
 #include <charconv>
 #include <chrono>
 #include <cinttypes>
+#include <cstddef>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <ctime>
 #include <fstream>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <random>
 #include <set>
 #include <sstream>
 #include <string>
 #include <system_error>
+#include <thread>
 #include <vector>
 
+#include "purrito_assets.h"
+#include "purrito_cache.h"
+#include "purrito_gzip.h"
+#include "purrito_io.h"
+#include "purrito_limit.h"
+#include "purrito_log.h"
+#include "purrito_metrics.h"
+#include "purrito_records.h"
+#include "purrito_slugs.h"
+#include "purrito_tls.h"
+#include "purrito_writer.h"
+
+/*
+ * whether new pastes can be written to anonymous files in the storage
+ * directory and linked into it once complete, see purrito_paste_file
+ */
+bool purrito_anonymous_files(const std::string &);
+
+/*
+ * a name served over TLS, with the certificate it is served with
+ */
+struct purrito_server_name {
+	std::string name;
+	uWS::SocketContextOptions options;
+};
+
 class purrito_settings {
        public:
 	/*
@@ -131,13 +171,14 @@ class purrito_settings {
 
 	/*
 	 * DEFAULT: {}
-	 * ssl options for https listener
+	 * names served by the https listener, each with its own
+	 * ssl options
 	 * - cert
 	 * - key
 	 * - dhparam
 	 * - passphrase
 	 */
-	const uWS::SocketContextOptions ssl_options;
+	const std::vector<purrito_server_name> server_names;
 
 	/*
 	 * DEFAULT: false
@@ -157,12 +198,177 @@ class purrito_settings {
 	 */
 	const std::uint_fast32_t max_retries;
 
+	/*
+	 * DEFAULT: 2000
+	 * longest time an expiry record waits for others to be
+	 * committed together with, in microseconds
+	 */
+	const std::uint_fast64_t commit_interval;
+
+	/*
+	 * DEFAULT: 64
+	 * number of pending expiry records which triggers a commit
+	 * without waiting for the rest of the commit interval
+	 */
+	const std::uint_fast32_t commit_batch_size;
+
+	/*
+	 * DEFAULT: false
+	 * store identical pastes only once, linking all of
+	 * them to a single copy kept in the .dedup directory
+	 */
+	const bool dedup;
+
+	/*
+	 * DEFAULT: 0
+	 * pastes up to this size in BYTES are stored inline in
+	 * the database instead of as files, 0 disables it
+	 */
+	const std::uint_fast64_t inline_size;
+
+	/*
+	 * DEFAULT: 0
+	 * gzip level with which paste files are compressed, from 1
+	 * to 9, 0 stores them as they are
+	 */
+	const int compression_level;
+
+	/*
+	 * DEFAULT: 127.0.0.1
+	 * IP on which the metrics listener accepts connections
+	 */
+	const std::string metrics_ip;
+
+	/*
+	 * DEFAULT: 0
+	 * port of the metrics listener, 0 disables the metrics
+	 */
+	const std::uint_fast16_t metrics_port;
+
+	/*
+	 * DEFAULT: 0
+	 * pastes a single client is allowed to send every
+	 * minute, 0 disables the rate limiting
+	 */
+	const std::uint_fast32_t rate_limit;
+
+	/*
+	 * DEFAULT: 10
+	 * pastes a client is allowed to send in a burst, before
+	 * the rate limit applies
+	 */
+	const std::uint_fast32_t rate_burst;
+
+	/*
+	 * DEFAULT: 0
+	 * number of directory levels pastes are sharded into, each
+	 * named after the next two characters of the slug, e.g. with
+	 * 2 the paste abcdxyz is stored as ab/cd/abcdxyz, 0 keeps
+	 * all of them directly in the storage directory
+	 */
+	const unsigned int storage_levels;
+
+	/*
+	 * DEFAULT: ""
+	 * file with the keys session tickets are encrypted with,
+	 * made up at start and rotated when empty
+	 */
+	const std::string ticket_key_file;
+
+	/*
+	 * DEFAULT: 3600
+	 * seconds a TLS session can be resumed for, 0 to always
+	 * do a full handshake
+	 */
+	const std::uint_fast64_t session_lifetime;
+
+	/*
+	 * DEFAULT: 0
+	 * seconds an unfinished resumable upload is kept after
+	 * data was last added to it, 0 disables them
+	 */
+	const std::uint_fast64_t upload_timeout;
+
 	///////
+	/*
+	 * DEFAULT: nullptr
+	 * in memory cache of recently served pastes, only
+	 * created when a non zero cache size is given
+	 */
+	const std::unique_ptr<purrito_cache> cache;
+
+	/*
+	 * DEFAULT: nullptr
+	 * asynchronous writer for paste files, only created when
+	 * a non zero number of io threads is given
+	 */
+	const std::unique_ptr<purrito_io> io;
+
+	/*
+	 * DEFAULT: nullptr
+	 * counters and histograms for the metrics listener, only
+	 * created when it is enabled
+	 */
+	const std::unique_ptr<purrito_metrics> metrics;
+
+	/*
+	 * DEFAULT: nullptr
+	 * frontend files served from memory, only created when
+	 * the http server is enabled, loaded by load_assets
+	 */
+	const std::unique_ptr<purrito_assets> assets;
+
+	/*
+	 * DEFAULT: nullptr
+	 * session tickets and cache shared by the workers, only
+	 * created when there are names served over TLS
+	 */
+	const std::unique_ptr<purrito_tls> tls;
+
+	/*
+	 * number of clients the rate limiter keeps track of at
+	 * once, in slots of 32 bytes
+	 */
+	static constexpr std::size_t rate_clients = 65536;
+
+	/*
+	 * DEFAULT: nullptr
+	 * token buckets of the clients, only created when a
+	 * non zero rate limit is given
+	 */
+	const std::unique_ptr<purrito_rate_limiter> limiter;
+
+	/*
+	 * new paste files are anonymous until they are complete,
+	 * probed once at startup
+	 */
+	const bool anonymous_files;
+
+	/*
+	 * pastes are still being moved from the flat layout into the
+	 * sharded one, until then they are also looked up in the flat
+	 * one, and moving and cleaning them is serialized by the lock
+	 */
+	mutable std::atomic<bool> migrating;
+	mutable std::mutex migration_lock;
+
 	/*
 	 * environment for opening the LMDB database
 	 */
 	lmdb::env env;
 
+	/*
+	 * allocator of new slugs, keeping its state in the database
+	 */
+	std::unique_ptr<purrito_slug_allocator> slugs;
+
+	/*
+	 * group commit writer for the expiry records
+	 * NOTE: declared after the environment, so that it is
+	 *       stopped before the environment is closed
+	 */
+	std::unique_ptr<purrito_expiry_writer> writer;
+
 	purrito_settings(const std::string &domain,
 	                 const std::string &storage_directory,
 	                 const std::string &database_directory,
@@ -174,10 +380,25 @@ class purrito_settings {
 	                 const std::string &slug_characters,
 	                 const std::uint_fast64_t &default_time_limit,
 	                 const std::map<std::string, std::string> &headers,
-	                 const uWS::SocketContextOptions ssl_options,
+	                 const std::vector<purrito_server_name> &server_names,
 	                 const bool enable_httpserver,
 	                 const std::string index_file,
-	                 const std::uint_fast32_t max_retries)
+	                 const std::uint_fast32_t max_retries,
+	                 const std::uint_fast64_t commit_interval,
+	                 const std::uint_fast32_t commit_batch_size,
+	                 const bool dedup,
+	                 const std::uint_fast64_t inline_size,
+	                 const std::uint_fast64_t cache_size,
+	                 const unsigned int io_threads,
+	                 const int compression_level,
+	                 const std::string &metrics_ip,
+	                 const std::uint_fast16_t metrics_port,
+	                 const std::uint_fast32_t rate_limit,
+	                 const std::uint_fast32_t rate_burst,
+	                 const unsigned int storage_levels,
+	                 const std::string &ticket_key_file,
+	                 const std::uint_fast64_t session_lifetime,
+	                 const std::uint_fast64_t upload_timeout)
 	    : domain(domain),
 	      storage_directory(storage_directory),
 	      database_directory(database_directory),
@@ -189,17 +410,69 @@ class purrito_settings {
 	      slug_characters(slug_characters),
 	      default_time_limit(default_time_limit),
 	      headers(headers),
-	      ssl_options(ssl_options),
+	      server_names(server_names),
 	      enable_httpserver(enable_httpserver),
 	      index_file(index_file),
 	      max_retries(max_retries),
+	      commit_interval(commit_interval),
+	      commit_batch_size(commit_batch_size),
+	      dedup(dedup),
+	      inline_size(inline_size),
+	      compression_level(compression_level),
+	      metrics_ip(metrics_ip),
+	      metrics_port(metrics_port),
+	      rate_limit(rate_limit),
+	      rate_burst(rate_burst),
+	      storage_levels(storage_levels),
+	      ticket_key_file(ticket_key_file),
+	      session_lifetime(session_lifetime),
+	      upload_timeout(upload_timeout),
+	      cache(cache_size != 0
+	                ? std::make_unique<purrito_cache>(cache_size)
+	                : nullptr),
+	      io(io_threads != 0 ? std::make_unique<purrito_io>(io_threads)
+	                         : nullptr),
+	      metrics(metrics_port != 0 ? std::make_unique<purrito_metrics>()
+	                                : nullptr),
+	      assets(enable_httpserver ? std::make_unique<purrito_assets>()
+	                               : nullptr),
+	      tls(!server_names.empty() ? std::make_unique<purrito_tls>(
+	                                      ticket_key_file, session_lifetime)
+	                                : nullptr),
+	      limiter(rate_limit != 0 ? std::make_unique<purrito_rate_limiter>(
+	                                    rate_limit / 60.0, rate_burst,
+	                                    rate_clients)
+	                              : nullptr),
+	      anonymous_files(purrito_anonymous_files(storage_directory)),
+	      migrating(storage_levels != 0),
 	      env(lmdb::env::create()) {
 		env.set_mapsize(max_database_size);
+		env.set_max_dbs(8);
 		unsigned int env_flags = 0;
 #if defined(__OpenBSD__)
 		env_flags = MDB_WRITEMAP;
 #endif
 		env.open(database_directory.c_str(), env_flags, 0640);
+		/* create all the named databases up front */
+		{
+			auto wtxn = lmdb::txn::begin(env);
+			for (auto name : {"dedup", "dedup_slugs", "expiry",
+			                  "meta", "pastes", "slugs", "uploads"})
+				lmdb::dbi::open(wtxn, name, MDB_CREATE);
+			wtxn.commit();
+		}
+		/* databases written by older versions, converted once */
+		auto converted = migrate_expiry_records(env, 10000);
+		if (converted != 0)
+			PLOG(LOG_NOTICE, "Converted %zu old expiry records",
+			     converted);
+		slugs = std::make_unique<purrito_slug_allocator>(
+		    env, slug_characters, slug_size);
+		writer = std::make_unique<purrito_expiry_writer>(
+		    env, std::chrono::microseconds(commit_interval),
+		    commit_batch_size,
+		    metrics ? &metrics->commit_seconds : nullptr);
+		slugs->reserve_ahead(writer.get());
 	}
 };
 
@@ -209,18 +482,133 @@ class purrito_settings {
  * https://github.com/uNetworking/uWebSockets
  */
 template <bool SSL>
-uWS::TemplatedApp<SSL> purr(const purrito_settings &);
+uWS::TemplatedApp<SSL> purr(const purrito_settings &,
+                            std::vector<us_listen_socket_t *> &);
+
+/*
+ * a running worker event loop, with what the signal thread can ask of
+ * it, always to be deferred onto the loop itself
+ * NOTE: only set while the loop runs, so it has to be looked at with
+ *       the lock of the workers held
+ */
+struct purrito_worker {
+	uWS::Loop *loop = nullptr;
+	/* read the certificates and keys again, nothing without TLS */
+	std::function<void()> reload;
+	/* stop listening, the loop ends once its connections are done */
+	std::function<void()> drain;
+	/* the descriptors of the listen sockets, handed to a new copy */
+	std::vector<int> listen_fds;
+};
+
+/*
+ * the listen sockets a new copy was handed by the one which started
+ * it, in PURRITO_LISTEN_FDS, for its workers to take over, so that the
+ * connections waiting to be accepted on them are not lost
+ */
+struct purrito_handover {
+	std::mutex lock;
+	std::vector<int> fds;
+
+	/* read the descriptors from the environment, none without it */
+	void inherit();
+	/*
+	 * swap the socket of a worker for an inherited one listening on the
+	 * same address, has to be called from the loop of the worker
+	 * returns whether there was one
+	 */
+	bool adopt(us_listen_socket_t *);
+	/* close the ones no worker took, which would only queue up */
+	void close_rest();
+};
+
+/*
+ * run a worker until it is drained, or it fails to listen
+ * the number of workers which got as far as listening, and of those
+ * which listen on all the addresses, are counted up once it does
+ */
+template <bool SSL>
+void run_worker(const purrito_settings &, purrito_worker &, std::mutex &,
+                purrito_handover &, std::atomic<unsigned int> &,
+                std::atomic<unsigned int> &);
+
+/*
+ * check that the certificate and private key can be loaded and belong
+ * together, before the workers are asked to switch to them
+ * returns the error, empty if there is none
+ */
+std::string check_certificate(const uWS::SocketContextOptions &);
+
+/*
+ * start a new copy of the server with the same arguments, told the pid
+ * of this one in PURRITO_PARENT_PID, so that it can ask this one to
+ * drain once it is listening as well, and handed the listen sockets
+ * returns the pid of the copy, -1 if it could not be started
+ */
+pid_t spawn_successor(char **, const std::vector<int> &);
+
+/*
+ * tell the service manager about the state, in the sd_notify(3)
+ * protocol, nothing if it did not ask for it with NOTIFY_SOCKET
+ */
+void notify_service(const std::string &);
+
+/*
+ * the listener for the metrics, answering GET /metrics with all the
+ * counters and histograms in the prometheus text format
+ */
+uWS::App purr_metrics(const purrito_settings &);
 
 /*
  * high precision timer and random number generator
  * see: https://codeforces.com/blog/entry/61587
- * it is also thread safe, so useful for async
+ * NOTE: the generator is thread local, so every worker event loop
+ *       gets its own independently seeded copy and never races
+ */
+thread_local std::mt19937_64 rng(
+    std::chrono::system_clock::now().time_since_epoch().count() ^
+    std::hash<std::thread::id>{}(std::this_thread::get_id()));
+
+/*
+ * incremental SHA-256 of a paste, fed chunk by chunk as it streams in
  */
-std::mt19937_64 rng(
-    std::chrono::system_clock::now().time_since_epoch().count());
+class purrito_hash {
+       public:
+	purrito_hash() : ctx(EVP_MD_CTX_new()) {
+		if (!ctx || !EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr))
+			throw std::runtime_error("could not initialize sha256");
+	}
+	~purrito_hash() { EVP_MD_CTX_free(ctx); }
+	purrito_hash(const purrito_hash &) = delete;
+	purrito_hash &operator=(const purrito_hash &) = delete;
+
+	void update(const std::string_view &chunk) {
+		EVP_DigestUpdate(ctx, chunk.data(), chunk.size());
+	}
 
-/* generate a random slug of required length */
-std::string random_slug(const std::string &, const std::string::size_type &);
+	/* the raw digest, the hash can not be updated afterwards */
+	std::string final() {
+		unsigned char md[EVP_MAX_MD_SIZE];
+		unsigned int md_size = 0;
+		EVP_DigestFinal_ex(ctx, md, &md_size);
+		return std::string(reinterpret_cast<char *>(md), md_size);
+	}
+
+	/* printable form of a raw digest */
+	static std::string hex(const std::string &digest) {
+		static const char digits[] = "0123456789abcdef";
+		std::string hexed(2 * digest.size(), '0');
+		for (std::string::size_type i = 0; i < digest.size(); i++) {
+			hexed[2 * i] = digits[(unsigned char)digest[i] >> 4];
+			hexed[2 * i + 1] =
+			    digits[(unsigned char)digest[i] & 15];
+		}
+		return hexed;
+	}
+
+       private:
+	EVP_MD_CTX *ctx;
+};
 
 /*
  * time utilities
@@ -230,321 +618,3541 @@ inline bool is_delay(const std::string_view &delay) {
 }
 
 /*
- * return number of nanoseconds since epoch
+ * path of a paste file in the storage directory, in the sharded layout
+ * pastes go into the directories named after the first characters of
+ * their slug, anything which is not a paste stays at the top
  */
-inline std::string time_since_epoch(const std::uint_fast64_t delay = 0) {
-	std::string timestamp = std::to_string(
-	    std::chrono::duration_cast<std::chrono::nanoseconds>(
-	        std::chrono::system_clock::now().time_since_epoch())
-	        .count() +
-	    delay);
-	std::string padding(25 - timestamp.length(), '0');
-	return padding + timestamp;
-}
+std::string paste_path(const purrito_settings &, const std::string &);
+
+/*
+ * create the missing directories of a path in the storage directory,
+ * returns false if one of them could not be created
+ */
+bool make_directories(const purrito_settings &, const std::string &);
+
+/*
+ * move all the pastes still in the flat layout into the sharded one
+ * a paste is first linked at its new path and only then unlinked from
+ * the old one, so while this runs readers look at the flat path first,
+ * and if it is gone the paste is already at its new path
+ * returns the number of pastes moved
+ */
+std::size_t migrate_pastes(const purrito_settings &);
+
+/*
+ * a paste being sent back to a client, either from memory or read in
+ * fixed size chunks from its file
+ */
+class purrito_paste_stream {
+       public:
+	/*
+	 * size of the chunks read from the file on every write
+	 */
+	static constexpr std::uint_fast64_t chunk_size = 65536;
+
+	int fd;
+	std::uint_fast64_t size;
+	std::shared_ptr<const std::string> data;
+	std::string buffer;
+	/* the paste is stored gzip compressed */
+	bool gzip;
+	/* modification time of the file, the validators are made from it */
+	struct timespec modified;
+	/* part of the paste being sent, all of it unless a range is asked */
+	std::uint_fast64_t offset, length;
+	purrito_paste_stream(std::shared_ptr<const std::string> data,
+	                     const bool gzip, const struct timespec &modified)
+	    : fd(-1),
+	      size(data->size()),
+	      data(std::move(data)),
+	      gzip(gzip),
+	      modified(modified),
+	      offset(0),
+	      length(size) {}
+	purrito_paste_stream(const int fd, const std::uint_fast64_t size,
+	                     const bool gzip, const struct timespec &modified)
+	    : fd(fd),
+	      size(size),
+	      gzip(gzip),
+	      modified(modified),
+	      offset(0),
+	      length(size) {
+		buffer.resize(std::min(size, chunk_size));
+	}
+	~purrito_paste_stream() {
+		if (fd != -1) close(fd);
+	}
+
+	/*
+	 * the part of the paste starting at the given offset, empty if
+	 * the offset is past the end or the file could not be read
+	 */
+	std::string_view chunk(const std::uint_fast64_t offset) {
+		if (offset >= size) return {};
+		if (data) return std::string_view(*data).substr(offset);
+		ssize_t r = pread(fd, &buffer[0],
+		                  std::min(size - offset, chunk_size), offset);
+		if (r <= 0) return {};
+		return std::string_view(buffer.data(), r);
+	}
+};
 
-/* simplified random file wrapper which locks and throws exceptions */
+/*
+ * the file of a paste being received, written through a single descriptor
+ * and only published under its slug once it is complete, so readers and
+ * the cleaner never see a partial paste and nothing has to be locked
+ * where the system supports it the file is anonymous, O_TMPFILE on Linux,
+ * so an aborted upload leaves nothing behind, elsewhere it is written
+ * under a hidden temporary name, which is removed if it is aborted
+ */
 class purrito_paste_file {
        public:
+	/* suffix of the files holding gzip compressed pastes */
+	static constexpr const char *gzip_suffix = ".gz";
+	/* prefix of the temporary files, without anonymous files */
+	static constexpr const char *temporary_prefix = ".upload.";
+	/*
+	 * seconds after which a temporary file nothing was written to is
+	 * taken to be left over from a crash
+	 */
+	static constexpr std::time_t stale_after = 3600;
+
 	int fd;
 	std::string slug;
+	/* the name the file is published under */
 	std::string file_path;
-	std::FILE *file;
 	bool to_remove;
 	purrito_paste_file(const purrito_settings &settings)
-	    : to_remove(false) {
-		slug =
-		    random_slug(settings.slug_characters, settings.slug_size);
-		std::uint_fast32_t retries = 0;
-		for (; retries < settings.max_retries;
-		     retries++, slug = random_slug(settings.slug_characters,
-		                                   settings.slug_size)) {
-			file_path = settings.storage_directory + slug;
-			fd =
-			    open(file_path.c_str(), O_WRONLY | O_CREAT | O_EXCL,
-			         S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-			if (fd == -1) continue;
-			int locked = flock(fd, LOCK_EX | LOCK_NB);
-			if (locked == -1) {
-				close(fd);
-				continue;
-			} else {
-				file = std::fopen(file_path.c_str(), "w");
-				if (!file) {
-					flock(fd, LOCK_UN);
-					close(fd);
-					std::remove(file_path.c_str());
-					continue;
-				}
-				break;
-			}
+	    : to_remove(false),
+	      anonymous(settings.anonymous_files),
+	      published(false) {
+		name(settings);
+#if defined(O_TMPFILE)
+		if (anonymous)
+			fd = open(settings.storage_directory.c_str(),
+			          O_TMPFILE | O_WRONLY,
+			          S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+		else
+#endif
+		{
+			temporary_path = settings.storage_directory +
+			                 temporary_prefix + slug;
+			fd = open(temporary_path.c_str(),
+			          O_WRONLY | O_CREAT | O_EXCL,
+			          S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
 		}
-		if (retries == settings.max_retries) {
+		if (fd == -1)
 			throw std::system_error(std::make_error_code(
 			    static_cast<std::errc>(errno)));
-		}
 	}
-	~purrito_paste_file() {
-		std::fclose(file);
-		flock(fd, LOCK_UN);
-		close(fd);
-		if (to_remove) std::remove(file_path.c_str());
+	/*
+	 * take over a complete file written elsewhere in the storage
+	 * directory, it is only linked under the slug and stays where it
+	 * is, its owner removes it
+	 */
+	purrito_paste_file(const purrito_settings &settings,
+	                   const std::string &source)
+	    : fd(-1),
+	      to_remove(false),
+	      anonymous(false),
+	      published(false),
+	      adopted(true),
+	      temporary_path(source) {
+		name(settings);
+		/* it is served like any other paste */
+		if (chmod(source.c_str(),
+		          S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) != 0)
+			throw std::system_error(std::make_error_code(
+			    static_cast<std::errc>(errno)));
 	}
-};
-
-/*
- * read data in a registered call back function
- */
-template <bool SSL>
-void read_paste(const purrito_settings &, const std::uint_fast64_t,
-                const std::uint_fast64_t, std::shared_ptr<purrito_paste_file>,
-                uWS::HttpResponse<SSL> *);
 
-/******************************************************************************/
+	/*
+	 * reserve the space of a paste of known size up front, in one
+	 * extent where the filesystem can, on Linux without changing the
+	 * size of the file, failing only loses the optimization
+	 * NOTE: not every system has posix_fallocate, e.g. OpenBSD
+	 */
+	void preallocate(const std::uint_fast64_t size) {
+#if defined(__linux__)
+		(void)fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size);
+#elif defined(__FreeBSD__) || defined(__NetBSD__)
+		(void)posix_fallocate(fd, 0, size);
+#else
+		(void)size;
+#endif
+	}
 
-template <bool SSL>
-uWS::TemplatedApp<SSL> purr(const purrito_settings &settings) {
-	/* create a standard non tls app to listen for requests */
-	auto purrito = uWS::TemplatedApp<SSL>();
-	purrito.post(
-	    "/*",
-	    /* specifically ignoring the request parameter, as c++ is dumb */
-	    [&](auto *res, auto *req) {
-		    /* Log that we are getting a connection */
-		    auto paste_ip = std::string(res->getRemoteAddressAsText());
-		    std::uint_fast64_t session_id = rng();
-		    syslog(
-		        LOG_INFO,
-		        "(%s) Got a POST connection - session id (%" PRIuFAST64
-		        ")",
-		        paste_ip.c_str(), session_id);
+	/*
+	 * give the complete file its name, new slugs never collide, but
+	 * one can still be taken by a paste from an earlier configuration
+	 * of the slugs, then a new one is tried, throws if it fails
+	 */
+	void publish(const purrito_settings &settings) {
+		std::uint_fast32_t retries = 0;
+		/* path the directories were last made for, once per slug */
+		std::string created;
+		while (link_to(file_path) != 0) {
+			/* the first paste of its shard creates the directory */
+			if (errno == ENOENT && created != file_path &&
+			    settings.storage_levels != 0) {
+				created = file_path;
+				if (make_directories(settings, file_path))
+					continue;
+			}
+			if (errno != EEXIST ||
+			    ++retries == settings.max_retries)
+				throw std::system_error(std::make_error_code(
+				    static_cast<std::errc>(errno)));
+			name(settings);
+		}
+		if (settings.metrics && retries != 0)
+			settings.metrics->slug_retries.add(retries);
+		if (!anonymous && !adopted) unlink(temporary_path.c_str());
+		published = true;
+	}
 
-		    std::shared_ptr<purrito_paste_file> pfile;
-		    /* first give the abort handler */
-		    res->onAborted([=]() {
-			    if (pfile) pfile->to_remove = true;
-			    syslog(LOG_WARNING,
-			           "(%" PRIuFAST64
-			           ") WARNING: Request was prematurely aborted",
-			           session_id);
-		    });
-		    std::uint_fast64_t delay = settings.default_time_limit;
-		    {
-			    auto url_ = req->getUrl();
-			    auto delay_ =
-			        url_.substr(url_.find_last_of("/") + 1);
-			    if (is_delay(delay_)) {
-				    std::from_chars(
-				        delay_.data(),
-				        delay_.data() + delay_.size(), delay);
-				    delay *=
-				        (unsigned long long)1000000000 * 60;
-			    } else if (delay_ == "day")
-				    delay = (unsigned long long)86400000000000;
-			    else if (delay_ == "week")
-				    delay = (unsigned long long)604800000000000;
-			    else if (delay_ == "month")
-				    delay =
-				        (unsigned long long)18144000000000000;
-		    }
-		    syslog(LOG_INFO,
-		           "(%" PRIuFAST64 ") Paste lifetime = %" PRIuFAST64
-		           "ns",
-		           session_id, delay);
-		    try {
-			    pfile =
-			        std::make_shared<purrito_paste_file>(settings);
-		    } catch (std::system_error &ex) {
-			    syslog(LOG_WARNING,
-			           "(%" PRIuFAST64
-			           ") WARNING: Could not generate file - %s",
-			           session_id, ex.what());
-			    res->close();
-			    return;
-		    }
+	~purrito_paste_file() {
+		if (fd != -1) close(fd);
+		if (!published) {
+			if (!anonymous && !adopted)
+				unlink(temporary_path.c_str());
+		} else if (to_remove)
+			unlink(file_path.c_str());
+	}
 
-		    for (auto it : settings.headers)
-			    res->writeHeader(it.first, it.second);
+       private:
+	const bool anonymous;
+	bool published;
+	const bool adopted = false;
+	std::string temporary_path;
 
-		    res->cork([&, delay, session_id, pfile]() {
-			    read_paste<SSL>(settings, delay, session_id, pfile,
-			                    res);
-		    });
-	    });
-	if (settings.enable_httpserver)
-		purrito.get("/*", [&](auto *res, auto *req) {
-			std::string paste_filename(req->getUrl()), paste_data;
-			/* Log that we are getting a connection */
-			auto paste_ip =
-			    std::string(res->getRemoteAddressAsText());
-			std::uint_fast64_t session_id = rng();
-			syslog(LOG_INFO,
-			       "(%s) Got a GET connection {%s} - session id "
-			       "(%" PRIuFAST64 ")",
-			       paste_ip.c_str(), paste_filename.c_str(),
-			       session_id);
-			/*
-			 * attach a standard abort handler, in case something
-			 * goes wrong
-			 */
-			res->onAborted([=]() {
-				syslog(LOG_WARNING,
-				       "(%" PRIuFAST64
-				       ") WARNING: Request was prematurely "
-				       "aborted",
-				       session_id);
-			});
+	void name(const purrito_settings &settings) {
+		slug = settings.slugs->next();
+		file_path = paste_path(settings, settings.compression_level != 0
+		                                     ? slug + gzip_suffix
+		                                     : slug);
+	}
 
-			if (paste_filename.size() <= 1)
-				paste_filename = "/" + settings.index_file;
-
-			paste_filename =
-			    settings.storage_directory +
-			    paste_filename.substr(
-			        paste_filename.find_last_of("/") + 1);
-
-			std::ifstream paste_stream(
-			    paste_filename, std::ios::in | std::ios::binary);
-			if (!paste_stream) {
-				res->writeStatus("404 Not Found");
-			} else {
-				paste_stream.seekg(0, std::ios::end);
-				paste_data.resize(paste_stream.tellg());
-				paste_stream.seekg(0, std::ios::beg);
-				paste_stream.read(&paste_data[0],
-				                  paste_data.size());
-				paste_stream.close();
-			}
-			for (auto it : settings.headers)
-				res->writeHeader(it.first, it.second);
-			res->write(paste_data);
-			res->end();
-		});
-	for (std::vector<std::uint_fast16_t>::size_type i = 0;
-	     i < settings.bind_ip.size(); i++) {
-		purrito.listen(
-		    settings.bind_ip[i], settings.bind_port[i],
-		    [&](auto *listenSocket) {
-			    if (listenSocket) {
-				    syslog(LOG_INFO,
-				           "Listening for connections "
-				           "on %s:%" PRIuFAST16 "...",
-				           settings.bind_ip[i].c_str(),
-				           settings.bind_port[i]);
-			    } else {
-				    syslog(LOG_WARNING,
-				           "WARNING: Failed to listen on "
-				           "%s:%" PRIuFAST16 "!!!",
-				           settings.bind_ip[i].c_str(),
-				           settings.bind_port[i]);
-			    }
-		    });
+	int link_to(const std::string &path) {
+		if (!anonymous)
+			return link(temporary_path.c_str(), path.c_str());
+		/* linking the descriptor itself needs CAP_DAC_READ_SEARCH */
+		char fd_path[32];
+		std::snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+		return linkat(AT_FDCWD, fd_path, AT_FDCWD, path.c_str(),
+		              AT_SYMLINK_FOLLOW);
 	}
-	return purrito;
-}
+};
 
-/******************************************************************************/
+bool purrito_anonymous_files(const std::string &storage_directory) {
+#if defined(O_TMPFILE)
+	int fd = open(storage_directory.c_str(), O_TMPFILE | O_WRONLY,
+	              S_IRUSR | S_IWUSR);
+	if (fd == -1) return false;
+	char fd_path[32];
+	std::snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+	std::string probe = storage_directory +
+	                    purrito_paste_file::temporary_prefix + "probe." +
+	                    std::to_string(getpid());
+	bool linked = linkat(AT_FDCWD, fd_path, AT_FDCWD, probe.c_str(),
+	                     AT_SYMLINK_FOLLOW) == 0;
+	close(fd);
+	if (linked) unlink(probe.c_str());
+	return linked;
+#else
+	(void)storage_directory;
+	return false;
+#endif
+}
 
 /*
- * process the request
+ * a paste being received, small pastes are kept in memory to be stored
+ * inline in the database, and once a paste grows past the inline size it
+ * is moved to a file in the storage directory
  */
-template <bool SSL>
-void read_paste(const purrito_settings &settings,
-                const std::uint_fast64_t delay,
-                const std::uint_fast64_t session_id,
-                std::shared_ptr<purrito_paste_file> pfile,
-                uWS::HttpResponse<SSL> *res) {
-	/* calculate the correct number of characters allowed in the paste */
-	uint_fast64_t max_chars = settings.max_paste_size;
-
-	/* keep a counter on how much was already read */
-	auto read_count = std::make_unique<std::uint_fast64_t>(0);
-
-	/* get the paste_url */
-	std::unique_ptr<std::string> paste_url =
-	    std::make_unique<std::string>(settings.domain + pfile->slug + "\n");
-
-	/* Log that we are starting to read the paste */
-	syslog(LOG_INFO, "(%" PRIuFAST64 ") Starting to read the paste",
-	       session_id);
+class purrito_paste : public std::enable_shared_from_this<purrito_paste> {
+       public:
+	/*
+	 * size of the chunks written to the file, smaller chunks are
+	 * gathered up to this size first
+	 */
+	static constexpr std::string::size_type io_chunk_size = 65536;
 
-	res->onData([=, &settings, read_count = std::move(read_count),
-	             paste_url = std::move(paste_url)](std::string_view chunk,
-	                                               bool is_last) {
+	std::string slug;
+	std::string buffer;
+	std::unique_ptr<purrito_paste_file> file;
+	bool to_remove;
+	/* errno of the first failed asynchronous write */
+	int error;
+	/* size of the paste received so far */
+	std::uint_fast64_t size;
+	/* FNV-1a of the paste received so far */
+	std::uint64_t content_hash;
+	/* whether a NUL byte was received, so it is not text */
+	bool binary;
+	const std::chrono::steady_clock::time_point started;
+	/*
+	 * the expected size is the Content-Length of the upload, 0 if it
+	 * is not known up front
+	 */
+	purrito_paste(const purrito_settings &settings,
+	              const std::uint_fast64_t expected_size = 0)
+	    : to_remove(false),
+	      error(0),
+	      size(0),
+	      content_hash(fnv1a(std::string_view())),
+	      binary(false),
+	      started(std::chrono::steady_clock::now()),
+	      hash(settings.dedup ? std::make_unique<purrito_hash>() : nullptr),
+	      file_size(0),
+	      pending(0) {
+		if (settings.inline_size == 0 ||
+		    expected_size > settings.inline_size)
+			spill(settings, expected_size);
+		else
+			slug = settings.slugs->next();
+	}
+	/*
+	 * a paste of the complete, uncompressed file at the given path,
+	 * which is published as it is instead of being written again, its
+	 * contents still have to be passed to scan, throws if it could not
+	 * be taken over
+	 */
+	purrito_paste(const purrito_settings &settings,
+	              const std::string &source)
+	    : file(std::make_unique<purrito_paste_file>(settings, source)),
+	      to_remove(false),
+	      error(0),
+	      size(0),
+	      content_hash(fnv1a(std::string_view())),
+	      binary(false),
+	      started(std::chrono::steady_clock::now()),
+	      hash(settings.dedup ? std::make_unique<purrito_hash>() : nullptr),
+	      file_size(0),
+	      pending(0) {
+		slug = file->slug;
+	}
+	~purrito_paste() {
+		if (file) file->to_remove = to_remove;
+	}
+
+	/* append a chunk, throws if it could not be written */
+	void write(const purrito_settings &settings,
+	           const std::string_view &chunk) {
+		count(chunk);
+		if (!file &&
+		    buffer.size() + chunk.size() <= settings.inline_size) {
+			buffer.append(chunk);
+			return;
+		}
+		if (!file) {
+			spill(settings);
+			compress(settings, buffer);
+			std::string().swap(buffer);
+		}
+		compress(settings, chunk);
+	}
+
+	/*
+	 * take in a chunk of the file of an adopted paste, which is already
+	 * where it belongs
+	 */
+	void scan(const std::string_view &chunk) {
+		count(chunk);
+		if (hash) hash->update(chunk);
+		file_size += chunk.size();
+	}
+
+	/*
+	 * publish the file of a complete paste, its slug can change if
+	 * the first one was taken, throws if it could not be published
+	 */
+	void publish(const purrito_settings &settings) {
+		if (!file) return;
+		file->publish(settings);
+		slug = file->slug;
+	}
+
+	/*
+	 * the metadata of a complete paste, with its final slug
+	 */
+	purrito_paste_record record(const purrito_settings &settings,
+	                            const std::uint64_t expiry) const {
+		purrito_paste_record record;
+		record.expiry = expiry;
+		record.created = time_since_epoch();
+		record.size = size;
+		record.stored_size = file ? file_size : buffer.size();
+		record.hash = content_hash;
+		record.metadata = true;
+		if (!binary) record.flags |= purrito_paste_record::TEXT;
+		if (file && settings.compression_level != 0)
+			record.flags |= purrito_paste_record::GZIP;
+		return record;
+	}
+
+	/*
+	 * hash of the file contents for deduplication, empty if the paste
+	 * is not deduplicated, can only be taken once the paste is flushed
+	 */
+	std::string digest() {
+		return hash && file ? hash->final() : std::string();
+	}
+
+	/*
+	 * finish the compressed stream and call back once everything has
+	 * reached the file, right away unless there are asynchronous
+	 * writes still pending
+	 */
+	void flush(const purrito_settings &settings,
+	           std::function<void()> done) {
+		try {
+			if (deflater) write_file(settings, deflater->finish());
+			if (!staged.empty()) submit(settings);
+		} catch (std::system_error &ex) {
+			if (!error) error = ex.code().value();
+		}
+		deflater.reset();
+		if (pending == 0) {
+			done();
+			return;
+		}
+		flushed = std::move(done);
+	}
+
+       private:
+	/* hash of the file contents, only calculated when deduplicating */
+	std::unique_ptr<purrito_hash> hash;
+	/* compressor of the file contents, only when compressing */
+	std::unique_ptr<purrito_deflate> deflater;
+	/* data gathered for the next write */
+	std::string staged;
+	/* offset in the file at which the next write starts */
+	std::uint_fast64_t file_size;
+	/* number of asynchronous writes still in flight */
+	std::uint_fast32_t pending;
+	std::function<void()> flushed;
+
+	void count(const std::string_view &chunk) {
+		size += chunk.size();
+		content_hash = fnv1a(chunk, content_hash);
+		binary = binary ||
+		         std::memchr(chunk.data(), 0, chunk.size()) != nullptr;
+	}
+
+	void spill(const purrito_settings &settings,
+	           const std::uint_fast64_t expected_size = 0) {
+		file = std::make_unique<purrito_paste_file>(settings);
+		slug = file->slug;
+		if (settings.compression_level != 0)
+			deflater = std::make_unique<purrito_deflate>(
+			    settings.compression_level);
+		/* the size of a compressed file is not known up front */
+		else if (expected_size != 0)
+			file->preallocate(expected_size);
+	}
+
+	void compress(const purrito_settings &settings,
+	              const std::string_view &chunk) {
+		if (!deflater) {
+			write_file(settings, chunk);
+			return;
+		}
+		auto compressed = deflater->update(chunk);
+		if (!compressed.empty()) write_file(settings, compressed);
+	}
+
+	void write_file(const purrito_settings &settings,
+	                const std::string_view &chunk) {
+		if (hash) hash->update(chunk);
+		if (error)
+			throw std::system_error(std::make_error_code(
+			    static_cast<std::errc>(error)));
+		staged.append(chunk);
+		if (staged.size() >= io_chunk_size) submit(settings);
+	}
+
+	/*
+	 * hand the staged data to the io threads, the completion is
+	 * brought back to the event loop this paste is being read on,
+	 * without them it is written right away, throwing if it fails
+	 */
+	void submit(const purrito_settings &settings) {
+		if (!settings.io) {
+			std::string::size_type written = 0;
+			while (written < staged.size()) {
+				ssize_t w = pwrite(file->fd,
+				                   staged.data() + written,
+				                   staged.size() - written,
+				                   file_size + written);
+				if (w == -1 && errno == EINTR) continue;
+				if (w == -1)
+					throw std::system_error(
+					    std::make_error_code(
+					        static_cast<std::errc>(errno)));
+				written += w;
+			}
+			file_size += written;
+			/* keeps its capacity for the next chunk */
+			staged.clear();
+			return;
+		}
+		auto loop = uWS::Loop::get();
+		auto self = shared_from_this();
+		auto size = staged.size();
+		pending++;
+		settings.io->write(file->fd, std::move(staged), file_size,
+		                   [self, loop](int err) {
+			                   loop->defer([self, err]() {
+				                   self->written(err);
+			                   });
+		                   });
+		file_size += size;
+		staged = std::string();
+	}
+
+	void written(const int err) {
+		pending--;
+		if (err && !error) error = err;
+		if (pending == 0 && flushed) {
+			auto done = std::move(flushed);
+			flushed = nullptr;
+			done();
+		}
+	}
+};
+
+/*
+ * several pastes uploaded in a single request, split while it streams in
+ * every paste is preceded by its size in bytes, written in decimal and
+ * followed by a newline, e.g. "5\nhello3\nbye"
+ */
+class purrito_batch {
+       public:
+	/*
+	 * most pastes accepted in a single request
+	 */
+	static constexpr std::size_t max_pastes = 64;
+
+	/*
+	 * the pastes received completely, in the order they were sent
+	 */
+	std::vector<std::shared_ptr<purrito_paste>> pastes;
+
+	/*
+	 * seconds until the client may send another paste, once it was
+	 * turned away by the rate limit
+	 */
+	std::uint_fast64_t retry_after = 0;
+
+	/*
+	 * split a chunk of the request into the pastes, returns OK, or the
+	 * status the request has to be turned away with, throws if a paste
+	 * could not be written
+	 * every paste takes a token of the client with the given address
+	 * from the rate limiter, as if it was sent on its own
+	 */
+	purrito_metrics::status feed(const purrito_settings &settings,
+	                             std::string_view chunk,
+	                             const std::string_view &address) {
+		while (!chunk.empty()) {
+			if (current) {
+				auto part = chunk.substr(0, remaining);
+				current->write(settings, part);
+				remaining -= part.size();
+				chunk.remove_prefix(part.size());
+				if (remaining == 0)
+					pastes.push_back(std::move(current));
+				continue;
+			}
+			auto end = chunk.find('\n');
+			header.append(chunk.substr(0, end));
+			/* more digits than any size which could be allowed */
+			if (header.size() > 20)
+				return purrito_metrics::BAD_REQUEST;
+			if (end == std::string_view::npos) break;
+			chunk.remove_prefix(end + 1);
+			std::uint_fast64_t size = 0;
+			auto parsed = std::from_chars(
+			    header.data(), header.data() + header.size(), size);
+			if (header.empty() || size == 0 ||
+			    parsed.ptr != header.data() + header.size())
+				return purrito_metrics::BAD_REQUEST;
+			if (size > settings.max_paste_size ||
+			    pastes.size() == max_pastes)
+				return purrito_metrics::PAYLOAD_TOO_LARGE;
+			if (settings.limiter &&
+			    !settings.limiter->allow(address, retry_after))
+				return purrito_metrics::TOO_MANY_REQUESTS;
+			header.clear();
+			current =
+			    std::make_shared<purrito_paste>(settings, size);
+			remaining = size;
+		}
+		return purrito_metrics::OK;
+	}
+
+	/*
+	 * whether the request ended right after a paste
+	 */
+	bool complete() const {
+		return !current && header.empty() && !pastes.empty();
+	}
+
+	/*
+	 * throw away everything received, once the request failed
+	 */
+	void remove() {
+		for (auto &paste : pastes) paste->to_remove = true;
+		if (current) current->to_remove = true;
+	}
+
+       private:
+	/* the paste being received, with the bytes still missing */
+	std::shared_ptr<purrito_paste> current;
+	std::uint_fast64_t remaining = 0;
+	/* the size of the next paste, as much as was received of it */
+	std::string header;
+};
+
+/*
+ * a resumable upload, created empty and then added to by PATCH requests,
+ * each starting at the offset the one before it left off, until it is
+ * finished into a paste
+ * its data goes straight into a file in the uploads directory, so only
+ * the chunk being written is held in memory however large it grows, and
+ * every request working on it holds the lock of that file, so that two
+ * of them never add to it at once
+ */
+class purrito_upload {
+       public:
+	/* directory of the files, inside the storage directory */
+	static constexpr const char *directory = ".uploads/";
+	/* bytes of the random ids, which are sent as hex */
+	static constexpr std::size_t id_bytes = 16;
+	/* bytes of the file copied into the paste at once when finishing */
+	static constexpr std::size_t copy_chunk_size = 1048576;
+
+	std::string id;
+	purrito_upload_record record;
+	/* bytes received so far, the size of the file */
+	std::uint_fast64_t offset;
+	int fd;
+
+	purrito_upload(const std::string_view &id = std::string_view())
+	    : id(id), offset(0), fd(-1) {}
+	/* closing the file also releases its lock */
+	~purrito_upload() {
+		if (fd != -1) close(fd);
+	}
+	purrito_upload(const purrito_upload &) = delete;
+	purrito_upload &operator=(const purrito_upload &) = delete;
+
+	/*
+	 * ids are never all digits, so they can not be mistaken for the
+	 * lifetime of a new upload
+	 */
+	static bool is_id(const std::string_view &name) {
+		return name.size() == 2 * id_bytes && !is_delay(name) &&
+		       std::all_of(name.begin(), name.end(), [](char c) {
+			       return (c >= '0' && c <= '9') ||
+			              (c >= 'a' && c <= 'f');
+		       });
+	}
+
+	static std::string path(const purrito_settings &settings,
+	                        const std::string_view &id) {
+		return settings.storage_directory + directory + std::string(id);
+	}
+
+	/*
+	 * create the empty file of a new upload under a new id, throws if
+	 * it could not be created
+	 * the id is all that guards the upload, so it comes from the
+	 * random generator of openssl and not the one of the sessions
+	 */
+	void create(const purrito_settings &settings) {
+		while (1) {
+			std::string raw(id_bytes, '\0');
+			auto bytes = reinterpret_cast<unsigned char *>(&raw[0]);
+			if (RAND_bytes(bytes, id_bytes) != 1)
+				throw std::system_error(std::make_error_code(
+				    std::errc::resource_unavailable_try_again));
+			id = purrito_hash::hex(raw);
+			if (!is_id(id)) continue;
+			fd = ::open(path(settings, id).c_str(),
+			            O_WRONLY | O_CREAT | O_EXCL,
+			            S_IRUSR | S_IWUSR);
+			if (fd != -1) return;
+			if (errno != EEXIST)
+				throw std::system_error(std::make_error_code(
+				    static_cast<std::errc>(errno)));
+		}
+	}
+
+	/*
+	 * look up the record of the upload and open its file, locked unless
+	 * it is only looked at, returns NOT_FOUND if there is no such upload
+	 * and CONFLICT if another request holds the lock, the offset is
+	 * filled in either way
+	 * a finished upload has no file any more, it is OK with the size of
+	 * its paste as the offset
+	 */
+	purrito_metrics::status open(const purrito_settings &settings,
+	                             const int flags, const bool lock) {
+		if (!is_id(id)) return purrito_metrics::NOT_FOUND;
+		/*
+		 * the request finishing it removes the file only once the
+		 * record says so, so a removed file is looked up once more
+		 */
+		for (int tries = 0; tries < 2; tries++) {
+			try {
+				auto rtxn = lmdb::txn::begin(
+				    settings.env, nullptr, MDB_RDONLY);
+				auto uploads = lmdb::dbi::open(rtxn, "uploads");
+				std::string_view value;
+				if (!uploads.get(rtxn, id, value) ||
+				    !record.parse(value))
+					return purrito_metrics::NOT_FOUND;
+			} catch (lmdb::error &) {
+				return purrito_metrics::SERVER_ERROR;
+			}
+			if (record.finished != 0) {
+				offset = record.length;
+				return purrito_metrics::OK;
+			}
+			fd = ::open(path(settings, id).c_str(), flags);
+			if (fd == -1) {
+				if (errno != ENOENT)
+					return purrito_metrics::SERVER_ERROR;
+				continue;
+			}
+			bool locked =
+			    !lock || flock(fd, LOCK_EX | LOCK_NB) == 0;
+			struct stat file_stat;
+			if (fstat(fd, &file_stat) != 0)
+				return purrito_metrics::SERVER_ERROR;
+			offset = file_stat.st_size;
+			if (file_stat.st_nlink != 0)
+				return locked ? purrito_metrics::OK
+				              : purrito_metrics::CONFLICT;
+			close(fd);
+			fd = -1;
+		}
+		/* the cleaner removed it in the meantime */
+		return purrito_metrics::NOT_FOUND;
+	}
+
+	/* add a chunk at the end of the file, throws if it fails */
+	void append(const std::string_view &chunk) {
+		std::string_view::size_type written = 0;
+		while (written < chunk.size()) {
+			ssize_t w = pwrite(fd, chunk.data() + written,
+			                   chunk.size() - written, offset);
+			if (w == -1 && errno == EINTR) continue;
+			if (w == -1)
+				throw std::system_error(std::make_error_code(
+				    static_cast<std::errc>(errno)));
+			written += w;
+			offset += w;
+		}
+	}
+
+	/*
+	 * read the chunk of the file starting at the given position, up to
+	 * the copy chunk size, throws if it fails or the file ends early
+	 */
+	std::string read(const std::uint_fast64_t position) {
+		std::string chunk(
+		    std::min<std::uint_fast64_t>(copy_chunk_size,
+		                                 offset - position),
+		    '\0');
+		std::string::size_type done = 0;
+		while (done < chunk.size()) {
+			ssize_t r = pread(fd, &chunk[done], chunk.size() - done,
+			                  position + done);
+			if (r == -1 && errno == EINTR) continue;
+			if (r == 0) errno = EIO;
+			if (r <= 0)
+				throw std::system_error(std::make_error_code(
+				    static_cast<std::errc>(errno)));
+			done += r;
+		}
+		return chunk;
+	}
+};
+
+/*
+ * read data in a registered call back function
+ */
+template <bool SSL>
+void read_paste(const purrito_settings &, const std::uint_fast64_t,
+                const std::uint_fast64_t, std::shared_ptr<purrito_paste>,
+                uWS::HttpResponse<SSL> *);
+
+/*
+ * wait for a completely received paste to be written, publish it and
+ * store it, the resumable upload it came from is passed on
+ */
+template <bool SSL>
+void complete_paste(const purrito_settings &, const std::uint_fast64_t,
+                    const std::uint_fast64_t, std::shared_ptr<purrito_paste>,
+                    uWS::HttpResponse<SSL> *,
+                    std::shared_ptr<purrito_upload> = nullptr);
+
+/*
+ * store the fully written paste and send its url back to the client, the
+ * resumable upload it came from, if any, is marked finished with it and
+ * stays locked until then
+ */
+template <bool SSL>
+void finish_paste(const purrito_settings &, const std::uint_fast64_t,
+                  const std::uint_fast64_t, std::shared_ptr<purrito_paste>,
+                  const std::string &, uWS::HttpResponse<SSL> *,
+                  std::shared_ptr<purrito_upload> = nullptr);
+
+/*
+ * read the pastes of a batch upload, the urls of all of them are sent
+ * back together, one per line
+ */
+template <bool SSL>
+void read_batch(const purrito_settings &, const std::uint_fast64_t,
+                const std::uint_fast64_t, uWS::HttpResponse<SSL> *);
+
+/*
+ * store all the pastes of a batch in a single writer submission, either
+ * all of them are stored or none is
+ */
+template <bool SSL>
+void finish_batch(const purrito_settings &, const std::uint_fast64_t,
+                  const std::uint_fast64_t, std::shared_ptr<purrito_batch>,
+                  uWS::HttpResponse<SSL> *);
+
+/*
+ * the lifetime asked for in the last part of the url, in nanoseconds,
+ * the default one if it does not name a lifetime
+ */
+std::uint_fast64_t paste_delay(const purrito_settings &,
+                               const std::string_view &);
+
+/*
+ * turn the client away with 429 if it is over the rate limit, returns
+ * true if it was
+ */
+template <bool SSL>
+bool rate_limited(const purrito_settings &, const std::uint_fast64_t,
+                  uWS::HttpResponse<SSL> *);
+
+/*
+ * the routes of the resumable uploads, only there when they are enabled
+ * - POST /upload[/lifetime]   create one, answered with its url
+ * - PATCH /upload/<id>        add the body at the offset in Upload-Offset
+ * - HEAD /upload/<id>         the offset received so far
+ * - POST /upload/<id>         finish it into a paste
+ */
+template <bool SSL>
+void purr_uploads(const purrito_settings &, uWS::TemplatedApp<SSL> &);
+
+template <bool SSL>
+void create_upload(const purrito_settings &, const std::uint_fast64_t,
+                   uWS::HttpResponse<SSL> *, uWS::HttpRequest *);
+
+template <bool SSL>
+void append_upload(const purrito_settings &, const std::uint_fast64_t,
+                   uWS::HttpResponse<SSL> *, uWS::HttpRequest *);
+
+template <bool SSL>
+void upload_offset(const purrito_settings &, const std::uint_fast64_t,
+                   uWS::HttpResponse<SSL> *, uWS::HttpRequest *);
+
+template <bool SSL>
+void finish_upload(const purrito_settings &, const std::uint_fast64_t,
+                   uWS::HttpResponse<SSL> *, uWS::HttpRequest *);
+
+/*
+ * copy the file of a finished upload into its paste a chunk at a time,
+ * giving the other requests on the loop their turn in between, a paste
+ * that adopted the file is only read through
+ */
+template <bool SSL>
+void copy_upload(const purrito_settings &, const std::uint_fast64_t,
+                 std::shared_ptr<purrito_upload>,
+                 std::shared_ptr<purrito_paste>, const bool,
+                 uWS::HttpResponse<SSL> *);
+
+/*
+ * answer an upload request with an error, along with the offset of the
+ * upload when it is known
+ */
+template <bool SSL>
+void refuse_upload(const purrito_settings &, uWS::HttpResponse<SSL> *,
+                   const purrito_metrics::method,
+                   const purrito_metrics::status, const std::string_view &,
+                   const purrito_upload * = nullptr);
+
+/*
+ * record a successfully stored paste in the metrics, if enabled
+ */
+void count_upload(const purrito_settings &, const purrito_paste &);
+
+/*
+ * the same for all the pastes of a batch, as a single request
+ */
+void count_upload(const purrito_settings &, const purrito_batch &);
+
+/*
+ * store a received paste in the database inside the writer transaction,
+ * along with its metadata and expiry, small pastes are stored inline,
+ * retrying slugs until a free one is found, returns false if none was
+ * found
+ */
+bool store_paste(const purrito_settings &, lmdb::txn &, purrito_paste &,
+                 const std::uint_fast64_t);
+
+/*
+ * take back what store_paste put into the database
+ */
+void unstore_paste(lmdb::txn &, const purrito_paste &,
+                   const std::uint_fast64_t);
+
+/*
+ * answer the request if the paste is stored inline in the database, or
+ * with 410 if its lifetime is over but the cleaner has not removed it
+ * yet, returns false if neither, with the record of the paste filled in
+ * if it has one
+ */
+template <bool SSL>
+bool serve_inline(const purrito_settings &, const std::string &,
+                  uWS::HttpRequest *, uWS::HttpResponse<SSL> *, const bool,
+                  purrito_paste_record &);
+
+/*
+ * content addressed deduplication
+ * every distinct content is stored once in the .dedup directory, named
+ * after its hash, and every paste with that content is a hard link to it
+ * the "dedup" database keeps the reference count of each hash, and the
+ * "dedup_slugs" database maps every paste back to the hash of its content
+ */
+
+/* path of the single stored copy of the content with the given hash */
+std::string dedup_path(const purrito_settings &, const std::string &);
+
+/*
+ * add a reference to the content with the given hash for a new paste,
+ * returns true if the same content is already stored
+ */
+bool dedup_paste(lmdb::txn &, const std::string &, const std::string &);
+
+/*
+ * once the references are committed, either link the file of the new
+ * paste to the stored copy of its content, or make it the stored copy
+ * NOTE: the hash is of the file contents, so compressed and plain
+ *       copies of the same paste are never mixed up
+ */
+void link_dedup(const purrito_settings &, const std::string &,
+                const std::string &, const bool);
+
+/*
+ * drop the reference of a cleaned paste, returns the hash of the content
+ * if it was the last reference and the stored copy has to be removed
+ */
+std::string undedup_paste(lmdb::txn &, const std::string &);
+
+/*
+ * remove the stored copies of the contents with the given hashes which
+ * are still without a reference, through the writer, so that it is
+ * ordered against link_dedup of new pastes with the same content
+ */
+void remove_dedup(const purrito_settings &, std::vector<std::string>);
+
+/*
+ * remove the stored copies nothing refers to, left behind by a crash
+ * between dropping their last reference and removing them, returns how
+ * many were handed to the writer for removal
+ */
+std::size_t clean_dedup(const purrito_settings &);
+
+/*
+ * statistics of a single run of the cleaner
+ */
+struct purrito_clean_stats {
+	/* number of pastes removed */
+	std::size_t cleaned = 0;
+	/* number of write transactions used */
+	std::size_t transactions = 0;
+	/*
+	 * number of expired records still in the database after the run,
+	 * those it did not get to and those which expired in the meantime
+	 */
+	std::size_t backlog = 0;
+	/* wall clock time taken by the run */
+	std::chrono::milliseconds duration{0};
+};
+
+/*
+ * remove all the expired pastes, walking the expiry keys in order and
+ * stopping at the first one which is not expired yet
+ * NOTE: at most the given number of pastes are deleted in a single
+ *       write transaction, and files are removed outside of any
+ *       transaction, so that the writer is never stalled for long
+ */
+purrito_clean_stats clean_pastes(const purrito_settings &,
+                                 const std::size_t);
+
+/*
+ * remove the temporary files of pastes which were never published, left
+ * behind by a crash on systems without anonymous files, returns how many
+ * were removed
+ */
+std::size_t clean_temporary_files(const purrito_settings &);
+
+/*
+ * remove the resumable uploads nothing was added to for longer than the
+ * upload timeout, along with records left without a file and files left
+ * without a record, returns how many were removed
+ * the records of finished uploads go once they were finished for longer
+ * than the upload timeout
+ * NOTE: uploads locked by a request are left alone
+ */
+std::size_t clean_uploads(const purrito_settings &);
+
+/*
+ * open a paste from the storage directory for streaming, going through
+ * the cache if it is enabled, returns nullptr if the paste does not exist
+ */
+std::shared_ptr<purrito_paste_stream> open_paste(const purrito_settings &,
+                                                 const std::string &);
+
+/*
+ * whether an Accept-Encoding header allows a gzip compressed response
+ */
+bool accepts_gzip(const std::string_view &);
+
+/*
+ * how a paste is sent back, everything needed to answer the conditional
+ * and range headers of a request for it
+ */
+struct purrito_representation {
+	/*
+	 * strong entity tag, including its quotes, of a string kept by the
+	 * caller until the answer is written
+	 */
+	std::string_view etag;
+	/* last modification time, zero if it is not known */
+	std::time_t modified = 0;
+	/* the same as an http date, worked out from it if it is empty */
+	std::string_view last_modified;
+	/* size of the whole body as it is sent */
+	std::uint_fast64_t size = 0;
+	/* the body is sent as it is stored, so parts of it can be sent */
+	bool ranges = false;
+	/* pastes never change, everything else has to be revalidated */
+	bool immutable = false;
+	/* the paste is stored compressed, so the encoding is negotiated */
+	bool vary = false;
+	/* the body is sent gzip encoded */
+	bool gzip = false;
+	/* media type of the body, none is sent for pastes */
+	const char *content_type = nullptr;
+};
+
+/* strong entity tag of a file, from its modification time and size */
+std::string file_etag(const struct timespec &, const std::uint_fast64_t);
+
+/* strong entity tag of a paste held in memory, from its contents */
+std::string data_etag(const std::string_view &);
+
+/*
+ * the same entity tag, from the hash and size of the contents kept in
+ * the metadata of a paste
+ */
+std::string content_etag(const std::uint64_t, const std::uint64_t);
+
+/* whether the name is one that could have been handed out as a slug */
+bool is_slug(const purrito_settings &, const std::string_view &);
+
+/*
+ * format and parse http dates, only the IMF-fixdate form is accepted
+ * e.g. Sun, 06 Nov 1994 08:49:37 GMT
+ * parsing returns -1 for anything else
+ */
+std::string http_date(const std::time_t);
+std::time_t parse_http_date(const std::string_view &);
+
+/*
+ * whether the entity tag is in the list of an If-None-Match header,
+ * compared weakly, as the header asks for
+ */
+bool etag_matches(const std::string_view &, const std::string_view &);
+
+/*
+ * parse a Range header against a body of the given size
+ * only a single range of bytes is supported, anything else is ignored
+ * and the whole body is sent
+ */
+enum purrito_range { RANGE_NONE, RANGE_SATISFIABLE, RANGE_UNSATISFIABLE };
+purrito_range parse_range(const std::string_view &, const std::uint_fast64_t,
+                          std::uint_fast64_t &, std::uint_fast64_t &);
+
+/*
+ * answer the conditional and range headers of a GET request, writing the
+ * status line and all the headers of the response
+ * returns false if the response is already complete, otherwise the part
+ * of the body to send is left in the offset and length
+ */
+template <bool SSL>
+bool answer_paste(const purrito_settings &, uWS::HttpRequest *,
+                  uWS::HttpResponse<SSL> *, const purrito_representation &,
+                  std::uint_fast64_t &, std::uint_fast64_t &);
+
+/*
+ * read the frontend files from the storage directory into memory, along
+ * with their compressed variants, replacing the ones loaded before
+ * files which are missing are read from disk on every request instead
+ * returns the number of files loaded
+ */
+std::size_t load_assets(const purrito_settings &);
+
+/* media type of a frontend file, from its extension */
+const char *content_type(const std::string_view &);
+
+/*
+ * answer the request if it is for one of the frontend files held in
+ * memory, returns false if it is not
+ */
+template <bool SSL>
+bool serve_asset(const purrito_settings &, const std::string_view &,
+                 uWS::HttpRequest *, uWS::HttpResponse<SSL> *, const bool);
+
+/*
+ * a compressed paste being decompressed on the fly, for clients which
+ * do not accept it compressed
+ */
+class purrito_gunzip_stream {
+       public:
+	std::shared_ptr<purrito_paste_stream> stream;
+	purrito_inflate inflater;
+	purrito_gunzip_stream(std::shared_ptr<purrito_paste_stream> stream)
+	    : stream(std::move(stream)), offset(0) {}
+
+	/*
+	 * the next part of the decompressed paste, empty once all of it
+	 * was returned, throws if the paste is truncated or corrupted
+	 */
+	std::string_view chunk() {
+		while (!inflater.finished) {
+			if (input.empty()) {
+				input = stream->chunk(offset);
+				if (input.empty())
+					throw std::runtime_error(
+					    "gzip stream is truncated");
+			}
+			std::string::size_type consumed = 0;
+			auto output = inflater.run(input, consumed);
+			input.remove_prefix(consumed);
+			offset += consumed;
+			if (!output.empty()) return output;
+		}
+		return {};
+	}
+
+       private:
+	/* part of the compressed paste read but not decompressed yet */
+	std::string_view input;
+	std::uint_fast64_t offset;
+};
+
+/*
+ * send as much of the decompressed paste as the socket accepts, the
+ * size is not known up front so it goes out in chunked encoding,
+ * returns false if the client is applying backpressure
+ */
+template <bool SSL>
+bool gunzip_paste(std::shared_ptr<purrito_gunzip_stream>,
+                  uWS::HttpResponse<SSL> *);
+
+/*
+ * send as much of the paste as the socket accepts without buffering,
+ * returns false if the client is applying backpressure
+ */
+template <bool SSL>
+bool stream_paste(std::shared_ptr<purrito_paste_stream>,
+                  uWS::HttpResponse<SSL> *);
+
+/******************************************************************************/
+
+template <bool SSL>
+uWS::TemplatedApp<SSL> purr(const purrito_settings &settings,
+                            std::vector<us_listen_socket_t *> &listen_sockets) {
+	/* create a standard non tls app to listen for requests */
+	auto purrito = uWS::TemplatedApp<SSL>();
+	purrito.post(
+	    "/*",
+	    /* specifically ignoring the request parameter, as c++ is dumb */
+	    [&](auto *res, auto *req) {
+		    /* Log that we are getting a connection */
+		    auto paste_ip = std::string(res->getRemoteAddressAsText());
+		    std::uint_fast64_t session_id = rng();
+		    PLOG(
+		        LOG_INFO,
+		        "(%s) Got a POST connection - session id (%" PRIuFAST64
+		        ")",
+		        paste_ip.c_str(), session_id);
+
+		    /* several pastes in one request, see purrito_batch */
+		    bool batch = req->getUrl() == "/batch" ||
+		                 req->getUrl().substr(0, 7) == "/batch/";
+
+		    std::uint_fast64_t delay =
+		        paste_delay(settings, req->getUrl());
+		    PLOG(LOG_INFO,
+		         "(%" PRIuFAST64 ") Paste lifetime = %" PRIuFAST64
+		         "ns",
+		         session_id, delay);
+		    /*
+		     * over the limit, turned away before storing anything,
+		     * the pastes of a batch are counted one by one instead
+		     */
+		    if (!batch && rate_limited<SSL>(settings, session_id, res))
+			    return;
+
+		    /*
+		     * uploads which announce their size are checked before
+		     * anything is stored, chunked ones are checked as their
+		     * data arrives
+		     */
+		    std::uint_fast64_t content_length = 0;
+		    {
+			    auto length_ = req->getHeader("content-length");
+			    std::from_chars(length_.data(),
+			                    length_.data() + length_.size(),
+			                    content_length);
+		    }
+		    std::uint_fast64_t max_length = settings.max_paste_size;
+		    /* every paste of a batch comes with up to 21 bytes more */
+		    if (batch)
+			    max_length = purrito_batch::max_pastes *
+			                 (settings.max_paste_size + 21);
+		    if (content_length > max_length) {
+			    PLOG(LOG_WARNING,
+			         "(%" PRIuFAST64
+			         ") WARNING: paste of %" PRIuFAST64
+			         " bytes is too large, rejected",
+			         session_id, content_length);
+			    if (settings.metrics)
+				    settings.metrics->request(
+				        purrito_metrics::POST,
+				        purrito_metrics::PAYLOAD_TOO_LARGE);
+			    res->writeStatus("413 Payload Too Large");
+			    for (auto it : settings.headers)
+				    res->writeHeader(it.first, it.second);
+			    /* the body is never read, so the connection goes */
+			    res->end("Paste Too Large", true);
+			    return;
+		    }
+
+		    if (batch) {
+			    res->cork([&, delay, session_id]() {
+				    read_batch<SSL>(settings, delay, session_id,
+				                    res);
+			    });
+			    return;
+		    }
+
+		    std::shared_ptr<purrito_paste> paste;
+		    try {
+			    paste = std::make_shared<purrito_paste>(
+			        settings, content_length);
+		    } catch (std::system_error &ex) {
+			    PLOG(LOG_WARNING,
+			         "(%" PRIuFAST64
+			         ") WARNING: Could not generate file - %s",
+			         session_id, ex.what());
+			    res->close();
+			    return;
+		    }
+		    /* the abort handler needs the paste, to remove it */
+		    res->onAborted([=, &settings]() {
+			    paste->to_remove = true;
+			    if (settings.metrics)
+				    settings.metrics
+				        ->aborted[purrito_metrics::POST]
+				        .add();
+			    PLOG(LOG_WARNING,
+			         "(%" PRIuFAST64
+			         ") WARNING: Request was prematurely aborted",
+			         session_id);
+		    });
+
+		    for (auto it : settings.headers)
+			    res->writeHeader(it.first, it.second);
+
+		    res->cork([&, delay, session_id, paste]() {
+			    read_paste<SSL>(settings, delay, session_id, paste,
+			                    res);
+		    });
+	    });
+	/*
+	 * HEAD is answered from the metadata of a paste alone, pastes from
+	 * older versions without it still have their file opened
+	 */
+	auto serve = [&settings](auto *res, auto *req, const bool head) {
+		std::string paste_filename(req->getUrl());
+		/* Log that we are getting a connection */
+		auto paste_ip = std::string(res->getRemoteAddressAsText());
+		std::uint_fast64_t session_id = rng();
+		PLOG(LOG_INFO,
+		     "(%s) Got a %s connection {%s} - session id "
+		     "(%" PRIuFAST64 ")",
+		     paste_ip.c_str(), head ? "HEAD" : "GET",
+		     paste_filename.c_str(), session_id);
+		/*
+		 * attach a standard abort handler, in case something
+		 * goes wrong
+		 */
+		res->onAborted([=, &settings]() {
+			if (settings.metrics)
+				settings.metrics->aborted[purrito_metrics::GET]
+				    .add();
+			PLOG(LOG_WARNING,
+			     "(%" PRIuFAST64
+			     ") WARNING: Request was prematurely "
+			     "aborted",
+			     session_id);
+		});
+
+		if (paste_filename.size() <= 1)
+			paste_filename = "/" + settings.index_file;
+
+		auto slug =
+		    paste_filename.substr(paste_filename.find_last_of("/") + 1);
+		if (serve_asset<SSL>(settings, slug, req, res, head)) return;
+		purrito_paste_record record;
+		if (serve_inline<SSL>(settings, slug, req, res, head, record))
+			return;
+
+		std::shared_ptr<purrito_paste_stream> stream;
+		if (!head || !record.metadata)
+			stream = open_paste(settings, slug);
+		if (!stream && (!head || !record.metadata)) {
+			if (settings.metrics)
+				settings.metrics->request(
+				    purrito_metrics::GET,
+				    purrito_metrics::NOT_FOUND);
+			res->writeStatus("404 Not Found");
+			for (auto it : settings.headers)
+				res->writeHeader(it.first, it.second);
+			res->end();
+			return;
+		}
+
+		/*
+		 * compressed pastes go out as they are stored, unless
+		 * the client can not take them, then they are
+		 * decompressed on the fly and can not be sent in parts
+		 */
+		purrito_representation paste;
+		std::string etag;
+		bool gzip;
+		if (record.metadata) {
+			gzip = record.flags & purrito_paste_record::GZIP;
+			etag = content_etag(record.hash, record.size);
+			paste.modified = record.created / 1000000000;
+			paste.size = record.stored_size;
+			paste.content_type = record.content_type();
+		} else {
+			gzip = stream->gzip;
+			etag = file_etag(stream->modified, stream->size);
+			paste.modified = stream->modified.tv_sec;
+			paste.size = stream->size;
+		}
+		paste.ranges = true;
+		paste.immutable = is_slug(settings, slug);
+		if (gzip) {
+			paste.vary = true;
+			paste.gzip =
+			    accepts_gzip(req->getHeader("accept-encoding"));
+			paste.ranges = paste.gzip;
+			/* both encodings need their own entity tag */
+			etag.insert(etag.size() - 1,
+			            paste.gzip ? "-gzip" : "-gunzip");
+			if (!paste.gzip && record.metadata)
+				paste.size = record.size;
+		}
+		paste.etag = etag;
+		std::uint_fast64_t offset = 0, length = 0;
+		if (!answer_paste<SSL>(settings, req, res, paste,
+		                       stream ? stream->offset : offset,
+		                       stream ? stream->length : length))
+			return;
+
+		if (head) {
+			/*
+			 * the same headers as GET, which sends a paste it
+			 * decompresses in chunked encoding without a length
+			 */
+			if (gzip && !paste.gzip)
+				res->endWithoutBody();
+			else
+				res->endWithoutBody(stream ? stream->length
+				                           : length);
+			return;
+		}
+
+		if (gzip && !paste.gzip) {
+			auto gunzip =
+			    std::make_shared<purrito_gunzip_stream>(stream);
+			if (!gunzip_paste<SSL>(gunzip, res))
+				res->onWritable([gunzip, res](auto) {
+					return gunzip_paste<SSL>(gunzip, res);
+				});
+			return;
+		}
+
+		/*
+		 * only a single chunk is ever held per client, the rest
+		 * is sent as the client drains its socket
+		 */
+		if (!stream_paste<SSL>(stream, res))
+			res->onWritable([stream, res](auto) {
+				return stream_paste<SSL>(stream, res);
+			});
+	};
+	if (settings.upload_timeout != 0) purr_uploads<SSL>(settings, purrito);
+	if (settings.enable_httpserver) {
+		purrito.get("/*", [serve](auto *res, auto *req) {
+			serve(res, req, false);
+		});
+		purrito.head("/*", [serve](auto *res, auto *req) {
+			serve(res, req, true);
+		});
+	}
+	for (std::vector<std::uint_fast16_t>::size_type i = 0;
+	     i < settings.bind_ip.size(); i++) {
+		purrito.listen(
+		    settings.bind_ip[i], settings.bind_port[i],
+		    [&](auto *listenSocket) {
+			    if (listenSocket) {
+				    listen_sockets.push_back(listenSocket);
+				    PLOG(LOG_INFO,
+				         "Listening for connections "
+				         "on %s:%" PRIuFAST16 "...",
+				         settings.bind_ip[i].c_str(),
+				         settings.bind_port[i]);
+			    } else {
+				    PLOG(LOG_WARNING,
+				         "WARNING: Failed to listen on "
+				         "%s:%" PRIuFAST16 "!!!",
+				         settings.bind_ip[i].c_str(),
+				         settings.bind_port[i]);
+			    }
+		    });
+	}
+	return purrito;
+}
+
+uWS::App purr_metrics(const purrito_settings &settings) {
+	auto metrics = uWS::App();
+	metrics.get("/metrics", [&](auto *res, auto *) {
+		auto out = settings.metrics->write();
+		if (settings.cache) {
+			out += "# HELP purrito_cache_hits_total Lookups "
+			       "answered from the cache.\n"
+			       "# TYPE purrito_cache_hits_total counter\n"
+			       "purrito_cache_hits_total " +
+			       std::to_string(settings.cache->hits.load()) +
+			       "\n";
+			out += "# HELP purrito_cache_misses_total Lookups "
+			       "missed by the cache.\n"
+			       "# TYPE purrito_cache_misses_total counter\n"
+			       "purrito_cache_misses_total " +
+			       std::to_string(settings.cache->misses.load()) +
+			       "\n";
+		}
+		if (settings.tls) {
+			out += "# HELP purrito_tls_handshakes_total TLS "
+			       "handshakes started.\n"
+			       "# TYPE purrito_tls_handshakes_total counter\n"
+			       "purrito_tls_handshakes_total " +
+			       std::to_string(settings.tls->handshakes.load()) +
+			       "\n";
+			out += "# HELP purrito_tls_resumptions_total TLS "
+			       "handshakes which resumed a session.\n"
+			       "# TYPE purrito_tls_resumptions_total counter\n"
+			       "purrito_tls_resumptions_total"
+			       "{from=\"ticket\"} " +
+			       std::to_string(
+			           settings.tls->ticket_resumptions.load()) +
+			       "\npurrito_tls_resumptions_total"
+			       "{from=\"cache\"} " +
+			       std::to_string(
+			           settings.tls->cache_resumptions.load()) +
+			       "\n";
+		}
+		res->writeHeader("Content-Type", "text/plain; version=0.0.4");
+		res->end(out);
+	});
+	metrics.listen(
+	    settings.metrics_ip, settings.metrics_port,
+	    [&](auto *listenSocket) {
+		    if (listenSocket)
+			    PLOG(LOG_INFO,
+			         "Listening for metrics on %s:%" PRIuFAST16
+			         "...",
+			         settings.metrics_ip.c_str(),
+			         settings.metrics_port);
+		    else
+			    PLOG(LOG_WARNING,
+			         "WARNING: Failed to listen for metrics on "
+			         "%s:%" PRIuFAST16 "!!!",
+			         settings.metrics_ip.c_str(),
+			         settings.metrics_port);
+	    });
+	return metrics;
+}
+
+template <bool SSL>
+void run_worker(const purrito_settings &settings, purrito_worker &worker,
+                std::mutex &worker_lock, purrito_handover &handover,
+                std::atomic<unsigned int> &started,
+                std::atomic<unsigned int> &listening) {
+	std::vector<us_listen_socket_t *> listen_sockets;
+	auto purrito = purr<SSL>(settings, listen_sockets);
+	std::vector<int> listen_fds;
+	for (auto listen_socket : listen_sockets) {
+		if (handover.adopt(listen_socket))
+			PLOG(LOG_DEBUG, "Took over an inherited listen socket");
+		listen_fds.push_back(us_poll_fd(
+		    reinterpret_cast<us_poll_t *>(listen_socket)));
+	}
+	if constexpr (SSL) {
+		/* the names are all looked up from the default context */
+		settings.tls->attach(
+		    static_cast<SSL_CTX *>(purrito.getNativeHandle()));
+		for (auto &server : settings.server_names)
+			purrito.addServerName(server.name, server.options);
+	}
+	{
+		std::lock_guard<std::mutex> guard(worker_lock);
+		worker.loop = uWS::Loop::get();
+		/* open connections keep the context they started with */
+		if constexpr (SSL)
+			worker.reload = [&]() {
+				for (auto &server : settings.server_names) {
+					purrito.removeServerName(server.name);
+					purrito.addServerName(server.name,
+					                      server.options);
+				}
+			};
+		worker.drain = [&]() {
+			{
+				std::lock_guard<std::mutex> guard(worker_lock);
+				worker.listen_fds.clear();
+			}
+			for (auto listen_socket : listen_sockets)
+				us_listen_socket_close(SSL, listen_socket);
+			listen_sockets.clear();
+		};
+		worker.listen_fds = listen_fds;
+	}
+	if (listen_sockets.size() == settings.bind_ip.size()) listening++;
+	started++;
+	purrito.run();
+	std::lock_guard<std::mutex> guard(worker_lock);
+	worker = purrito_worker();
+}
+
+std::string check_certificate(const uWS::SocketContextOptions &options) {
+	std::unique_ptr<SSL_CTX, decltype(&SSL_CTX_free)> ctx(
+	    SSL_CTX_new(TLS_server_method()), SSL_CTX_free);
+	if (!ctx) return "could not create a TLS context";
+	if (options.passphrase != nullptr)
+		SSL_CTX_set_default_passwd_cb_userdata(
+		    ctx.get(), const_cast<char *>(options.passphrase));
+	std::string error;
+	if (SSL_CTX_use_certificate_chain_file(
+	        ctx.get(), options.cert_file_name) != 1)
+		error = "could not load the certificate";
+	else if (SSL_CTX_use_PrivateKey_file(ctx.get(), options.key_file_name,
+	                                     SSL_FILETYPE_PEM) != 1)
+		error = "could not load the private key";
+	else if (SSL_CTX_check_private_key(ctx.get()) != 1)
+		error = "the private key does not belong to the certificate";
+	if (!error.empty()) {
+		char reason[256];
+		ERR_error_string_n(ERR_get_error(), reason, sizeof(reason));
+		error += std::string(" - ") + reason;
+	}
+	ERR_clear_error();
+	return error;
+}
+
+extern char **environ;
+
+pid_t spawn_successor(char **argv, const std::vector<int> &listen_fds) {
+	/* everything is prepared before the fork, the child only execs */
+	static const char parent_variable[] = "PURRITO_PARENT_PID=";
+	static const char fds_variable[] = "PURRITO_LISTEN_FDS=";
+	std::string parent = parent_variable + std::to_string(getpid());
+	std::string fds = fds_variable;
+	for (auto fd : listen_fds) {
+		if (fds.size() > sizeof(fds_variable) - 1) fds += ',';
+		fds += std::to_string(fd);
+	}
+	std::vector<char *> envp;
+	for (char **variable = environ; *variable != nullptr; variable++)
+		if (std::strncmp(*variable, parent_variable,
+		                 sizeof(parent_variable) - 1) != 0 &&
+		    std::strncmp(*variable, fds_variable,
+		                 sizeof(fds_variable) - 1) != 0)
+			envp.push_back(*variable);
+	envp.push_back(&parent[0]);
+	envp.push_back(&fds[0]);
+	envp.push_back(nullptr);
+	long max_fd = sysconf(_SC_OPEN_MAX);
+	if (max_fd < 0) max_fd = 1024;
+	sigset_t none;
+	sigemptyset(&none);
+
+	pid_t pid = fork();
+	if (pid != 0) return pid;
+	/* only the listen sockets are of any use to the copy */
+	for (int fd = 3; fd < max_fd; fd++)
+		if (std::find(listen_fds.begin(), listen_fds.end(), fd) ==
+		    listen_fds.end())
+			close(fd);
+		else
+			fcntl(fd, F_SETFD, 0);
+	/* the copy blocks the signals it takes again on its own */
+	pthread_sigmask(SIG_SETMASK, &none, nullptr);
+	if (std::strchr(argv[0], '/') != nullptr)
+		execve(argv[0], argv, envp.data());
+	else {
+		environ = envp.data();
+		execvp(argv[0], argv);
+	}
+	_exit(127);
+}
+
+/* the address a socket is bound to, empty if it is not a socket */
+static std::string socket_address(const int fd) {
+	sockaddr_storage address;
+	socklen_t length = sizeof(address);
+	std::memset(&address, 0, sizeof(address));
+	if (getsockname(fd, reinterpret_cast<sockaddr *>(&address),
+	                &length) != 0)
+		return std::string();
+	return std::string(reinterpret_cast<const char *>(&address),
+	                   std::min<socklen_t>(length, sizeof(address)));
+}
+
+void purrito_handover::inherit() {
+	auto variable = std::getenv("PURRITO_LISTEN_FDS");
+	if (variable == nullptr) return;
+	std::lock_guard<std::mutex> guard(lock);
+	for (const char *next = variable; *next != '\0';) {
+		char *end;
+		long fd = std::strtol(next, &end, 10);
+		if (end == next) break;
+		/* only listening stream sockets are of any use */
+		int accepting = 0;
+		socklen_t length = sizeof(accepting);
+		if (fd > 2 && fd <= INT32_MAX &&
+		    getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &accepting,
+		               &length) == 0 &&
+		    accepting) {
+			fcntl(fd, F_SETFD, FD_CLOEXEC);
+			fds.push_back(fd);
+		}
+		next = *end == ',' ? end + 1 : end;
+	}
+}
+
+bool purrito_handover::adopt(us_listen_socket_t *listen_socket) {
+	auto poll = reinterpret_cast<us_poll_t *>(listen_socket);
+	int own = us_poll_fd(poll);
+	std::string address = socket_address(own);
+	if (address.empty()) return false;
+	int inherited = -1;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		auto match = std::find_if(fds.begin(), fds.end(), [&](int fd) {
+			return socket_address(fd) == address;
+		});
+		if (match == fds.end()) return false;
+		inherited = *match;
+		fds.erase(match);
+	}
+	/*
+	 * the inherited socket takes the place of the own one under the
+	 * same descriptor, so uSockets keeps on using it as before
+	 * NOTE: whatever the own one queued since it started listening, a
+	 *       moment ago, is lost with it
+	 */
+	auto loop = reinterpret_cast<us_loop_t *>(uWS::Loop::get());
+	int events = us_poll_events(poll);
+	us_poll_stop(poll, loop);
+	bool adopted = dup2(inherited, own) != -1;
+	if (adopted) fcntl(own, F_SETFD, FD_CLOEXEC);
+	close(inherited);
+	us_poll_start(poll, loop, events);
+	return adopted;
+}
+
+void purrito_handover::close_rest() {
+	std::lock_guard<std::mutex> guard(lock);
+	for (auto fd : fds) close(fd);
+	fds.clear();
+}
+
+void notify_service(const std::string &state) {
+	auto path = std::getenv("NOTIFY_SOCKET");
+	if (path == nullptr || (path[0] != '/' && path[0] != '@')) return;
+	sockaddr_un address;
+	std::memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	std::size_t length = std::strlen(path);
+	if (length >= sizeof(address.sun_path)) return;
+	std::memcpy(address.sun_path, path, length);
+	/* a leading @ stands for the abstract namespace */
+	if (path[0] == '@') address.sun_path[0] = '\0';
+	int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (fd == -1) return;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	if (sendto(fd, state.data(), state.size(), 0,
+	           reinterpret_cast<const sockaddr *>(&address),
+	           offsetof(sockaddr_un, sun_path) + length) == -1)
+		PLOG(LOG_WARNING, "WARNING: could not notify the service "
+		                  "manager - %s",
+		     strerror(errno));
+	close(fd);
+}
+
+/******************************************************************************/
+
+/*
+ * process the request
+ */
+template <bool SSL>
+void read_paste(const purrito_settings &settings,
+                const std::uint_fast64_t delay,
+                const std::uint_fast64_t session_id,
+                std::shared_ptr<purrito_paste> paste,
+                uWS::HttpResponse<SSL> *res) {
+	/* calculate the correct number of characters allowed in the paste */
+	uint_fast64_t max_chars = settings.max_paste_size;
+
+	/* keep a counter on how much was already read */
+	auto read_count = std::make_unique<std::uint_fast64_t>(0);
+
+	/* Log that we are starting to read the paste */
+	PLOG(LOG_INFO, "(%" PRIuFAST64 ") Starting to read the paste",
+	     session_id);
+
+	res->onData([=, &settings, read_count = std::move(read_count)](
+	                std::string_view chunk, bool is_last) {
 		if (chunk.size() > max_chars - *read_count) {
-			syslog(LOG_WARNING,
-			       "(%" PRIuFAST64
-			       ") WARNING: paste was too large, "
-			       "forced to close the request",
-			       session_id);
+			PLOG(LOG_WARNING,
+			     "(%" PRIuFAST64
+			     ") WARNING: paste was too large, "
+			     "forced to close the request",
+			     session_id);
+			res->close();
+			return;
+		}
+
+		/* remember to increment the read count */
+		*read_count = chunk.size() + *read_count;
+
+		try {
+			paste->write(settings, chunk);
+		} catch (std::system_error &ex) {
+			PLOG(LOG_WARNING,
+			     "(%" PRIuFAST64
+			     ") WARNING: error while writing the paste - %s",
+			     session_id, ex.what());
+			res->close();
+			return;
+		}
+
+		if (is_last) {
+			/* Log that we finished reading the paste */
+			PLOG(
+			    LOG_INFO,
+			    "(%" PRIuFAST64
+			    ") Finished reading a paste of size %" PRIuFAST64,
+			    session_id, *read_count);
+
+			if (*read_count == 0) {
+				if (settings.metrics)
+					settings.metrics->request(
+					    purrito_metrics::POST,
+					    purrito_metrics::BAD_REQUEST);
+				paste->to_remove = true;
+				res->writeStatus("400 Bad Request");
+				res->end("Empty Paste Data");
+				return;
+			}
+
+			complete_paste<SSL>(settings, delay, session_id, paste,
+			                    res);
+		}
+	});
+}
+
+template <bool SSL>
+void complete_paste(const purrito_settings &settings,
+                    const std::uint_fast64_t delay,
+                    const std::uint_fast64_t session_id,
+                    std::shared_ptr<purrito_paste> paste,
+                    uWS::HttpResponse<SSL> *res,
+                    std::shared_ptr<purrito_upload> upload) {
+	/* the url only goes out once the paste is written */
+	paste->flush(settings, [=, &settings]() {
+		/* the client is already gone */
+		if (paste->to_remove) return;
+		if (paste->error) {
+			PLOG(LOG_WARNING,
+			     "(%" PRIuFAST64
+			     ") WARNING: error while writing the paste - %s",
+			     session_id, strerror(paste->error));
+			res->close();
+			return;
+		}
+		try {
+			paste->publish(settings);
+		} catch (std::system_error &ex) {
+			PLOG(LOG_WARNING,
+			     "(%" PRIuFAST64
+			     ") WARNING: could not publish the paste - %s",
+			     session_id, ex.what());
+			res->close();
+			return;
+		}
+		res->cork([&]() {
+			finish_paste<SSL>(settings, delay, session_id, paste,
+			                  paste->digest(), res, upload);
+		});
+	});
+}
+
+template <bool SSL>
+void finish_paste(const purrito_settings &settings,
+                  const std::uint_fast64_t delay,
+                  const std::uint_fast64_t session_id,
+                  std::shared_ptr<purrito_paste> paste,
+                  const std::string &digest, uWS::HttpResponse<SSL> *res,
+                  std::shared_ptr<purrito_upload> upload) {
+	/*
+	 * add the records of the paste to database, the url is only returned
+	 * once the batch containing it has been committed, so the writer has
+	 * to hand the response back to this loop
+	 * NOTE: small pastes only get their final slug when they are
+	 *       stored in the database
+	 */
+	auto loop = uWS::Loop::get();
+	std::uint_fast64_t expiry = delay != 0 ? time_since_epoch(delay) : 0;
+	auto stored = std::make_shared<bool>(false);
+	auto duplicate = std::make_shared<bool>(false);
+	settings.writer->submit(
+	    [=, &settings](lmdb::txn &wtxn) {
+		    *stored = store_paste(settings, wtxn, *paste, expiry);
+		    if (*stored && !digest.empty())
+			    *duplicate = dedup_paste(wtxn, digest, paste->slug);
+		    /* kept for a client finishing it again */
+		    if (*stored && upload) {
+			    auto record = upload->record;
+			    record.length = paste->size;
+			    record.finished = time_since_epoch();
+			    record.slug = paste->slug;
+			    lmdb::dbi::open(wtxn, "uploads")
+			        .put(wtxn, upload->id, record.serialize());
+		    }
+	    },
+	    [=, &settings](bool committed) {
+		    if (committed && *stored && !digest.empty())
+			    link_dedup(settings, digest,
+			               paste->file->file_path, *duplicate);
+		    if (committed && *stored && upload)
+			    unlink(purrito_upload::path(settings, upload->id)
+			               .c_str());
+		    loop->defer([=, &settings]() {
+			    /*
+			     * the client is already gone, but once stored
+			     * the paste stays, as its records point at it
+			     */
+			    if (paste->to_remove) {
+				    if (committed && *stored)
+					    paste->to_remove = false;
+				    return;
+			    }
+			    res->cork([&]() {
+				    if (committed && *stored) {
+					    count_upload(settings, *paste);
+					    std::string paste_url =
+					        settings.domain + paste->slug +
+					        "\n";
+					    PLOG(
+					        LOG_INFO,
+					        "(%" PRIuFAST64
+					        ") Sending paste url back: %s",
+					        session_id, paste_url.c_str());
+					    res->end(paste_url);
+					    return;
+				    }
+				    paste->to_remove = true;
+				    if (settings.metrics)
+					    settings.metrics->request(
+					        purrito_metrics::POST,
+					        purrito_metrics::SERVER_ERROR);
+				    res->writeStatus(
+				        "500 Internal Server Error");
+				    res->end();
+			    });
+		    });
+	    });
+}
+
+template <bool SSL>
+void read_batch(const purrito_settings &settings,
+                const std::uint_fast64_t delay,
+                const std::uint_fast64_t session_id,
+                uWS::HttpResponse<SSL> *res) {
+	auto batch = std::make_shared<purrito_batch>();
+	/* set once the request failed, whatever else arrives is dropped */
+	auto failed = std::make_shared<bool>(false);
+	res->onAborted([=, &settings]() {
+		*failed = true;
+		batch->remove();
+		if (settings.metrics)
+			settings.metrics->aborted[purrito_metrics::POST].add();
+		PLOG(LOG_WARNING,
+		     "(%" PRIuFAST64
+		     ") WARNING: Request was prematurely aborted",
+		     session_id);
+	});
+
+	PLOG(LOG_INFO, "(%" PRIuFAST64 ") Starting to read a batch",
+	     session_id);
+
+	res->onData([=, &settings](std::string_view chunk, bool is_last) {
+		if (*failed) return;
+		auto status = purrito_metrics::OK;
+		try {
+			status = batch->feed(settings, chunk,
+			                     res->getRemoteAddress());
+		} catch (std::system_error &ex) {
+			PLOG(LOG_WARNING,
+			     "(%" PRIuFAST64
+			     ") WARNING: error while writing the batch - %s",
+			     session_id, ex.what());
+			*failed = true;
+			batch->remove();
 			res->close();
 			return;
 		}
+		if (status == purrito_metrics::OK && is_last &&
+		    !batch->complete())
+			status = purrito_metrics::BAD_REQUEST;
+		if (status != purrito_metrics::OK) {
+			PLOG(LOG_WARNING,
+			     "(%" PRIuFAST64 ") WARNING: batch was rejected",
+			     session_id);
+			*failed = true;
+			batch->remove();
+			if (settings.metrics)
+				settings.metrics->request(purrito_metrics::POST,
+				                          status);
+			const char *message = "Invalid Batch";
+			if (status == purrito_metrics::PAYLOAD_TOO_LARGE) {
+				res->writeStatus("413 Payload Too Large");
+				message = "Paste Too Large";
+			} else if (status ==
+			           purrito_metrics::TOO_MANY_REQUESTS) {
+				res->writeStatus("429 Too Many Requests");
+				message = "Too Many Requests";
+			} else
+				res->writeStatus("400 Bad Request");
+			for (auto it : settings.headers)
+				res->writeHeader(it.first, it.second);
+			if (status == purrito_metrics::TOO_MANY_REQUESTS)
+				res->writeHeader(
+				    "Retry-After",
+				    std::to_string(batch->retry_after));
+			/* the rest of the body is not read */
+			res->end(message, true);
+			return;
+		}
+		if (!is_last) return;
 
-		/* remember to increment the read count */
-		*read_count = chunk.size() + *read_count;
+		PLOG(LOG_INFO,
+		     "(%" PRIuFAST64 ") Finished reading a batch of %zu pastes",
+		     session_id, batch->pastes.size());
+		/* the urls only go out once all the pastes are written */
+		auto flushing =
+		    std::make_shared<std::size_t>(batch->pastes.size());
+		for (auto &paste : batch->pastes)
+			paste->flush(settings, [=, &settings]() {
+				if (--*flushing != 0 || *failed) return;
+				int error = 0;
+				for (auto &paste : batch->pastes)
+					if (!error) error = paste->error;
+				try {
+					if (error)
+						throw std::system_error(
+						    std::make_error_code(
+						        static_cast<std::errc>(
+						            error)));
+					for (auto &paste : batch->pastes)
+						paste->publish(settings);
+				} catch (std::system_error &ex) {
+					PLOG(LOG_WARNING,
+					     "(%" PRIuFAST64
+					     ") WARNING: could not publish "
+					     "the batch - %s",
+					     session_id, ex.what());
+					*failed = true;
+					batch->remove();
+					res->close();
+					return;
+				}
+				res->cork([&]() {
+					finish_batch<SSL>(settings, delay,
+					                  session_id, batch,
+					                  res);
+				});
+			});
+	});
+}
+
+template <bool SSL>
+void finish_batch(const purrito_settings &settings,
+                  const std::uint_fast64_t delay,
+                  const std::uint_fast64_t session_id,
+                  std::shared_ptr<purrito_batch> batch,
+                  uWS::HttpResponse<SSL> *res) {
+	auto loop = uWS::Loop::get();
+	std::uint_fast64_t expiry = delay != 0 ? time_since_epoch(delay) : 0;
+	std::vector<std::string> digests;
+	for (auto &paste : batch->pastes) digests.push_back(paste->digest());
+	auto stored = std::make_shared<bool>(false);
+	auto duplicates =
+	    std::make_shared<std::vector<char>>(batch->pastes.size(), false);
+	settings.writer->submit(
+	    [=, &settings](lmdb::txn &wtxn) {
+		    auto &pastes = batch->pastes;
+		    for (std::size_t i = 0; i < pastes.size(); i++) {
+			    if (store_paste(settings, wtxn, *pastes[i], expiry))
+				    continue;
+			    /* the others share the transaction, undo them */
+			    while (i-- > 0)
+				    unstore_paste(wtxn, *pastes[i], expiry);
+			    return;
+		    }
+		    *stored = true;
+		    for (std::size_t i = 0; i < pastes.size(); i++)
+			    if (!digests[i].empty())
+				    (*duplicates)[i] = dedup_paste(
+				        wtxn, digests[i], pastes[i]->slug);
+	    },
+	    [=, &settings](bool committed) {
+		    if (committed && *stored)
+			    for (std::size_t i = 0; i < digests.size(); i++)
+				    if (!digests[i].empty())
+					    link_dedup(settings, digests[i],
+					               batch->pastes[i]
+					                   ->file->file_path,
+					               (*duplicates)[i]);
+		    std::string paste_urls;
+		    if (committed && *stored)
+			    for (auto &paste : batch->pastes)
+				    paste_urls +=
+				        settings.domain + paste->slug + "\n";
+		    loop->defer([=, &settings]() {
+			    /*
+			     * the client is already gone, but once stored
+			     * the pastes stay, as their records point at them
+			     */
+			    if (batch->pastes.front()->to_remove) {
+				    if (committed && *stored)
+					    for (auto &paste : batch->pastes)
+						    paste->to_remove = false;
+				    return;
+			    }
+			    res->cork([&]() {
+				    if (!paste_urls.empty()) {
+					    count_upload(settings, *batch);
+					    PLOG(LOG_INFO,
+					         "(%" PRIuFAST64
+					         ") Sending %zu paste urls",
+					         session_id,
+					         batch->pastes.size());
+					    for (auto it : settings.headers)
+						    res->writeHeader(it.first,
+						                     it.second);
+					    res->end(paste_urls);
+					    return;
+				    }
+				    batch->remove();
+				    if (settings.metrics)
+					    settings.metrics->request(
+					        purrito_metrics::POST,
+					        purrito_metrics::SERVER_ERROR);
+				    res->writeStatus(
+				        "500 Internal Server Error");
+				    res->end();
+			    });
+		    });
+	    });
+}
+
+void count_upload(const purrito_settings &settings,
+                  const purrito_paste &paste) {
+	if (!settings.metrics) return;
+	settings.metrics->request(purrito_metrics::POST, purrito_metrics::OK);
+	settings.metrics->upload_bytes.observe(paste.size);
+	settings.metrics->upload_seconds.observe(
+	    std::chrono::steady_clock::now() - paste.started);
+}
 
-		int write_count = fwrite(chunk.data(), sizeof(char),
-		                         chunk.size(), pfile->file);
+bool store_paste(const purrito_settings &settings, lmdb::txn &wtxn,
+                 purrito_paste &paste, const std::uint_fast64_t expiry) {
+	if (!paste.file) {
+		auto pastes = lmdb::dbi::open(wtxn, "pastes");
+		for (std::uint_fast32_t retries = 0;
+		     !pastes.put(wtxn, paste.slug, paste.buffer,
+		                 MDB_NOOVERWRITE);
+		     retries++) {
+			if (settings.metrics)
+				settings.metrics->slug_retries.add();
+			if (retries == settings.max_retries) return false;
+			paste.slug = settings.slugs->next(wtxn);
+		}
+	}
+	if (expiry != 0) {
+		auto expiries = lmdb::dbi::open(wtxn, "expiry");
+		expiries.put(wtxn, expiry_key(expiry, paste.slug), "");
+	}
+	auto slugs = lmdb::dbi::open(wtxn, "slugs");
+	slugs.put(wtxn, paste.slug,
+	          paste.record(settings, expiry).serialize());
+	return true;
+}
+
+void count_upload(const purrito_settings &settings,
+                  const purrito_batch &batch) {
+	if (!settings.metrics) return;
+	settings.metrics->request(purrito_metrics::POST, purrito_metrics::OK);
+	for (auto &paste : batch.pastes) {
+		settings.metrics->upload_bytes.observe(paste->size);
+		settings.metrics->upload_seconds.observe(
+		    std::chrono::steady_clock::now() - paste->started);
+	}
+}
+
+void unstore_paste(lmdb::txn &wtxn, const purrito_paste &paste,
+                   const std::uint_fast64_t expiry) {
+	if (expiry != 0) {
+		auto expiries = lmdb::dbi::open(wtxn, "expiry");
+		expiries.del(wtxn, expiry_key(expiry, paste.slug));
+	}
+	auto slugs = lmdb::dbi::open(wtxn, "slugs");
+	slugs.del(wtxn, paste.slug);
+	if (!paste.file) {
+		auto pastes = lmdb::dbi::open(wtxn, "pastes");
+		pastes.del(wtxn, paste.slug);
+	}
+}
+
+std::uint_fast64_t paste_delay(const purrito_settings &settings,
+                               const std::string_view &url) {
+	std::uint_fast64_t delay = settings.default_time_limit;
+	auto delay_ = url.substr(url.find_last_of("/") + 1);
+	if (is_delay(delay_)) {
+		std::from_chars(delay_.data(), delay_.data() + delay_.size(),
+		                delay);
+		delay *= (unsigned long long)1000000000 * 60;
+	} else if (delay_ == "day")
+		delay = (unsigned long long)86400000000000;
+	else if (delay_ == "week")
+		delay = (unsigned long long)604800000000000;
+	else if (delay_ == "month")
+		delay = (unsigned long long)18144000000000000;
+	return delay;
+}
+
+template <bool SSL>
+bool rate_limited(const purrito_settings &settings,
+                  const std::uint_fast64_t session_id,
+                  uWS::HttpResponse<SSL> *res) {
+	std::uint_fast64_t retry_after;
+	if (!settings.limiter ||
+	    settings.limiter->allow(res->getRemoteAddress(), retry_after))
+		return false;
+	PLOG(LOG_INFO,
+	     "(%" PRIuFAST64 ") Rate limited - retry after %" PRIuFAST64
+	     " seconds",
+	     session_id, retry_after);
+	if (settings.metrics)
+		settings.metrics->request(purrito_metrics::POST,
+		                          purrito_metrics::TOO_MANY_REQUESTS);
+	res->writeStatus("429 Too Many Requests");
+	for (auto it : settings.headers) res->writeHeader(it.first, it.second);
+	res->writeHeader("Retry-After", std::to_string(retry_after));
+	/* the body is never read, so the connection goes */
+	res->end("Too Many Requests", true);
+	return true;
+}
+
+template <bool SSL>
+void purr_uploads(const purrito_settings &settings,
+                  uWS::TemplatedApp<SSL> &purrito) {
+	/* Log that we are getting a connection */
+	auto connection = [](auto *res, auto *req, const char *method) {
+		auto paste_ip = std::string(res->getRemoteAddressAsText());
+		auto url = std::string(req->getUrl());
+		std::uint_fast64_t session_id = rng();
+		PLOG(LOG_INFO,
+		     "(%s) Got a %s connection {%s} - session id "
+		     "(%" PRIuFAST64 ")",
+		     paste_ip.c_str(), method, url.c_str(), session_id);
+		return session_id;
+	};
+	/* ids are never lifetimes, so both go in the same place */
+	auto post = [&settings, connection](auto *res, auto *req) {
+		auto session_id = connection(res, req, "POST");
+		if (purrito_upload::is_id(req->getParameter(0)))
+			finish_upload<SSL>(settings, session_id, res, req);
+		else
+			create_upload<SSL>(settings, session_id, res, req);
+	};
+	purrito.post("/upload", post);
+	purrito.post("/upload/:id", post);
+	purrito.patch("/upload/:id",
+	              [&settings, connection](auto *res, auto *req) {
+		              append_upload<SSL>(settings,
+		                                 connection(res, req, "PATCH"),
+		                                 res, req);
+	              });
+	purrito.head("/upload/:id",
+	             [&settings, connection](auto *res, auto *req) {
+		             upload_offset<SSL>(settings,
+		                                connection(res, req, "HEAD"),
+		                                res, req);
+	             });
+}
+
+template <bool SSL>
+void create_upload(const purrito_settings &settings,
+                   const std::uint_fast64_t session_id,
+                   uWS::HttpResponse<SSL> *res, uWS::HttpRequest *req) {
+	/* every upload turns into a paste, so it counts as one already */
+	if (rate_limited<SSL>(settings, session_id, res)) return;
+	auto upload = std::make_shared<purrito_upload>();
+	upload->record.delay = paste_delay(settings, req->getUrl());
+	/* the size can be announced up front, it is then checked early */
+	auto length_ = req->getHeader("upload-length");
+	std::from_chars(length_.data(), length_.data() + length_.size(),
+	                upload->record.length);
+	if (upload->record.length > settings.max_paste_size) {
+		refuse_upload<SSL>(settings, res, purrito_metrics::POST,
+		                   purrito_metrics::PAYLOAD_TOO_LARGE,
+		                   "Paste Too Large");
+		return;
+	}
+	try {
+		upload->create(settings);
+	} catch (std::system_error &ex) {
+		PLOG(LOG_WARNING,
+		     "(%" PRIuFAST64 ") WARNING: Could not create upload - %s",
+		     session_id, ex.what());
+		refuse_upload<SSL>(settings, res, purrito_metrics::POST,
+		                   purrito_metrics::SERVER_ERROR, "");
+		return;
+	}
+	PLOG(LOG_INFO,
+	     "(%" PRIuFAST64 ") Created upload %s, paste lifetime = "
+	     "%" PRIuFAST64 "ns",
+	     session_id, upload->id.c_str(), upload->record.delay);
+
+	auto aborted = std::make_shared<bool>(false);
+	res->onAborted([=, &settings]() {
+		*aborted = true;
+		if (settings.metrics)
+			settings.metrics->aborted[purrito_metrics::POST].add();
+		PLOG(LOG_WARNING,
+		     "(%" PRIuFAST64
+		     ") WARNING: Request was prematurely aborted",
+		     session_id);
+	});
+	/* the url is only sent once the record is committed */
+	auto loop = uWS::Loop::get();
+	settings.writer->submit(
+	    [=](lmdb::txn &wtxn) {
+		    lmdb::dbi::open(wtxn, "uploads")
+		        .put(wtxn, upload->id, upload->record.serialize());
+	    },
+	    [=, &settings](bool committed) {
+		    if (!committed)
+			    unlink(purrito_upload::path(settings, upload->id)
+			               .c_str());
+		    loop->defer([=, &settings]() {
+			    /* the client is already gone */
+			    if (*aborted) return;
+			    res->cork([&]() {
+				    if (!committed) {
+					    refuse_upload<SSL>(
+					        settings, res,
+					        purrito_metrics::POST,
+					        purrito_metrics::SERVER_ERROR,
+					        "");
+					    return;
+				    }
+				    if (settings.metrics)
+					    settings.metrics->request(
+					        purrito_metrics::POST,
+					        purrito_metrics::OK);
+				    std::string upload_url = settings.domain +
+				                             "upload/" +
+				                             upload->id;
+				    res->writeStatus("201 Created");
+				    for (auto it : settings.headers)
+					    res->writeHeader(it.first,
+					                     it.second);
+				    res->writeHeader("Location", upload_url);
+				    res->writeHeader("Upload-Offset", "0");
+				    res->end(upload_url + "\n");
+			    });
+		    });
+	    });
+}
+
+template <bool SSL>
+void append_upload(const purrito_settings &settings,
+                   const std::uint_fast64_t session_id,
+                   uWS::HttpResponse<SSL> *res, uWS::HttpRequest *req) {
+	auto upload = std::make_shared<purrito_upload>(req->getParameter(0));
+	auto status = upload->open(settings, O_WRONLY, true);
+	std::string_view message =
+	    status == purrito_metrics::CONFLICT ? "Upload In Progress" : "";
+	if (status == purrito_metrics::OK && upload->record.finished != 0) {
+		status = purrito_metrics::CONFLICT;
+		message = "Upload Finished";
+	}
+	if (status != purrito_metrics::OK) {
+		refuse_upload<SSL>(settings, res, purrito_metrics::PATCH,
+		                   status, message, upload.get());
+		return;
+	}
+	/* data only ever goes at the end of what was received */
+	std::uint_fast64_t offset = 0;
+	auto offset_ = req->getHeader("upload-offset");
+	auto parsed = std::from_chars(offset_.data(),
+	                              offset_.data() + offset_.size(), offset);
+	if (offset_.empty() || parsed.ec != std::errc() ||
+	    parsed.ptr != offset_.data() + offset_.size()) {
+		refuse_upload<SSL>(settings, res, purrito_metrics::PATCH,
+		                   purrito_metrics::BAD_REQUEST,
+		                   "Missing Upload-Offset", upload.get());
+		return;
+	}
+	if (offset != upload->offset) {
+		refuse_upload<SSL>(settings, res, purrito_metrics::PATCH,
+		                   purrito_metrics::CONFLICT,
+		                   "Upload-Offset Mismatch", upload.get());
+		return;
+	}
+	std::uint_fast64_t max_size = settings.max_paste_size;
+	if (upload->record.length != 0)
+		max_size = std::min<std::uint_fast64_t>(max_size,
+		                                        upload->record.length);
+	std::uint_fast64_t content_length = 0;
+	auto length_ = req->getHeader("content-length");
+	std::from_chars(length_.data(), length_.data() + length_.size(),
+	                content_length);
+	if (offset > max_size || content_length > max_size - offset) {
+		refuse_upload<SSL>(settings, res, purrito_metrics::PATCH,
+		                   purrito_metrics::PAYLOAD_TOO_LARGE,
+		                   "Paste Too Large", upload.get());
+		return;
+	}
 
-		if (write_count < 0) {
-			syslog(LOG_WARNING,
-			       "(%" PRIuFAST64
-			       ") WARNING: error (%d) while writing to file",
-			       session_id, write_count);
+	/* whatever was written before an abort stays, to be resumed */
+	res->onAborted([=, &settings]() {
+		if (settings.metrics)
+			settings.metrics->aborted[purrito_metrics::PATCH].add();
+		PLOG(LOG_WARNING,
+		     "(%" PRIuFAST64
+		     ") WARNING: Request was prematurely aborted",
+		     session_id);
+	});
+	res->onData([=, &settings](std::string_view chunk, bool is_last) {
+		if (chunk.size() > max_size - upload->offset) {
+			PLOG(LOG_WARNING,
+			     "(%" PRIuFAST64
+			     ") WARNING: upload was too large, forced to close "
+			     "the request",
+			     session_id);
 			res->close();
 			return;
 		}
+		try {
+			upload->append(chunk);
+		} catch (std::system_error &ex) {
+			PLOG(LOG_WARNING,
+			     "(%" PRIuFAST64
+			     ") WARNING: error while writing the upload - %s",
+			     session_id, ex.what());
+			res->close();
+			return;
+		}
+		if (!is_last) return;
+		PLOG(LOG_INFO,
+		     "(%" PRIuFAST64 ") Upload %s is at offset %" PRIuFAST64,
+		     session_id, upload->id.c_str(), upload->offset);
+		if (settings.metrics)
+			settings.metrics->request(purrito_metrics::PATCH,
+			                          purrito_metrics::OK);
+		res->writeStatus("204 No Content");
+		for (auto it : settings.headers)
+			res->writeHeader(it.first, it.second);
+		res->writeHeader("Upload-Offset",
+		                 std::to_string(upload->offset));
+		res->endWithoutBody();
+	});
+}
 
-		if (is_last) {
-			/* Log that we finished reading the paste */
-			syslog(
-			    LOG_INFO,
-			    "(%" PRIuFAST64
-			    ") Finished reading a paste of size %" PRIuFAST64,
-			    session_id, *read_count);
+template <bool SSL>
+void upload_offset(const purrito_settings &settings,
+                   const std::uint_fast64_t session_id,
+                   uWS::HttpResponse<SSL> *res, uWS::HttpRequest *req) {
+	purrito_upload upload(req->getParameter(0));
+	auto status = upload.open(settings, O_RDONLY, false);
+	if (status != purrito_metrics::OK) {
+		refuse_upload<SSL>(settings, res, purrito_metrics::GET, status,
+		                   "");
+		return;
+	}
+	PLOG(LOG_INFO, "(%" PRIuFAST64 ") Upload %s is at offset %" PRIuFAST64,
+	     session_id, upload.id.c_str(), upload.offset);
+	if (settings.metrics)
+		settings.metrics->request(purrito_metrics::GET,
+		                          purrito_metrics::OK);
+	for (auto it : settings.headers) res->writeHeader(it.first, it.second);
+	res->writeHeader("Upload-Offset", std::to_string(upload.offset));
+	if (upload.record.length != 0)
+		res->writeHeader("Upload-Length",
+		                 std::to_string(upload.record.length));
+	/* the offset changes with every PATCH */
+	res->writeHeader("Cache-Control", "no-store");
+	res->endWithoutBody();
+}
 
-			if (*read_count == 0) {
-				if (pfile) pfile->to_remove = true;
-				res->writeStatus("400 Bad Request");
-				res->end("Empty Paste Data");
+template <bool SSL>
+void finish_upload(const purrito_settings &settings,
+                   const std::uint_fast64_t session_id,
+                   uWS::HttpResponse<SSL> *res, uWS::HttpRequest *req) {
+	auto upload = std::make_shared<purrito_upload>(req->getParameter(0));
+	auto status = upload->open(settings, O_RDONLY, true);
+	std::string_view message =
+	    status == purrito_metrics::CONFLICT ? "Upload In Progress" : "";
+	/* finished before, the client only missed the url */
+	if (status == purrito_metrics::OK && upload->record.finished != 0) {
+		std::string paste_url =
+		    settings.domain + upload->record.slug + "\n";
+		PLOG(LOG_INFO,
+		     "(%" PRIuFAST64 ") Upload %s was finished before, "
+		     "sending paste url back: %s",
+		     session_id, upload->id.c_str(), paste_url.c_str());
+		if (settings.metrics)
+			settings.metrics->request(purrito_metrics::POST,
+			                          purrito_metrics::OK);
+		for (auto it : settings.headers)
+			res->writeHeader(it.first, it.second);
+		res->end(paste_url);
+		return;
+	}
+	if (status == purrito_metrics::OK) {
+		if (upload->offset == 0) {
+			status = purrito_metrics::BAD_REQUEST;
+			message = "Empty Paste Data";
+		} else if (upload->offset > settings.max_paste_size) {
+			status = purrito_metrics::PAYLOAD_TOO_LARGE;
+			message = "Paste Too Large";
+		} else if (upload->record.length != 0 &&
+		           upload->offset != upload->record.length) {
+			status = purrito_metrics::CONFLICT;
+			message = "Upload Incomplete";
+		}
+	}
+	if (status != purrito_metrics::OK) {
+		refuse_upload<SSL>(settings, res, purrito_metrics::POST, status,
+		                   message, upload.get());
+		return;
+	}
+
+	/*
+	 * a file that needs no compression is published as it is, it is
+	 * only read through for the metadata of the paste
+	 */
+	bool adopt = settings.compression_level == 0 &&
+	             (settings.inline_size == 0 ||
+	              upload->offset > settings.inline_size);
+	auto upload_path = purrito_upload::path(settings, upload->id);
+	std::shared_ptr<purrito_paste> paste;
+	try {
+		if (adopt)
+			paste = std::make_shared<purrito_paste>(settings,
+			                                        upload_path);
+		else
+			paste = std::make_shared<purrito_paste>(settings,
+			                                        upload->offset);
+	} catch (std::system_error &ex) {
+		PLOG(LOG_WARNING,
+		     "(%" PRIuFAST64 ") WARNING: Could not generate file - %s",
+		     session_id, ex.what());
+		res->close();
+		return;
+	}
+	PLOG(LOG_INFO,
+	     "(%" PRIuFAST64 ") Finishing upload %s of size %" PRIuFAST64,
+	     session_id, upload->id.c_str(), upload->offset);
+	res->onAborted([=, &settings]() {
+		paste->to_remove = true;
+		if (settings.metrics)
+			settings.metrics->aborted[purrito_metrics::POST].add();
+		PLOG(LOG_WARNING,
+		     "(%" PRIuFAST64
+		     ") WARNING: Request was prematurely aborted",
+		     session_id);
+	});
+	for (auto it : settings.headers) res->writeHeader(it.first, it.second);
+	copy_upload<SSL>(settings, session_id, upload, paste, adopt, res);
+}
+
+template <bool SSL>
+void copy_upload(const purrito_settings &settings,
+                 const std::uint_fast64_t session_id,
+                 std::shared_ptr<purrito_upload> upload,
+                 std::shared_ptr<purrito_paste> paste, const bool adopt,
+                 uWS::HttpResponse<SSL> *res) {
+	/* the client is already gone */
+	if (paste->to_remove) return;
+	try {
+		if (adopt)
+			paste->scan(upload->read(paste->size));
+		else
+			paste->write(settings, upload->read(paste->size));
+	} catch (std::system_error &ex) {
+		PLOG(LOG_WARNING,
+		     "(%" PRIuFAST64
+		     ") WARNING: error while copying the upload - %s",
+		     session_id, ex.what());
+		res->close();
+		return;
+	}
+	if (paste->size < upload->offset) {
+		uWS::Loop::get()->defer([=, &settings]() {
+			if (paste->to_remove) return;
+			res->cork([&]() {
+				copy_upload<SSL>(settings, session_id, upload,
+				                 paste, adopt, res);
+			});
+		});
+		return;
+	}
+	complete_paste<SSL>(settings, upload->record.delay, session_id, paste,
+	                    res, upload);
+}
+
+template <bool SSL>
+void refuse_upload(const purrito_settings &settings,
+                   uWS::HttpResponse<SSL> *res,
+                   const purrito_metrics::method method,
+                   const purrito_metrics::status status,
+                   const std::string_view &message,
+                   const purrito_upload *upload) {
+	if (settings.metrics) settings.metrics->request(method, status);
+	switch (status) {
+		case purrito_metrics::BAD_REQUEST:
+			res->writeStatus("400 Bad Request");
+			break;
+		case purrito_metrics::NOT_FOUND:
+			res->writeStatus("404 Not Found");
+			break;
+		case purrito_metrics::CONFLICT:
+			res->writeStatus("409 Conflict");
+			break;
+		case purrito_metrics::PAYLOAD_TOO_LARGE:
+			res->writeStatus("413 Payload Too Large");
+			break;
+		default:
+			res->writeStatus("500 Internal Server Error");
+			break;
+	}
+	for (auto it : settings.headers) res->writeHeader(it.first, it.second);
+	if (upload && (upload->fd != -1 || upload->record.finished != 0))
+		res->writeHeader("Upload-Offset",
+		                 std::to_string(upload->offset));
+	/* HEAD has no body, the others have theirs left unread */
+	if (method == purrito_metrics::GET)
+		res->endWithoutBody();
+	else
+		res->end(message, true);
+}
+
+template <bool SSL>
+bool serve_inline(const purrito_settings &settings, const std::string &slug,
+                  uWS::HttpRequest *req, uWS::HttpResponse<SSL> *res,
+                  const bool head, purrito_paste_record &record) {
+	if (slug.empty()) return false;
+	try {
+		auto rtxn = lmdb::txn::begin(settings.env, nullptr, MDB_RDONLY);
+		auto slugs = lmdb::dbi::open(rtxn, "slugs");
+		std::string_view record_data;
+		if (slugs.get(rtxn, slug, record_data) &&
+		    record.parse(record_data) &&
+		    record.expired(time_since_epoch())) {
+			if (settings.metrics)
+				settings.metrics->request(
+				    purrito_metrics::GET,
+				    purrito_metrics::GONE);
+			res->writeStatus("410 Gone");
+			for (auto it : settings.headers)
+				res->writeHeader(it.first, it.second);
+			res->end();
+			return true;
+		}
+		auto pastes = lmdb::dbi::open(rtxn, "pastes");
+		std::string_view paste_data;
+		if (!pastes.get(rtxn, slug, paste_data)) return false;
+		purrito_representation paste;
+		/* the hash is in the metadata, older pastes are hashed here */
+		auto etag = record.metadata
+		                ? content_etag(record.hash, record.size)
+		                : data_etag(paste_data);
+		paste.etag = etag;
+		paste.size = paste_data.size();
+		paste.ranges = true;
+		paste.immutable = true;
+		if (record.metadata) paste.content_type = record.content_type();
+		std::uint_fast64_t offset, length;
+		if (!answer_paste<SSL>(settings, req, res, paste, offset,
+		                       length))
+			return true;
+		/* sent straight out of the memory map, no copy in between */
+		if (head)
+			res->endWithoutBody(length);
+		else
+			res->end(paste_data.substr(offset, length));
+		return true;
+	} catch (lmdb::error &ex) {
+		PLOG(LOG_WARNING,
+		     "WARNING: Caught an error while reading paste %s"
+		     " - { %d, %s }",
+		     slug.c_str(), ex.code(), ex.what());
+		return false;
+	}
+}
+
+std::shared_ptr<purrito_paste_stream> open_paste(
+    const purrito_settings &settings, const std::string &slug) {
+	/* compressed pastes are cached under the name of their file */
+	std::string gzip_slug = slug + purrito_paste_file::gzip_suffix;
+	if (settings.cache) {
+		auto cached = settings.cache->get(slug, false);
+		if (cached)
+			return std::make_shared<purrito_paste_stream>(
+			    cached.data, false, cached.modified);
+		cached = settings.cache->get(gzip_slug);
+		if (cached)
+			return std::make_shared<purrito_paste_stream>(
+			    cached.data, true, cached.modified);
+	}
+
+	auto open_file = [&](const std::string &name) {
+		auto flat = settings.storage_directory + name;
+		auto path = paste_path(settings, name);
+		/* see migrate_pastes for the order */
+		if (settings.migrating && path != flat) {
+			int fd = open(flat.c_str(), O_RDONLY);
+			if (fd != -1) return fd;
+		}
+		return open(path.c_str(), O_RDONLY);
+	};
+	bool gzip = false;
+	int fd = open_file(slug);
+	if (fd == -1) {
+		gzip = true;
+		fd = open_file(gzip_slug);
+	}
+	if (fd == -1) return nullptr;
+	struct stat paste_stat;
+	if (fstat(fd, &paste_stat) != 0 || !S_ISREG(paste_stat.st_mode)) {
+		close(fd);
+		return nullptr;
+	}
+
+	/*
+	 * pastes are only ever published complete, so any can be cached,
+	 * other files in the storage directory are never removed from the
+	 * cache by the cleaner, so they are always read from the file
+	 */
+	if (!settings.cache || !settings.cache->cacheable(paste_stat.st_size) ||
+	    !is_slug(settings, slug))
+		return std::make_shared<purrito_paste_stream>(
+		    fd, paste_stat.st_size, gzip, paste_stat.st_mtim);
+
+	auto paste_data = std::make_shared<std::string>();
+	paste_data->resize(paste_stat.st_size);
+	std::string::size_type read_count = 0;
+	while (read_count < paste_data->size()) {
+		ssize_t r = read(fd, &(*paste_data)[read_count],
+		                 paste_data->size() - read_count);
+		if (r <= 0) break;
+		read_count += r;
+	}
+	paste_data->resize(read_count);
+	close(fd);
+
+	settings.cache->put(gzip ? gzip_slug : slug,
+	                    {paste_data, paste_stat.st_mtim});
+	return std::make_shared<purrito_paste_stream>(paste_data, gzip,
+	                                              paste_stat.st_mtim);
+}
+
+bool accepts_gzip(const std::string_view &accept_encoding) {
+	std::string_view::size_type start = 0;
+	while (start < accept_encoding.size()) {
+		auto end = accept_encoding.find(',', start);
+		if (end == std::string_view::npos) end = accept_encoding.size();
+		auto coding = accept_encoding.substr(start, end - start);
+		start = end + 1;
+
+		std::string_view quality;
+		auto parameters = coding.find(';');
+		if (parameters != std::string_view::npos) {
+			quality = coding.substr(parameters + 1);
+			coding = coding.substr(0, parameters);
+		}
+		auto first = coding.find_first_not_of(" \t");
+		auto last = coding.find_last_not_of(" \t");
+		if (first == std::string_view::npos) continue;
+		coding = coding.substr(first, last - first + 1);
+		if (coding != "gzip" && coding != "x-gzip" && coding != "*")
+			continue;
+
+		/* only an explicit q=0 refuses it */
+		auto q = quality.find("q=");
+		if (q == std::string_view::npos) return true;
+		quality = quality.substr(q + 2);
+		quality = quality.substr(
+		    0, quality.find_first_not_of("0123456789."));
+		return quality.find_first_of("123456789") !=
+		       std::string_view::npos;
+	}
+	return false;
+}
+
+std::string file_etag(const struct timespec &modified,
+                      const std::uint_fast64_t size) {
+	char etag[64];
+	std::snprintf(etag, sizeof(etag), "\"%llx.%lx-%" PRIxFAST64 "\"",
+	              (unsigned long long)modified.tv_sec,
+	              (unsigned long)modified.tv_nsec, size);
+	return etag;
+}
+
+std::string data_etag(const std::string_view &data) {
+	return content_etag(fnv1a(data), data.size());
+}
+
+std::string content_etag(const std::uint64_t hash, const std::uint64_t size) {
+	char etag[40];
+	std::snprintf(etag, sizeof(etag), "\"%016" PRIx64 "-%" PRIx64 "\"",
+	              hash, size);
+	return etag;
+}
+
+bool is_slug(const purrito_settings &settings, const std::string_view &name) {
+	return name.size() == settings.slug_size &&
+	       name.find_first_not_of(settings.slug_characters) ==
+	           std::string_view::npos;
+}
+
+static const char *http_days[] = {"Sun", "Mon", "Tue", "Wed",
+                                  "Thu", "Fri", "Sat"};
+static const char *http_months[] = {"Jan", "Feb", "Mar", "Apr",
+                                    "May", "Jun", "Jul", "Aug",
+                                    "Sep", "Oct", "Nov", "Dec"};
+
+std::string http_date(const std::time_t time) {
+	struct tm date;
+	gmtime_r(&time, &date);
+	/* not strftime, the names must not depend on the locale */
+	char out[32];
+	std::snprintf(out, sizeof(out), "%s, %02d %s %04d %02d:%02d:%02d GMT",
+	              http_days[date.tm_wday], date.tm_mday,
+	              http_months[date.tm_mon], date.tm_year + 1900,
+	              date.tm_hour, date.tm_min, date.tm_sec);
+	return out;
+}
+
+std::time_t parse_http_date(const std::string_view &value) {
+	if (value.size() != 29) return -1;
+	std::string date(value);
+	struct tm parsed = {};
+	char month[4];
+	int end = 0;
+	if (std::sscanf(date.c_str(), "%*3s, %2d %3s %4d %2d:%2d:%2d GMT%n",
+	                &parsed.tm_mday, month, &parsed.tm_year,
+	                &parsed.tm_hour, &parsed.tm_min, &parsed.tm_sec,
+	                &end) != 6 ||
+	    end != 29)
+		return -1;
+	parsed.tm_mon = -1;
+	for (int m = 0; m < 12; m++)
+		if (std::strcmp(month, http_months[m]) == 0) parsed.tm_mon = m;
+	if (parsed.tm_mon == -1) return -1;
+	parsed.tm_year -= 1900;
+	return timegm(&parsed);
+}
+
+bool etag_matches(const std::string_view &header,
+                  const std::string_view &etag) {
+	std::string_view::size_type start = 0;
+	while (start < header.size()) {
+		auto end = header.find(',', start);
+		if (end == std::string_view::npos) end = header.size();
+		auto tag = header.substr(start, end - start);
+		start = end + 1;
+		auto first = tag.find_first_not_of(" \t");
+		auto last = tag.find_last_not_of(" \t");
+		if (first == std::string_view::npos) continue;
+		tag = tag.substr(first, last - first + 1);
+		if (tag == "*") return true;
+		if (tag.substr(0, 2) == "W/") tag.remove_prefix(2);
+		if (tag == etag) return true;
+	}
+	return false;
+}
+
+purrito_range parse_range(const std::string_view &header,
+                          const std::uint_fast64_t size,
+                          std::uint_fast64_t &offset,
+                          std::uint_fast64_t &length) {
+	if (header.substr(0, 6) != "bytes=") return RANGE_NONE;
+	auto spec = header.substr(6);
+	auto dash = spec.find('-');
+	if (dash == std::string_view::npos ||
+	    spec.find(',') != std::string_view::npos)
+		return RANGE_NONE;
+	auto first_ = spec.substr(0, dash), last_ = spec.substr(dash + 1);
+	std::uint_fast64_t first = 0, last = 0;
+	auto number = [](const std::string_view &digits,
+	                 std::uint_fast64_t &value) {
+		auto [end, ec] = std::from_chars(
+		    digits.data(), digits.data() + digits.size(), value);
+		return ec == std::errc() &&
+		       end == digits.data() + digits.size();
+	};
+	if (first_.empty()) {
+		/* the last bytes of the body */
+		if (!number(last_, last)) return RANGE_NONE;
+		if (last == 0 || size == 0) return RANGE_UNSATISFIABLE;
+		offset = size - std::min(last, size);
+		length = size - offset;
+		return RANGE_SATISFIABLE;
+	}
+	if (!number(first_, first)) return RANGE_NONE;
+	if (last_.empty())
+		last = size - 1;
+	else if (!number(last_, last) || last < first)
+		return RANGE_NONE;
+	if (first >= size) return RANGE_UNSATISFIABLE;
+	offset = first;
+	length = std::min(last, size - 1) - first + 1;
+	return RANGE_SATISFIABLE;
+}
+
+template <bool SSL>
+bool answer_paste(const purrito_settings &settings, uWS::HttpRequest *req,
+                  uWS::HttpResponse<SSL> *res,
+                  const purrito_representation &paste,
+                  std::uint_fast64_t &offset, std::uint_fast64_t &length) {
+	offset = 0;
+	length = paste.size;
+	std::string date;
+	std::string_view last_modified = paste.last_modified;
+	if (last_modified.empty() && paste.modified != 0) {
+		date = http_date(paste.modified);
+		last_modified = date;
+	}
+
+	/* If-Modified-Since only counts without an If-None-Match */
+	bool not_modified = false;
+	auto if_none_match = req->getHeader("if-none-match");
+	if (!if_none_match.empty())
+		not_modified = etag_matches(if_none_match, paste.etag);
+	else if (paste.modified != 0) {
+		auto since =
+		    parse_http_date(req->getHeader("if-modified-since"));
+		not_modified = since != -1 && paste.modified <= since;
+	}
+
+	purrito_range range = RANGE_NONE;
+	if (!not_modified && paste.ranges) {
+		auto range_ = req->getHeader("range");
+		/* a stale If-Range gets the whole, current, body */
+		auto if_range = req->getHeader("if-range");
+		if (!range_.empty() &&
+		    (if_range.empty() || if_range == paste.etag ||
+		     (paste.modified != 0 && if_range == last_modified)))
+			range = parse_range(range_, paste.size, offset, length);
+	}
+
+	purrito_metrics::status status = purrito_metrics::OK;
+	if (not_modified) {
+		status = purrito_metrics::NOT_MODIFIED;
+		res->writeStatus("304 Not Modified");
+	} else if (range == RANGE_SATISFIABLE) {
+		status = purrito_metrics::PARTIAL_CONTENT;
+		res->writeStatus("206 Partial Content");
+	} else if (range == RANGE_UNSATISFIABLE) {
+		status = purrito_metrics::RANGE_NOT_SATISFIABLE;
+		res->writeStatus("416 Range Not Satisfiable");
+	}
+	if (settings.metrics) {
+		settings.metrics->request(purrito_metrics::GET, status);
+		if (status == purrito_metrics::OK ||
+		    status == purrito_metrics::PARTIAL_CONTENT)
+			settings.metrics->download_bytes.observe(length);
+	}
+
+	/* a configured Content-Type goes for everything */
+	bool typed = false;
+	for (auto it : settings.headers) {
+		res->writeHeader(it.first, it.second);
+		if (strcasecmp(it.first.c_str(), "content-type") == 0)
+			typed = true;
+	}
+	res->writeHeader("ETag", paste.etag);
+	if (paste.modified != 0)
+		res->writeHeader("Last-Modified", last_modified);
+	res->writeHeader("Cache-Control",
+	                 paste.immutable ? "public, max-age=31536000, immutable"
+	                                 : "no-cache");
+	if (paste.vary) res->writeHeader("Vary", "Accept-Encoding");
+	if (not_modified) {
+		res->endWithoutBody();
+		return false;
+	}
+	if (paste.ranges) res->writeHeader("Accept-Ranges", "bytes");
+	/* formatted in place, nothing is allocated for it */
+	char content_range[80];
+	if (range == RANGE_UNSATISFIABLE) {
+		std::snprintf(content_range, sizeof(content_range),
+		              "bytes */%" PRIuFAST64, paste.size);
+		res->writeHeader("Content-Range", content_range);
+		res->end();
+		return false;
+	}
+	if (range == RANGE_SATISFIABLE) {
+		std::snprintf(content_range, sizeof(content_range),
+		              "bytes %" PRIuFAST64 "-%" PRIuFAST64
+		              "/%" PRIuFAST64,
+		              offset, offset + length - 1, paste.size);
+		res->writeHeader("Content-Range", content_range);
+	}
+	if (paste.content_type && !typed)
+		res->writeHeader("Content-Type", paste.content_type);
+	if (paste.gzip) res->writeHeader("Content-Encoding", "gzip");
+	return true;
+}
+
+/* the files the frontend is made of, as they are installed */
+static const char *frontend_files[] = {
+    "about.html", "crypto-js-4.1.1.min.js", "decrypt.js", "index.html",
+    "paste.html", "style.css",              "submit.js"};
+
+std::size_t load_assets(const purrito_settings &settings) {
+	std::vector<std::string> names(std::begin(frontend_files),
+	                               std::end(frontend_files));
+	if (std::find(names.begin(), names.end(), settings.index_file) ==
+	    names.end())
+		names.push_back(settings.index_file);
+	auto assets = std::make_shared<purrito_assets::asset_set>();
+	for (auto &name : names) {
+		auto path = settings.storage_directory + name;
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd == -1) {
+			PLOG(LOG_DEBUG, "Frontend file %s not found",
+			     path.c_str());
+			continue;
+		}
+		struct stat asset_stat;
+		if (fstat(fd, &asset_stat) != 0 ||
+		    !S_ISREG(asset_stat.st_mode)) {
+			close(fd);
+			continue;
+		}
+		purrito_asset asset;
+		asset.name = name;
+		asset.data.resize(asset_stat.st_size);
+		std::string::size_type read_count = 0;
+		while (read_count < asset.data.size()) {
+			ssize_t r = read(fd, &asset.data[read_count],
+			                 asset.data.size() - read_count);
+			if (r <= 0) break;
+			read_count += r;
+		}
+		asset.data.resize(read_count);
+		close(fd);
+		asset.etag = data_etag(asset.data);
+		asset.content_type = content_type(name);
+		asset.modified = asset_stat.st_mtim.tv_sec;
+		asset.last_modified = http_date(asset.modified);
+		/* compressed once, as hard as possible */
+		try {
+			purrito_deflate deflater(9);
+			asset.gzip =
+			    deflater.update(asset.data) + deflater.finish();
+		} catch (std::runtime_error &ex) {
+			PLOG(LOG_WARNING,
+			     "WARNING: could not compress %s - %s",
+			     path.c_str(), ex.what());
+		}
+		if (asset.gzip.size() >= asset.data.size())
+			asset.gzip.clear();
+		else {
+			asset.gzip_etag = asset.etag;
+			asset.gzip_etag.insert(asset.gzip_etag.size() - 1,
+			                       "-gzip");
+		}
+		assets->push_back(std::move(asset));
+	}
+	auto loaded = assets->size();
+	settings.assets->replace(std::move(assets));
+	return loaded;
+}
+
+const char *content_type(const std::string_view &name) {
+	static const std::pair<const char *, const char *> types[] = {
+	    {".html", "text/html; charset=utf-8"},
+	    {".css", "text/css; charset=utf-8"},
+	    {".js", "text/javascript; charset=utf-8"},
+	    {".json", "application/json"},
+	    {".txt", "text/plain; charset=utf-8"},
+	    {".svg", "image/svg+xml"},
+	    {".png", "image/png"},
+	    {".ico", "image/x-icon"}};
+	auto dot = name.find_last_of('.');
+	if (dot != std::string_view::npos)
+		for (auto &type : types)
+			if (name.substr(dot) == type.first) return type.second;
+	return "application/octet-stream";
+}
+
+template <bool SSL>
+bool serve_asset(const purrito_settings &settings,
+                 const std::string_view &name, uWS::HttpRequest *req,
+                 uWS::HttpResponse<SSL> *res, const bool head) {
+	if (!settings.assets) return false;
+	auto assets = settings.assets->get();
+	if (!assets) return false;
+	auto asset = purrito_assets::find(*assets, name);
+	if (!asset) return false;
+	purrito_representation file;
+	file.modified = asset->modified;
+	file.last_modified = asset->last_modified;
+	file.ranges = true;
+	file.content_type = asset->content_type;
+	file.gzip = !asset->gzip.empty() &&
+	            accepts_gzip(req->getHeader("accept-encoding"));
+	file.vary = !asset->gzip.empty();
+	file.etag = file.gzip ? asset->gzip_etag : asset->etag;
+	const std::string &body = file.gzip ? asset->gzip : asset->data;
+	file.size = body.size();
+	std::uint_fast64_t offset, length;
+	if (!answer_paste<SSL>(settings, req, res, file, offset, length))
+		return true;
+	if (head)
+		res->endWithoutBody(length);
+	else
+		res->end(std::string_view(body).substr(offset, length));
+	return true;
+}
+
+template <bool SSL>
+bool stream_paste(std::shared_ptr<purrito_paste_stream> stream,
+                  uWS::HttpResponse<SSL> *res) {
+	while (true) {
+		auto sent = res->getWriteOffset();
+		auto chunk = stream->chunk(stream->offset + sent)
+		                 .substr(0, stream->length - sent);
+		if (chunk.empty() && stream->length != 0) {
+			/* the file got truncated under us, nothing to save */
+			res->close();
+			return true;
+		}
+		auto [ok, done] = res->tryEnd(chunk, stream->length);
+		if (done) return true;
+		if (!ok) return false;
+	}
+}
+
+template <bool SSL>
+bool gunzip_paste(std::shared_ptr<purrito_gunzip_stream> gunzip,
+                  uWS::HttpResponse<SSL> *res) {
+	try {
+		while (true) {
+			auto chunk = gunzip->chunk();
+			if (chunk.empty()) {
+				res->end();
+				return true;
+			}
+			/* the chunk is copied out, so it may be reused after */
+			if (!res->write(chunk)) return false;
+		}
+	} catch (std::runtime_error &ex) {
+		PLOG(LOG_WARNING, "WARNING: could not decompress paste - %s",
+		     ex.what());
+		res->close();
+		return true;
+	}
+}
+
+std::string paste_path(const purrito_settings &settings,
+                       const std::string &name) {
+	/* compressed pastes go with their slug */
+	std::string_view slug(name);
+	auto suffix = std::strlen(purrito_paste_file::gzip_suffix);
+	if (slug.size() > suffix && slug.substr(slug.size() - suffix) ==
+	                                purrito_paste_file::gzip_suffix)
+		slug.remove_suffix(suffix);
+	if (settings.storage_levels == 0 ||
+	    slug.size() <= 2 * settings.storage_levels ||
+	    !is_slug(settings, slug))
+		return settings.storage_directory + name;
+	std::string path = settings.storage_directory;
+	for (unsigned int level = 0; level < settings.storage_levels; level++)
+		path.append(slug, 2 * level, 2).push_back('/');
+	return path + name;
+}
+
+bool make_directories(const purrito_settings &settings,
+                      const std::string &path) {
+	for (auto end = path.find('/', settings.storage_directory.size());
+	     end != std::string::npos; end = path.find('/', end + 1))
+		if (mkdir(path.substr(0, end).c_str(), S_IRWXU | S_IRGRP |
+		                                           S_IXGRP | S_IROTH |
+		                                           S_IXOTH) != 0 &&
+		    errno != EEXIST)
+			return false;
+	return true;
+}
+
+std::size_t migrate_pastes(const purrito_settings &settings) {
+	std::size_t moved = 0;
+	DIR *storage = opendir(settings.storage_directory.c_str());
+	if (!storage) {
+		PLOG(LOG_WARNING,
+		     "(migrator) WARNING: could not open the storage "
+		     "directory - %s",
+		     strerror(errno));
+		return moved;
+	}
+	while (auto entry = readdir(storage)) {
+		std::string name(entry->d_name);
+		auto flat = settings.storage_directory + name;
+		auto path = paste_path(settings, name);
+		/* not a paste, or not one which has to move */
+		if (path == flat) continue;
+		std::lock_guard<std::mutex> guard(settings.migration_lock);
+		if (link(flat.c_str(), path.c_str()) != 0 && errno == ENOENT &&
+		    make_directories(settings, path))
+			link(flat.c_str(), path.c_str());
+		/* it can already be there from an interrupted earlier run */
+		struct stat moved_stat;
+		if (stat(path.c_str(), &moved_stat) != 0) {
+			PLOG(LOG_WARNING,
+			     "(migrator) WARNING: could not move %s - %s",
+			     name.c_str(), strerror(errno));
+			continue;
+		}
+		unlink(flat.c_str());
+		if (++moved % 100000 == 0)
+			PLOG(LOG_INFO, "(migrator) Moved %zu pastes so far",
+			     moved);
+	}
+	closedir(storage);
+	settings.migrating = false;
+	return moved;
+}
+
+purrito_clean_stats clean_pastes(const purrito_settings &settings,
+                                 const std::size_t batch_size) {
+	purrito_clean_stats stats;
+	auto start = std::chrono::steady_clock::now();
+	/* every key sorting before this one has expired */
+	auto limit = expiry_key(time_since_epoch(), "");
+	/* last key looked at, the next batch starts after it */
+	std::string position;
+	bool more = true;
+	while (more) {
+		std::vector<std::string> keys, slugs;
+		try {
+			auto rtxn =
+			    lmdb::txn::begin(settings.env, nullptr, MDB_RDONLY);
+			auto dbi = lmdb::dbi::open(rtxn, "expiry");
+			auto cursor = lmdb::cursor::open(rtxn, dbi);
+			std::string_view key(position), value;
+			bool found;
+			if (position.empty())
+				found = cursor.get(key, value, MDB_FIRST);
+			else {
+				found = cursor.get(key, value, MDB_SET_RANGE);
+				/* skip the last one of the batch before */
+				if (found && key == position)
+					found =
+					    cursor.get(key, value, MDB_NEXT);
 			}
-			/* print out the separator */
-			syslog(LOG_INFO,
-			       "(%" PRIuFAST64 ") Sending paste url back: %s",
-			       session_id, paste_url->c_str());
-
-			/* add timestamp to database */
-			if (delay != 0) {
-				auto wtxn = lmdb::txn::begin(settings.env);
-				auto dbi = lmdb::dbi::open(wtxn, nullptr);
-				auto timestamp = time_since_epoch(delay);
-				std::string_view ts(timestamp);
-				dbi.put(wtxn, ts, pfile->slug);
-				wtxn.commit();
+			while (found && key < limit &&
+			       keys.size() < batch_size) {
+				keys.emplace_back(key);
+				slugs.emplace_back(expiry_slug(key));
+				found = cursor.get(key, value, MDB_NEXT);
 			}
-			/* and return it to the user */
-			res->end(paste_url->c_str());
+			more = found && key < limit;
+		} catch (lmdb::error &ex) {
+			PLOG(LOG_WARNING,
+			     "(cleaner) Caught an error while "
+			     "cursoring - { %d, %s }",
+			     ex.code(), ex.what());
+			break;
 		}
-	});
+		if (keys.empty()) break;
+		position = keys.back();
+
+		/* remove the files first, a crash leaves only stale records */
+		std::vector<std::pair<std::string, std::string>> cleaned;
+		for (std::size_t i = 0; i < keys.size(); i++) {
+			PLOG(LOG_INFO, "(cleaner) - %s", slugs[i].c_str());
+			std::string gzip_slug =
+			    slugs[i] + purrito_paste_file::gzip_suffix;
+			for (auto name : {slugs[i], gzip_slug}) {
+				auto path = paste_path(settings, name);
+				unlink(path.c_str());
+				if (!settings.migrating) continue;
+				/* it might be moved right now */
+				std::lock_guard<std::mutex> guard(
+				    settings.migration_lock);
+				unlink(path.c_str());
+				unlink((settings.storage_directory + name)
+				           .c_str());
+			}
+			if (settings.cache) {
+				settings.cache->erase(slugs[i]);
+				settings.cache->erase(
+				    slugs[i] + purrito_paste_file::gzip_suffix);
+			}
+			cleaned.emplace_back(std::move(keys[i]),
+			                     std::move(slugs[i]));
+		}
+
+		std::vector<std::string> unreferenced;
+		try {
+			auto wtxn = lmdb::txn::begin(settings.env);
+			auto dbi = lmdb::dbi::open(wtxn, "expiry");
+			auto slugs = lmdb::dbi::open(wtxn, "slugs");
+			auto pastes = lmdb::dbi::open(wtxn, "pastes");
+			for (auto &paste : cleaned) {
+				dbi.del(wtxn, paste.first);
+				slugs.del(wtxn, paste.second);
+				pastes.del(wtxn, paste.second);
+				auto hash = undedup_paste(wtxn, paste.second);
+				if (!hash.empty())
+					unreferenced.emplace_back(
+					    std::move(hash));
+			}
+			wtxn.commit();
+			stats.cleaned += cleaned.size();
+			stats.transactions++;
+			remove_dedup(settings, std::move(unreferenced));
+		} catch (lmdb::error &ex) {
+			PLOG(LOG_WARNING,
+			     "(cleaner) Caught an error while "
+			     "cleaning - { %d, %s }",
+			     ex.code(), ex.what());
+			break;
+		}
+	}
+
+	try {
+		auto rtxn = lmdb::txn::begin(settings.env, nullptr, MDB_RDONLY);
+		auto dbi = lmdb::dbi::open(rtxn, "expiry");
+		auto cursor = lmdb::cursor::open(rtxn, dbi);
+		limit = expiry_key(time_since_epoch(), "");
+		std::string_view key, value;
+		for (bool found = cursor.get(key, value, MDB_FIRST);
+		     found && key < limit;
+		     found = cursor.get(key, value, MDB_NEXT))
+			stats.backlog++;
+	} catch (lmdb::error &) {
+	}
+	stats.duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+	    std::chrono::steady_clock::now() - start);
+	return stats;
 }
 
-/*
- * linear time generation of random slug
- */
-std::string random_slug(const std::string &slug_characters,
-                        const std::string::size_type &slug_size) {
-	auto rslug = std::unique_ptr<char[]>(new char[slug_size + 1]);
+std::size_t clean_temporary_files(const purrito_settings &settings) {
+	std::size_t removed = 0;
+	DIR *storage = opendir(settings.storage_directory.c_str());
+	if (!storage) {
+		PLOG(LOG_WARNING,
+		     "(cleaner) WARNING: could not open the storage "
+		     "directory - %s",
+		     strerror(errno));
+		return removed;
+	}
+	auto limit = std::time(nullptr) - purrito_paste_file::stale_after;
+	std::string_view prefix(purrito_paste_file::temporary_prefix);
+	while (auto entry = readdir(storage)) {
+		std::string_view name(entry->d_name);
+		if (name.substr(0, prefix.size()) != prefix) continue;
+		auto path = settings.storage_directory + std::string(name);
+		struct stat file_stat;
+		if (stat(path.c_str(), &file_stat) == 0 &&
+		    file_stat.st_mtime < limit && unlink(path.c_str()) == 0)
+			removed++;
+	}
+	closedir(storage);
+	return removed;
+}
+
+std::size_t clean_uploads(const purrito_settings &settings) {
+	std::size_t removed = 0;
+	auto limit = std::time(nullptr) - (std::time_t)settings.upload_timeout;
+	/* remove the file if it is idle, returns true if it is gone */
+	auto remove_idle = [&](const std::string &id) {
+		auto path = purrito_upload::path(settings, id);
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd == -1) return errno == ENOENT;
+		struct stat upload_stat;
+		bool idle = flock(fd, LOCK_EX | LOCK_NB) == 0 &&
+		            fstat(fd, &upload_stat) == 0 &&
+		            upload_stat.st_mtime < limit;
+		if (idle) unlink(path.c_str());
+		close(fd);
+		return idle;
+	};
+
+	/* remove the files first, a crash leaves only stale records */
+	std::set<std::string> known, finished;
+	std::vector<std::string> abandoned;
+	auto finished_limit =
+	    time_since_epoch() - settings.upload_timeout * 1000000000;
+	try {
+		auto rtxn = lmdb::txn::begin(settings.env, nullptr, MDB_RDONLY);
+		auto dbi = lmdb::dbi::open(rtxn, "uploads");
+		auto cursor = lmdb::cursor::open(rtxn, dbi);
+		std::string_view key, value;
+		purrito_upload_record record;
+		for (bool found = cursor.get(key, value, MDB_FIRST); found;
+		     found = cursor.get(key, value, MDB_NEXT)) {
+			known.emplace(key);
+			if (!record.parse(value) || record.finished == 0)
+				continue;
+			finished.emplace(key);
+			/* left behind if finishing it was cut short */
+			unlink(purrito_upload::path(settings, key).c_str());
+			if (record.finished < finished_limit)
+				abandoned.emplace_back(key);
+		}
+	} catch (lmdb::error &ex) {
+		PLOG(LOG_WARNING,
+		     "(cleaner) Caught an error while cursoring - { %d, %s }",
+		     ex.code(), ex.what());
+		return removed;
+	}
+	for (auto &id : known)
+		if (!finished.count(id) && remove_idle(id)) {
+			PLOG(LOG_INFO, "(cleaner) - upload %s", id.c_str());
+			abandoned.push_back(id);
+		}
+	if (!abandoned.empty()) {
+		try {
+			auto wtxn = lmdb::txn::begin(settings.env);
+			auto dbi = lmdb::dbi::open(wtxn, "uploads");
+			for (auto &id : abandoned) dbi.del(wtxn, id);
+			wtxn.commit();
+			removed += abandoned.size();
+		} catch (lmdb::error &ex) {
+			PLOG(LOG_WARNING,
+			     "(cleaner) Caught an error while cleaning - "
+			     "{ %d, %s }",
+			     ex.code(), ex.what());
+		}
+	}
+
+	/* files whose record never made it into the database */
+	auto directory = settings.storage_directory + purrito_upload::directory;
+	DIR *uploads = opendir(directory.c_str());
+	if (!uploads) return removed;
+	while (auto entry = readdir(uploads)) {
+		std::string id(entry->d_name);
+		if (!purrito_upload::is_id(id) || known.count(id)) continue;
+		if (remove_idle(id)) removed++;
+	}
+	closedir(uploads);
+	return removed;
+}
+
+std::string dedup_path(const purrito_settings &settings,
+                       const std::string &hash) {
+	return settings.storage_directory + ".dedup/" + purrito_hash::hex(hash);
+}
+
+bool dedup_paste(lmdb::txn &wtxn, const std::string &hash,
+                 const std::string &slug) {
+	auto hashes = lmdb::dbi::open(wtxn, "dedup", MDB_CREATE);
+	auto slugs = lmdb::dbi::open(wtxn, "dedup_slugs", MDB_CREATE);
+	std::uint64_t references = 0;
+	std::string_view stored;
+	if (hashes.get(wtxn, hash, stored) &&
+	    stored.size() == sizeof(references))
+		std::memcpy(&references, stored.data(), sizeof(references));
+	references++;
+	hashes.put(wtxn, hash,
+	           std::string_view(reinterpret_cast<char *>(&references),
+	                            sizeof(references)));
+	slugs.put(wtxn, slug, hash);
+	return references > 1;
+}
+
+void link_dedup(const purrito_settings &settings, const std::string &hash,
+                const std::string &file_path, const bool duplicate) {
+	std::string stored_path = dedup_path(settings, hash);
+	std::string temporary_path = file_path + ".dedup";
+	if (!duplicate) {
+		if (link(file_path.c_str(), stored_path.c_str()) == 0) return;
+		/* a copy nothing referred to any more is taken over */
+		if (errno == EEXIST &&
+		    link(file_path.c_str(), temporary_path.c_str()) == 0) {
+			if (std::rename(temporary_path.c_str(),
+			                stored_path.c_str()) == 0)
+				return;
+			std::remove(temporary_path.c_str());
+		}
+		PLOG(LOG_WARNING,
+		     "(writer) WARNING: could not store %s for "
+		     "deduplication - %s",
+		     file_path.c_str(), strerror(errno));
+		return;
+	}
+	/*
+	 * replace the paste atomically, so that it is never missing, if the
+	 * stored copy is gone the paste simply keeps its own copy
+	 */
+	if (link(stored_path.c_str(), temporary_path.c_str()) != 0) return;
+	if (std::rename(temporary_path.c_str(), file_path.c_str()) != 0)
+		std::remove(temporary_path.c_str());
+}
+
+std::string undedup_paste(lmdb::txn &wtxn, const std::string &slug) {
+	auto hashes = lmdb::dbi::open(wtxn, "dedup", MDB_CREATE);
+	auto slugs = lmdb::dbi::open(wtxn, "dedup_slugs", MDB_CREATE);
+	std::string_view stored;
+	if (!slugs.get(wtxn, slug, stored)) return std::string();
+	std::string hash(stored);
+	slugs.del(wtxn, slug);
 
-	/* finally generate the random string by sampling */
-	for (std::string::size_type i = 0; i < slug_size; i++) {
-		rslug[i] = slug_characters[rng() % slug_characters.length()];
+	std::uint64_t references = 0;
+	if (hashes.get(wtxn, hash, stored) &&
+	    stored.size() == sizeof(references))
+		std::memcpy(&references, stored.data(), sizeof(references));
+	if (references > 1) {
+		references--;
+		hashes.put(wtxn, hash,
+		           std::string_view(
+		               reinterpret_cast<char *>(&references),
+		               sizeof(references)));
+		return std::string();
 	}
+	hashes.del(wtxn, hash);
+	return hash;
+}
+
+void remove_dedup(const purrito_settings &settings,
+                  std::vector<std::string> hashes) {
+	if (hashes.empty()) return;
+	auto candidates =
+	    std::make_shared<std::vector<std::string>>(std::move(hashes));
+	auto unreferenced = std::make_shared<std::vector<std::string>>();
+	/*
+	 * the completions run on the writer thread in the order of their
+	 * commits, as does link_dedup, so a paste which took the content
+	 * up again either kept its reference here or links it afterwards
+	 */
+	settings.writer->submit(
+	    [=](lmdb::txn &wtxn) {
+		    auto dbi = lmdb::dbi::open(wtxn, "dedup", MDB_CREATE);
+		    unreferenced->clear();
+		    std::string_view stored;
+		    for (auto &hash : *candidates)
+			    if (!dbi.get(wtxn, hash, stored))
+				    unreferenced->push_back(hash);
+	    },
+	    [=, &settings](bool committed) {
+		    if (!committed) return;
+		    for (auto &hash : *unreferenced)
+			    std::remove(dedup_path(settings, hash).c_str());
+	    });
+}
 
-	/* add the final character for converting back to string */
-	rslug[slug_size] = '\0';
-	std::string new_slug(rslug.get());
+std::size_t clean_dedup(const purrito_settings &settings) {
+	auto directory = settings.storage_directory + ".dedup/";
+	DIR *stored = opendir(directory.c_str());
+	if (!stored) return 0;
+	std::vector<std::string> names;
+	while (auto entry = readdir(stored)) {
+		std::string_view name(entry->d_name);
+		if (name.size() == 64 &&
+		    std::all_of(name.begin(), name.end(), [](char c) {
+			    return (c >= '0' && c <= '9') ||
+			           (c >= 'a' && c <= 'f');
+		    }))
+			names.emplace_back(name);
+	}
+	closedir(stored);
 
-	return new_slug;
+	std::vector<std::string> orphans;
+	try {
+		auto rtxn = lmdb::txn::begin(settings.env, nullptr, MDB_RDONLY);
+		auto dbi = lmdb::dbi::open(rtxn, "dedup");
+		std::string_view value;
+		for (auto &name : names) {
+			/* the raw digest the name is the hex form of */
+			std::string hash;
+			for (std::string::size_type i = 0; i < name.size();
+			     i += 2) {
+				unsigned int byte = 0;
+				std::from_chars(name.data() + i,
+				                name.data() + i + 2, byte, 16);
+				hash.push_back(static_cast<char>(byte));
+			}
+			if (!dbi.get(rtxn, hash, value))
+				orphans.push_back(std::move(hash));
+		}
+	} catch (lmdb::error &ex) {
+		PLOG(LOG_WARNING,
+		     "(cleaner) Caught an error while cursoring - { %d, %s }",
+		     ex.code(), ex.what());
+		return 0;
+	}
+	auto removed = orphans.size();
+	remove_dedup(settings, std::move(orphans));
+	return removed;
 }
 
 #endif  //_PURRITO
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2020-2021 Aisha Tammy <purrito@bsd.ac>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+
+#ifndef _PURRITO_ASSETS
+#define _PURRITO_ASSETS
+
+#include <ctime>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/*
+ * a frontend file held in memory, with everything needed to answer for
+ * it worked out once when it is loaded
+ */
+struct purrito_asset {
+	/* name of the file, as it is requested */
+	std::string name;
+	std::string data;
+	/* gzip encoded data, empty if compressing it does not pay off */
+	std::string gzip;
+	/* strong entity tags of both encodings, including their quotes */
+	std::string etag, gzip_etag;
+	const char *content_type = nullptr;
+	std::time_t modified = 0;
+	/* the modification time as it is sent in Last-Modified */
+	std::string last_modified;
+};
+
+/*
+ * the frontend files served from memory
+ * the whole set is replaced at once when it is reloaded, requests keep
+ * the set they started with alive until they are done with it, so no
+ * lock is held while answering
+ * NOTE: there are only a handful of files, looking them up one after the
+ *       other is cheaper than hashing the name
+ */
+class purrito_assets {
+       public:
+	typedef std::vector<purrito_asset> asset_set;
+
+	std::shared_ptr<const asset_set> get() const {
+		return std::atomic_load(&current);
+	}
+
+	void replace(std::shared_ptr<const asset_set> assets) {
+		std::atomic_store(&current, std::move(assets));
+	}
+
+	/* returns null if there is no file with the name */
+	static const purrito_asset *find(const asset_set &assets,
+	                                 const std::string_view &name) {
+		for (auto &asset : assets)
+			if (asset.name == name) return &asset;
+		return nullptr;
+	}
+
+       private:
+	std::shared_ptr<const asset_set> current;
+};
+
+#endif  //_PURRITO_ASSETS
@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2020-2021 Aisha Tammy <purrito@bsd.ac>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+
+#ifndef _PURRITO_CACHE
+#define _PURRITO_CACHE
+
+#include <sys/stat.h>
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+/*
+ * a cached paste body, along with the modification time of its file,
+ * which its validators are made from
+ */
+struct purrito_cached_paste {
+	std::shared_ptr<const std::string> data;
+	struct timespec modified = {};
+
+	explicit operator bool() const { return bool(data); }
+};
+
+/*
+ * bounded least recently used cache of paste bodies, keyed by slug
+ * pastes are immutable once written, so a cached body stays valid
+ * until the paste is cleaned, at which point it has to be erased
+ * NOTE: bodies are handed out as shared pointers, so an entry which
+ *       gets evicted while it is still being sent stays alive until
+ *       the last response using it is done
+ */
+class purrito_cache {
+       public:
+	/*
+	 * maximum number of bytes of paste data held in the cache
+	 */
+	const std::uint_fast64_t max_size;
+
+	/*
+	 * number of lookups answered from and missed by the cache
+	 */
+	std::atomic<std::uint_fast64_t> hits, misses;
+
+	purrito_cache(const std::uint_fast64_t max_size)
+	    : max_size(max_size), hits(0), misses(0), size(0) {}
+
+	/*
+	 * a single paste is not allowed to take more than a quarter of the
+	 * cache, otherwise one large paste would flush all the hot ones
+	 */
+	bool cacheable(const std::uint_fast64_t paste_size) const {
+		return paste_size <= max_size / 4;
+	}
+
+	/*
+	 * a lookup which is followed by another one for the same paste
+	 * under a different name does not count as a miss
+	 */
+	purrito_cached_paste get(const std::string &slug,
+	                         const bool count_miss = true) {
+		std::lock_guard<std::mutex> guard(lock);
+		auto it = index.find(slug);
+		if (it == index.end()) {
+			if (count_miss)
+				misses.fetch_add(1, std::memory_order_relaxed);
+			return {};
+		}
+		/* move it to the front, as the most recently used */
+		entries.splice(entries.begin(), entries, it->second);
+		hits.fetch_add(1, std::memory_order_relaxed);
+		return it->second->second;
+	}
+
+	void put(const std::string &slug, purrito_cached_paste paste) {
+		if (!cacheable(paste.data->size())) return;
+		std::lock_guard<std::mutex> guard(lock);
+		auto it = index.find(slug);
+		if (it != index.end()) {
+			size -= it->second->second.data->size();
+			entries.erase(it->second);
+			index.erase(it);
+		}
+		size += paste.data->size();
+		entries.emplace_front(slug, std::move(paste));
+		index[slug] = entries.begin();
+		while (size > max_size) {
+			auto &last = entries.back();
+			size -= last.second.data->size();
+			index.erase(last.first);
+			entries.pop_back();
+		}
+	}
+
+	void erase(const std::string &slug) {
+		std::lock_guard<std::mutex> guard(lock);
+		auto it = index.find(slug);
+		if (it == index.end()) return;
+		size -= it->second->second.data->size();
+		entries.erase(it->second);
+		index.erase(it);
+	}
+
+       private:
+	typedef std::list<std::pair<std::string, purrito_cached_paste>>
+	    entry_list;
+
+	std::mutex lock;
+	std::uint_fast64_t size;
+	entry_list entries;
+	std::unordered_map<std::string, entry_list::iterator> index;
+};
+
+#endif  //_PURRITO_CACHE
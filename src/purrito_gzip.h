@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2020-2021 Aisha Tammy <purrito@bsd.ac>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+
+#ifndef _PURRITO_GZIP
+#define _PURRITO_GZIP
+
+#include <zlib.h>
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+/*
+ * incremental gzip compression of a paste, fed chunk by chunk as it
+ * streams in, the output is a complete gzip file once finished
+ */
+class purrito_deflate {
+       public:
+	purrito_deflate(const int level) : zs() {
+		/* 16 on top of the window bits selects the gzip wrapper */
+		if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8,
+		                 Z_DEFAULT_STRATEGY) != Z_OK)
+			throw std::runtime_error("could not initialize gzip");
+	}
+	~purrito_deflate() { deflateEnd(&zs); }
+	purrito_deflate(const purrito_deflate &) = delete;
+	purrito_deflate &operator=(const purrito_deflate &) = delete;
+
+	/* compress a chunk, returns the output which is ready so far */
+	std::string update(const std::string_view &chunk) {
+		return run(chunk, Z_NO_FLUSH);
+	}
+
+	/* the rest of the output, nothing can be compressed afterwards */
+	std::string finish() { return run(std::string_view(), Z_FINISH); }
+
+       private:
+	z_stream zs;
+
+	std::string run(const std::string_view &chunk, const int flush) {
+		std::string output;
+		zs.next_in =
+		    reinterpret_cast<Bytef *>(const_cast<char *>(chunk.data()));
+		zs.avail_in = static_cast<uInt>(chunk.size());
+		do {
+			auto used = output.size();
+			output.resize(used + 16384);
+			zs.next_out = reinterpret_cast<Bytef *>(&output[used]);
+			zs.avail_out = 16384;
+			if (deflate(&zs, flush) == Z_STREAM_ERROR)
+				throw std::runtime_error("gzip stream broken");
+			output.resize(output.size() - zs.avail_out);
+		} while (zs.avail_out == 0);
+		return output;
+	}
+};
+
+/*
+ * incremental gzip decompression, for sending a compressed paste to a
+ * client which does not accept it compressed
+ */
+class purrito_inflate {
+       public:
+	/*
+	 * largest amount of output produced by a single call
+	 */
+	static constexpr std::string::size_type chunk_size = 65536;
+
+	/* set once the end of the gzip stream is reached */
+	bool finished;
+
+	purrito_inflate() : finished(false), zs() {
+		if (inflateInit2(&zs, 15 + 16) != Z_OK)
+			throw std::runtime_error("could not initialize gunzip");
+		output.resize(chunk_size);
+	}
+	~purrito_inflate() { inflateEnd(&zs); }
+	purrito_inflate(const purrito_inflate &) = delete;
+	purrito_inflate &operator=(const purrito_inflate &) = delete;
+
+	/*
+	 * decompress from the start of the input, as much as fits in a
+	 * single chunk of output, the number of input bytes used up is
+	 * stored in consumed, throws if the input is not valid gzip
+	 * NOTE: the output is only valid until the next call
+	 */
+	std::string_view run(const std::string_view &input,
+	                     std::string::size_type &consumed) {
+		zs.next_in =
+		    reinterpret_cast<Bytef *>(const_cast<char *>(input.data()));
+		zs.avail_in = static_cast<uInt>(input.size());
+		zs.next_out = reinterpret_cast<Bytef *>(&output[0]);
+		zs.avail_out = static_cast<uInt>(output.size());
+		int r = inflate(&zs, Z_NO_FLUSH);
+		if (r == Z_STREAM_END)
+			finished = true;
+		else if (r != Z_OK && r != Z_BUF_ERROR)
+			throw std::runtime_error("gzip stream is corrupted");
+		consumed = input.size() - zs.avail_in;
+		return std::string_view(output.data(),
+		                        output.size() - zs.avail_out);
+	}
+
+       private:
+	z_stream zs;
+	std::string output;
+};
+
+#endif  //_PURRITO_GZIP
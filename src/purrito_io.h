@@ -0,0 +1,265 @@
+/*
+ * Copyright (c) 2020-2021 Aisha Tammy <purrito@bsd.ac>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+
+#ifndef _PURRITO_IO
+#define _PURRITO_IO
+
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#if defined(PURRITO_IO_URING)
+#include <liburing.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "purrito_log.h"
+
+/*
+ * asynchronous writes of paste chunks, so that a slow disk never stalls
+ * the event loops, using io_uring where available and otherwise a small
+ * pool of threads doing blocking writes
+ * NOTE: the completion callbacks are run on an io thread, callers have
+ *       to get back to their own event loop themselves
+ */
+class purrito_io {
+       public:
+	/*
+	 * called once all of the data was written, with 0 on success
+	 * and the errno of the failed write otherwise
+	 */
+	typedef std::function<void(int)> completion;
+
+	purrito_io(const unsigned int threads)
+	    : stopping(false), threads(std::max(1u, threads)) {
+#if defined(PURRITO_IO_URING)
+		int err = io_uring_queue_init(queue_depth, &ring, 0);
+		if (err == 0) {
+			uring = true;
+			workers.emplace_back([this]() { reap(); });
+			return;
+		}
+		PLOG(LOG_WARNING,
+		     "WARNING: could not set up io_uring, falling back to "
+		     "io threads - %s",
+		     strerror(-err));
+#endif
+		for (unsigned int i = 0; i < this->threads; i++)
+			workers.emplace_back([this]() { work(); });
+	}
+
+	~purrito_io() {
+#if defined(PURRITO_IO_URING)
+		if (uring) {
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				/* an empty request tells the reaper to stop */
+				struct io_uring_sqe *sqe = get_sqe();
+				io_uring_prep_nop(sqe);
+				io_uring_sqe_set_data(sqe, nullptr);
+				io_uring_submit(&ring);
+			}
+			for (auto &worker : workers) worker.join();
+			io_uring_queue_exit(&ring);
+			return;
+		}
+#endif
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		wakeup.notify_all();
+		for (auto &worker : workers) worker.join();
+	}
+
+	/* write all of the data at the given offset of the file */
+	void write(const int fd, std::string data, const off_t offset,
+	           completion done) {
+		auto r = new request{fd, std::move(data), offset, 0,
+		                     std::move(done)};
+#if defined(PURRITO_IO_URING)
+		if (uring && submit(r)) return;
+#endif
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			queue.push_back(r);
+		}
+		wakeup.notify_one();
+	}
+
+       private:
+	struct request {
+		int fd;
+		std::string data;
+		off_t offset;
+		/* how much of the data was already written */
+		std::string::size_type written;
+		completion done;
+	};
+
+	std::mutex lock;
+	std::condition_variable wakeup;
+	std::deque<request *> queue;
+	bool stopping;
+	/* number of io threads, also when taking over from io_uring */
+	const unsigned int threads;
+	std::vector<std::thread> workers;
+
+	void work() {
+		while (true) {
+			request *r;
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				wakeup.wait(guard, [this]() {
+					return stopping || !queue.empty();
+				});
+				if (queue.empty()) return;
+				r = queue.front();
+				queue.pop_front();
+			}
+			int err = 0;
+			while (r->written < r->data.size()) {
+				ssize_t w = pwrite(r->fd, &r->data[r->written],
+				                   r->data.size() - r->written,
+				                   r->offset + r->written);
+				if (w < 0 && errno == EINTR) continue;
+				if (w <= 0) {
+					err = w < 0 ? errno : EIO;
+					break;
+				}
+				r->written += w;
+			}
+			r->done(err);
+			delete r;
+		}
+	}
+
+#if defined(PURRITO_IO_URING)
+	static constexpr unsigned int queue_depth = 256;
+
+	std::atomic<bool> uring{false};
+	struct io_uring ring;
+	/* requests handed to the kernel, needs the lock held */
+	std::unordered_set<request *> in_flight;
+
+	/* needs the lock held */
+	struct io_uring_sqe *get_sqe() {
+		struct io_uring_sqe *sqe;
+		/* the submission queue is full, push it to the kernel */
+		while (!(sqe = io_uring_get_sqe(&ring))) io_uring_submit(&ring);
+		return sqe;
+	}
+
+	/* returns false if the ring was given up, the caller queues it */
+	bool submit(request *r) {
+		std::lock_guard<std::mutex> guard(lock);
+		if (!uring) return false;
+		struct io_uring_sqe *sqe = get_sqe();
+		io_uring_prep_write(sqe, r->fd, &r->data[r->written],
+		                    r->data.size() - r->written,
+		                    r->offset + r->written);
+		io_uring_sqe_set_data(sqe, r);
+		io_uring_submit(&ring);
+		in_flight.insert(r);
+		return true;
+	}
+
+	/*
+	 * give up on a ring which stopped working, the writes still in
+	 * flight are written again from where they were, writing the same
+	 * data at the same offset twice is harmless, and io threads take
+	 * over all the writes from here on
+	 * NOTE: tearing the ring down first waits for the kernel to be done
+	 *       with the buffers of the requests
+	 */
+	void fall_back() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			uring = false;
+			io_uring_queue_exit(&ring);
+			for (auto r : in_flight) queue.push_back(r);
+			in_flight.clear();
+			for (unsigned int i = 0; i < threads; i++)
+				workers.emplace_back([this]() { work(); });
+		}
+		wakeup.notify_all();
+	}
+
+	/* queue a request the ring did not take to the io threads */
+	void resubmit(request *r) {
+		if (submit(r)) return;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			queue.push_back(r);
+		}
+		wakeup.notify_one();
+	}
+
+	void reap() {
+		while (true) {
+			struct io_uring_cqe *cqe;
+			int err = io_uring_wait_cqe(&ring, &cqe);
+			if (err == -EINTR) continue;
+			if (err < 0) {
+				PLOG(LOG_WARNING,
+				     "WARNING: io_uring stopped working, "
+				     "falling back to io threads - %s",
+				     strerror(-err));
+				fall_back();
+				return;
+			}
+			auto r = static_cast<request *>(
+			    io_uring_cqe_get_data(cqe));
+			int res = cqe->res;
+			io_uring_cqe_seen(&ring, cqe);
+			if (!r) return;
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				in_flight.erase(r);
+			}
+
+			if (res == -EINTR || res == -EAGAIN) {
+				resubmit(r);
+				continue;
+			}
+			if (res > 0) r->written += res;
+			if (res > 0 && r->written < r->data.size()) {
+				/* a short write, queue the rest */
+				resubmit(r);
+				continue;
+			}
+			r->done(res < 0 ? -res : (res == 0 ? EIO : 0));
+			delete r;
+		}
+	}
+#endif
+};
+
+#endif  //_PURRITO_IO
@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2020-2021 Aisha Tammy <purrito@bsd.ac>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+#ifndef _PURRITO_LIMIT
+#define _PURRITO_LIMIT
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string_view>
+
+/*
+ * per client token buckets, limiting how fast new pastes are accepted
+ * clients are told apart by their IPv4 address, or by the /64 prefix
+ * of their IPv6 address, as that is what a single host usually gets
+ * the buckets live in a fixed size set associative table, split into
+ * shards with their own lock, an address can only go into one of a few
+ * neighbouring slots, and when they are all taken the one idle for the
+ * longest is evicted, so memory stays bounded whatever the number of
+ * distinct addresses
+ * NOTE: an evicted client starts over with a full bucket, a table which
+ *       is too small for the clients it sees limits less than asked
+ */
+class purrito_rate_limiter {
+       public:
+	/*
+	 * number of shards, each with its own lock
+	 */
+	static constexpr std::size_t shard_count = 64;
+
+	/*
+	 * number of slots an address can go into, together they take
+	 * two cache lines
+	 */
+	static constexpr std::size_t ways = 4;
+
+	/*
+	 * tokens added every second and the most a bucket can hold
+	 */
+	const double rate, burst;
+
+	purrito_rate_limiter(const double rate, const double burst,
+	                     const std::size_t max_clients)
+	    : rate(rate),
+	      burst(burst),
+	      set_count(std::max<std::size_t>(
+	          1, max_clients / (shard_count * ways))),
+	      shards(new shard[shard_count]),
+	      start(std::chrono::steady_clock::now()) {
+		/* a secret seed, so that nobody can aim at a single set */
+		std::random_device rd;
+		seed = (std::uint64_t(rd()) << 32) | rd();
+		for (std::size_t i = 0; i < shard_count; i++)
+			shards[i].sets.reset(new set[set_count]());
+	}
+
+	/*
+	 * take a token for the client with the given raw address, as
+	 * returned by getRemoteAddress, otherwise the number of seconds
+	 * until the next one is available is left in retry_after
+	 */
+	bool allow(const std::string_view &address,
+	           std::uint_fast64_t &retry_after) {
+		std::uint64_t key[2];
+		make_key(address, key);
+		std::uint64_t h = hash(key);
+		auto &s = shards[h % shard_count];
+		slot *slots = s.sets[(h / shard_count) % set_count].slots;
+		using std::chrono::milliseconds;
+		auto elapsed = std::chrono::steady_clock::now() - start;
+		std::uint64_t now =
+		    std::chrono::duration_cast<milliseconds>(elapsed).count();
+		/* zero marks an empty slot */
+		now++;
+
+		std::lock_guard<std::mutex> guard(s.lock);
+		slot *victim = slots;
+		for (std::size_t i = 0; i < ways; i++) {
+			slot &e = slots[i];
+			if (e.last != 0 && e.key[0] == key[0] &&
+			    e.key[1] == key[1]) {
+				e.tokens = std::min(
+				    burst,
+				    e.tokens + (now - e.last) * rate / 1000);
+				e.last = now;
+				if (e.tokens >= 1) {
+					e.tokens -= 1;
+					return true;
+				}
+				retry_after = std::ceil((1 - e.tokens) / rate);
+				return false;
+			}
+			if (e.last < victim->last) victim = &e;
+		}
+		victim->key[0] = key[0];
+		victim->key[1] = key[1];
+		victim->tokens = burst - 1;
+		victim->last = now;
+		return true;
+	}
+
+       private:
+	struct slot {
+		std::uint64_t key[2];
+		double tokens;
+		/* milliseconds since the start when it was last seen */
+		std::uint64_t last;
+	};
+
+	struct alignas(64) set {
+		slot slots[ways];
+	};
+
+	struct alignas(64) shard {
+		std::mutex lock;
+		std::unique_ptr<set[]> sets;
+	};
+
+	/* number of sets in every shard */
+	const std::size_t set_count;
+	std::unique_ptr<shard[]> shards;
+	const std::chrono::steady_clock::time_point start;
+	std::uint64_t seed;
+
+	/*
+	 * IPv4 addresses, also when mapped into IPv6, are kept whole in
+	 * the low half, IPv6 ones are cut down to their /64 prefix
+	 */
+	static void make_key(const std::string_view &address,
+	                     std::uint64_t key[2]) {
+		static const unsigned char mapped[12] = {
+		    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+		key[0] = key[1] = 0;
+		if (address.size() == 4) {
+			std::memcpy(&key[1], address.data(), 4);
+			key[1] |= std::uint64_t(1) << 63;
+		} else if (address.size() == 16 &&
+		           std::memcmp(address.data(), mapped, 12) == 0) {
+			std::memcpy(&key[1], address.data() + 12, 4);
+			key[1] |= std::uint64_t(1) << 63;
+		} else
+			std::memcpy(&key[0], address.data(),
+			            std::min<std::size_t>(address.size(), 8));
+	}
+
+	/* a round of splitmix64 over both halves */
+	std::uint64_t hash(const std::uint64_t key[2]) const {
+		std::uint64_t z = key[0] ^ seed;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+		z ^= key[1];
+		z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+		return z ^ (z >> 31);
+	}
+};
+
+#endif  //_PURRITO_LIMIT
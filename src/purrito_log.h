@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2020-2021 Aisha Tammy <purrito@bsd.ac>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+
+#ifndef _PURRITO_LOG
+#define _PURRITO_LOG
+
+#include <syslog.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * the least important priority which still gets logged, the syslog
+ * priorities are used, from LOG_EMERG to LOG_DEBUG
+ * NOTE: can be changed at any time, from any thread
+ */
+inline std::atomic<int> purrito_log_level{LOG_WARNING};
+
+/*
+ * log a message with a printf style format, below the current log level
+ * this is a single relaxed load and the arguments are never evaluated
+ */
+#define PLOG(priority, ...)                                               \
+	do {                                                              \
+		if ((priority) <=                                         \
+		    purrito_log_level.load(std::memory_order_relaxed))    \
+			purrito_logger::instance().log((priority),        \
+			                               __VA_ARGS__);      \
+	} while (0)
+
+/*
+ * asynchronous logger
+ * every thread formats its messages into a ring buffer of its own, which
+ * only it writes to and only the drain thread reads from, so logging never
+ * takes a lock or makes a system call on the event loops
+ * the drain thread writes the messages out to syslog, stderr or a file
+ * NOTE: if a thread logs faster than the messages are written out, the
+ *       messages which do not fit are dropped and counted
+ */
+class purrito_logger {
+       public:
+	/*
+	 * number of messages held by the ring of every thread, and the
+	 * longest message, anything longer is cut off
+	 */
+	static constexpr std::size_t ring_size = 256;
+	static constexpr std::size_t message_size = 256;
+
+	/*
+	 * how long the drain thread sleeps when there is nothing to write
+	 */
+	static constexpr std::chrono::milliseconds drain_interval{10};
+
+	static purrito_logger &instance() {
+		static purrito_logger logger;
+		return logger;
+	}
+
+	/*
+	 * start the drain thread, writing to syslog for "syslog", to stderr
+	 * for "stderr" and appending to the file with the given path for
+	 * anything else, returns false if the file could not be opened
+	 * NOTE: until it is started, messages are written out right away
+	 */
+	bool start(const std::string &destination) {
+		if (destination == "stderr")
+			output = stderr;
+		else if (destination != "syslog") {
+			output = std::fopen(destination.c_str(), "a");
+			if (!output) return false;
+		}
+		stopping = false;
+		drain = std::thread([this]() { run(); });
+		running = true;
+		return true;
+	}
+
+	/* write out everything still queued and stop the drain thread */
+	void stop() {
+		if (!drain.joinable()) return;
+		running = false;
+		stopping = true;
+		drain.join();
+		if (output && output != stderr) std::fclose(output);
+		output = nullptr;
+	}
+
+	~purrito_logger() { stop(); }
+
+	void log(const int priority, const char *format, ...)
+	    __attribute__((format(printf, 3, 4))) {
+		std::va_list arguments;
+		va_start(arguments, format);
+		if (!running.load(std::memory_order_relaxed)) {
+			vsyslog(priority, format, arguments);
+			va_end(arguments);
+			return;
+		}
+		auto &mine = local();
+		auto head = mine.head.load(std::memory_order_relaxed);
+		if (head - mine.tail.load(std::memory_order_acquire) ==
+		    ring_size) {
+			va_end(arguments);
+			dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		auto &message = mine.messages[head % ring_size];
+		message.priority = priority;
+		message.time = std::chrono::system_clock::now();
+		std::vsnprintf(message.text, message_size, format, arguments);
+		va_end(arguments);
+		mine.head.store(head + 1, std::memory_order_release);
+	}
+
+	/*
+	 * the priority with the given name or number, -1 if there is none
+	 */
+	static int priority(const std::string &name) {
+		for (int p = LOG_EMERG; p <= LOG_DEBUG; p++)
+			if (name == names[p] || name == std::to_string(p))
+				return p;
+		return -1;
+	}
+
+	static const char *name(const int priority) {
+		return priority >= LOG_EMERG && priority <= LOG_DEBUG
+		           ? names[priority]
+		           : "unknown";
+	}
+
+	/* number of messages dropped as their ring was full */
+	std::atomic<std::uint_fast64_t> dropped{0};
+
+       private:
+	static constexpr const char *names[] = {
+	    "emerg",   "alert",  "crit", "err",
+	    "warning", "notice", "info", "debug"};
+
+	struct message {
+		int priority;
+		std::chrono::system_clock::time_point time;
+		char text[message_size];
+	};
+
+	struct ring {
+		/* number of the thread, shown with its messages */
+		unsigned int id;
+		alignas(64) std::atomic<std::size_t> head{0};
+		alignas(64) std::atomic<std::size_t> tail{0};
+		message messages[ring_size];
+	};
+
+	std::mutex lock;
+	/* rings of all the threads which have logged, never removed */
+	std::vector<std::unique_ptr<ring>> rings;
+	std::FILE *output = nullptr;
+	std::atomic<bool> running{false}, stopping{false};
+	std::thread drain;
+
+	purrito_logger() = default;
+
+	ring &local() {
+		thread_local ring *mine = nullptr;
+		if (!mine) {
+			std::lock_guard<std::mutex> guard(lock);
+			rings.push_back(std::make_unique<ring>());
+			mine = rings.back().get();
+			mine->id = rings.size() - 1;
+		}
+		return *mine;
+	}
+
+	void write(const unsigned int id, const message &m) {
+		if (!output) {
+			syslog(m.priority, "%s", m.text);
+			return;
+		}
+		auto since_epoch = m.time.time_since_epoch();
+		std::time_t seconds =
+		    std::chrono::duration_cast<std::chrono::seconds>(
+		        since_epoch)
+		        .count();
+		long micros =
+		    std::chrono::duration_cast<std::chrono::microseconds>(
+		        since_epoch)
+		        .count() %
+		    1000000;
+		struct tm utc;
+		gmtime_r(&seconds, &utc);
+		char stamp[32];
+		std::strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &utc);
+		std::fprintf(output, "%s.%06ldZ %s [%u] %s\n", stamp, micros,
+		             name(m.priority), id, m.text);
+	}
+
+	void run() {
+		std::vector<ring *> snapshot;
+		bool last = false;
+		while (true) {
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				snapshot.clear();
+				for (auto &r : rings)
+					snapshot.push_back(r.get());
+			}
+			bool written = false;
+			for (auto r : snapshot) {
+				auto tail = r->tail.load(std::memory_order_relaxed);
+				auto head = r->head.load(std::memory_order_acquire);
+				if (tail == head) continue;
+				for (; tail != head; tail++)
+					write(r->id,
+					      r->messages[tail % ring_size]);
+				written = true;
+				r->tail.store(tail, std::memory_order_release);
+			}
+			if (written && output) std::fflush(output);
+			/* one more round after being told to stop */
+			if (last) return;
+			if (stopping) last = true;
+			if (!written && !last)
+				std::this_thread::sleep_for(drain_interval);
+		}
+	}
+};
+
+#endif  //_PURRITO_LOG
@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2020-2021 Aisha Tammy <purrito@bsd.ac>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+
+#ifndef _PURRITO_METRICS
+#define _PURRITO_METRICS
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "purrito_log.h"
+
+/*
+ * counters and histograms exported in the prometheus text format
+ * everything is a relaxed atomic which is only ever added to, and every
+ * one of them sits on its own cache line, so that the workers updating
+ * them do not fight over the same line
+ * see: https://prometheus.io/docs/instrumenting/exposition_formats/
+ */
+
+/* a single counter or gauge */
+struct alignas(64) purrito_counter {
+	std::atomic<std::uint_fast64_t> value{0};
+
+	void add(const std::uint_fast64_t n = 1) {
+		value.fetch_add(n, std::memory_order_relaxed);
+	}
+	void set(const std::uint_fast64_t n) {
+		value.store(n, std::memory_order_relaxed);
+	}
+	std::uint_fast64_t get() const {
+		return value.load(std::memory_order_relaxed);
+	}
+};
+
+/*
+ * histogram with fixed bucket bounds, values are whole units such as
+ * nanoseconds or bytes and are scaled only when the histogram is written
+ * out, so that observing a value is a couple of integer additions
+ */
+class purrito_histogram {
+       public:
+	purrito_histogram(const std::vector<std::uint_fast64_t> &bounds,
+	                  const double scale = 1)
+	    : bounds(bounds),
+	      scale(scale),
+	      buckets(new purrito_counter[this->bounds.size() + 1]) {}
+
+	void observe(const std::uint_fast64_t value) {
+		auto bucket = std::lower_bound(bounds.begin(), bounds.end(),
+		                               value) -
+		              bounds.begin();
+		buckets[bucket].add();
+		sum.add(value);
+	}
+
+	void observe(const std::chrono::nanoseconds duration) {
+		observe(duration.count() > 0 ? duration.count() : 0);
+	}
+
+	/* append the samples of the histogram */
+	void write(std::string &out, const char *name) const {
+		std::uint_fast64_t count = 0;
+		for (std::vector<std::uint_fast64_t>::size_type i = 0;
+		     i <= bounds.size(); i++) {
+			count += buckets[i].get();
+			char le[32] = "+Inf";
+			if (i < bounds.size())
+				std::snprintf(le, sizeof(le), "%.10g",
+				              bounds[i] * scale);
+			out += std::string(name) + "_bucket{le=\"" + le +
+			       "\"} " + std::to_string(count) + "\n";
+		}
+		char sum_text[32];
+		std::snprintf(sum_text, sizeof(sum_text), "%.9g",
+		              sum.get() * scale);
+		out += std::string(name) + "_sum " + sum_text + "\n";
+		out += std::string(name) + "_count " + std::to_string(count) +
+		       "\n";
+	}
+
+       private:
+	const std::vector<std::uint_fast64_t> bounds;
+	const double scale;
+	const std::unique_ptr<purrito_counter[]> buckets;
+	purrito_counter sum;
+};
+
+class purrito_metrics {
+       public:
+	enum method { GET, POST, PATCH, methods };
+	enum status {
+		OK,
+		PARTIAL_CONTENT,
+		NOT_MODIFIED,
+		BAD_REQUEST,
+		NOT_FOUND,
+		CONFLICT,
+		GONE,
+		PAYLOAD_TOO_LARGE,
+		RANGE_NOT_SATISFIABLE,
+		TOO_MANY_REQUESTS,
+		SERVER_ERROR,
+		statuses
+	};
+
+	/* requests answered, by method and status */
+	purrito_counter requests[methods][statuses];
+	/* requests aborted before they were answered, by method */
+	purrito_counter aborted[methods];
+	/* paste sizes received and sent, in bytes */
+	purrito_histogram upload_bytes, download_bytes;
+	/* time from the start of an upload until its url is sent */
+	purrito_histogram upload_seconds;
+	/* time taken by the group commits of the writer */
+	purrito_histogram commit_seconds;
+	/* slugs which had to be retried, as they were already taken */
+	purrito_counter slug_retries;
+	/* results of the cleaner, the last two only of its last run */
+	purrito_counter cleaner_runs, cleaner_cleaned, cleaner_backlog,
+	    cleaner_milliseconds;
+
+	purrito_metrics()
+	    : upload_bytes(sizes()),
+	      download_bytes(sizes()),
+	      upload_seconds(durations(), 1e-9),
+	      commit_seconds(durations(), 1e-9) {}
+
+	void request(const method m, const status s) { requests[m][s].add(); }
+
+	/* everything in the prometheus text format */
+	std::string write() const {
+		static const char *method_names[] = {"GET", "POST", "PATCH"};
+		static const char *status_names[] = {
+		    "200", "206", "304", "400", "404", "409",
+		    "410", "413", "416", "429", "500"};
+		std::string out;
+		out += "# HELP purrito_requests_total Requests answered.\n"
+		       "# TYPE purrito_requests_total counter\n";
+		for (int m = 0; m < methods; m++)
+			for (int s = 0; s < statuses; s++)
+				out += std::string(
+				           "purrito_requests_total{method=\"") +
+				       method_names[m] + "\",status=\"" +
+				       status_names[s] + "\"} " +
+				       std::to_string(requests[m][s].get()) +
+				       "\n";
+		out += "# HELP purrito_aborted_requests_total Requests "
+		       "aborted before they were answered.\n"
+		       "# TYPE purrito_aborted_requests_total counter\n";
+		for (int m = 0; m < methods; m++)
+			out += std::string(
+			           "purrito_aborted_requests_total{method=\"") +
+			       method_names[m] + "\"} " +
+			       std::to_string(aborted[m].get()) + "\n";
+		histogram(out, upload_bytes, "purrito_upload_bytes",
+		          "Sizes of the received pastes.");
+		histogram(out, download_bytes, "purrito_download_bytes",
+		          "Sizes of the sent pastes.");
+		histogram(out, upload_seconds, "purrito_upload_seconds",
+		          "Time from the start of an upload until its url is "
+		          "sent.");
+		histogram(out, commit_seconds, "purrito_commit_seconds",
+		          "Time taken by the database commits of the writer.");
+		counter(out, slug_retries, "purrito_slug_retries_total",
+		        "counter", "Slugs retried as they were already taken.");
+		counter(out, cleaner_runs, "purrito_cleaner_runs_total",
+		        "counter", "Runs of the cleaner.");
+		counter(out, cleaner_cleaned, "purrito_cleaner_cleaned_total",
+		        "counter", "Expired pastes removed by the cleaner.");
+		counter(out, cleaner_backlog, "purrito_cleaner_backlog",
+		        "gauge", "Expired records left after the last run.");
+		out += "# HELP purrito_cleaner_seconds Time taken by the last "
+		       "run of the cleaner.\n"
+		       "# TYPE purrito_cleaner_seconds gauge\n"
+		       "purrito_cleaner_seconds " +
+		       std::to_string(cleaner_milliseconds.get() / 1000.0) +
+		       "\n";
+		/* kept by the logger, which does not know of the metrics */
+		out += "# HELP purrito_log_dropped_total Log messages dropped "
+		       "as they were written out too slowly.\n"
+		       "# TYPE purrito_log_dropped_total counter\n"
+		       "purrito_log_dropped_total " +
+		       std::to_string(purrito_logger::instance().dropped.load(
+		           std::memory_order_relaxed)) +
+		       "\n";
+		return out;
+	}
+
+	/* append a single counter or gauge */
+	static void counter(std::string &out, const purrito_counter &value,
+	                    const char *name, const char *type,
+	                    const char *help) {
+		out += std::string("# HELP ") + name + " " + help + "\n" +
+		       "# TYPE " + name + " " + type + "\n" + name + " " +
+		       std::to_string(value.get()) + "\n";
+	}
+
+       private:
+	static std::vector<std::uint_fast64_t> sizes() {
+		return {64,      256,     1024,     4096,
+		        16384,   65536,   262144,   1048576,
+		        4194304, 16777216, 67108864, 268435456};
+	}
+
+	/* from 100 microseconds up to 10 seconds, in nanoseconds */
+	static std::vector<std::uint_fast64_t> durations() {
+		return {100000,    250000,    500000,     1000000,
+		        2500000,   5000000,   10000000,   25000000,
+		        50000000,  100000000, 250000000,  500000000,
+		        1000000000, 2500000000, 5000000000, 10000000000};
+	}
+
+	static void histogram(std::string &out, const purrito_histogram &h,
+	                      const char *name, const char *help) {
+		out += std::string("# HELP ") + name + " " + help + "\n" +
+		       "# TYPE " + name + " histogram\n";
+		h.write(out, name);
+	}
+};
+
+#endif  //_PURRITO_METRICS
@@ -0,0 +1,256 @@
+/*
+ * Copyright (c) 2020-2021 Aisha Tammy <purrito@bsd.ac>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#ifndef _PURRITO_RECORDS
+#define _PURRITO_RECORDS
+
+#include <lmdb++.h>
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "purrito_log.h"
+
+/*
+ * records kept in the database for every paste with a lifetime
+ * "expiry" is keyed by the time the paste expires, as a big endian count
+ * of nanoseconds since the epoch followed by the slug, so that the keys
+ * sort by time and two pastes expiring in the same nanosecond never
+ * overwrite each other, the values are empty
+ * "slugs" maps every slug back to the record of its paste, so that its
+ * expiry and metadata can be found without walking the expiry keys or
+ * touching its file
+ */
+
+/*
+ * return number of nanoseconds since epoch, plus the given delay
+ */
+inline std::uint_fast64_t time_since_epoch(
+    const std::uint_fast64_t delay = 0) {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+	           std::chrono::system_clock::now().time_since_epoch())
+	           .count() +
+	       delay;
+}
+
+inline void put_be64(std::string &out, const std::uint64_t value) {
+	for (int shift = 56; shift >= 0; shift -= 8)
+		out.push_back(static_cast<char>((value >> shift) & 0xff));
+}
+
+inline std::uint64_t get_be64(const std::string_view &in) {
+	std::uint64_t value = 0;
+	for (std::size_t i = 0; i < 8 && i < in.size(); i++)
+		value = (value << 8) | static_cast<unsigned char>(in[i]);
+	return value;
+}
+
+/*
+ * FNV-1a of the data, continuing from the hash of the data before it
+ */
+inline std::uint64_t fnv1a(const std::string_view &data,
+                           std::uint64_t hash = 0xcbf29ce484222325) {
+	for (unsigned char c : data) {
+		hash ^= c;
+		hash *= 0x100000001b3;
+	}
+	return hash;
+}
+
+/*
+ * the expiry key of a paste, with an empty slug it sorts before all the
+ * keys of pastes expiring at the same time or later
+ */
+inline std::string expiry_key(const std::uint64_t time,
+                              const std::string_view &slug) {
+	std::string key;
+	key.reserve(8 + slug.size());
+	put_be64(key, time);
+	key.append(slug);
+	return key;
+}
+
+inline std::string_view expiry_slug(const std::string_view &key) {
+	return key.substr(std::min<std::size_t>(8, key.size()));
+}
+
+/*
+ * the record of a single paste in the "slugs" database, fixed width
+ * fields which later ones can be appended to
+ * NOTE: records converted from older versions only hold the expiry
+ */
+struct purrito_paste_record {
+	/* bits of the flags */
+	static constexpr std::uint8_t TEXT = 1, GZIP = 2;
+	/* size of a record with all the metadata */
+	static constexpr std::size_t metadata_size = 5 * 8 + 1;
+
+	/* time the paste expires, 0 if it never does */
+	std::uint64_t expiry = 0;
+	/* time the paste was stored */
+	std::uint64_t created = 0;
+	/* size of the paste, and of its file, which is smaller if compressed */
+	std::uint64_t size = 0, stored_size = 0;
+	/* FNV-1a of the contents of the paste */
+	std::uint64_t hash = 0;
+	std::uint8_t flags = 0;
+	/* whether everything past the expiry is known */
+	bool metadata = false;
+
+	std::string serialize() const {
+		std::string out;
+		out.reserve(metadata_size);
+		for (auto field : {expiry, created, size, stored_size, hash})
+			put_be64(out, field);
+		out.push_back(static_cast<char>(flags));
+		return out;
+	}
+
+	/* returns false if the record is too short */
+	bool parse(const std::string_view &in) {
+		if (in.size() < 8) return false;
+		expiry = get_be64(in);
+		metadata = in.size() >= metadata_size;
+		if (!metadata) return true;
+		created = get_be64(in.substr(8));
+		size = get_be64(in.substr(16));
+		stored_size = get_be64(in.substr(24));
+		hash = get_be64(in.substr(32));
+		flags = static_cast<std::uint8_t>(in[40]);
+		return true;
+	}
+
+	/* pastes without a NUL byte are taken to be text */
+	const char *content_type() const {
+		return flags & TEXT ? "text/plain; charset=utf-8"
+		                    : "application/octet-stream";
+	}
+
+	bool expired(const std::uint64_t now) const {
+		return expiry != 0 && expiry <= now;
+	}
+};
+
+/*
+ * the record of a resumable upload in the "uploads" database, keyed by its
+ * id, the data received so far is kept in a file of the same name
+ * once finished it is kept for a while with the slug of the paste, so a
+ * client that missed the url can finish it again and get the same one
+ */
+struct purrito_upload_record {
+	/* size of a record, the slug of a finished one follows it */
+	static constexpr std::size_t record_size = 3 * 8;
+	/* size of the records of older versions, without finishing time */
+	static constexpr std::size_t short_record_size = 2 * 8;
+
+	/* lifetime of the paste it turns into, in nanoseconds */
+	std::uint64_t delay = 0;
+	/*
+	 * size announced when it was created, 0 if it was not, the size
+	 * of the paste once it is finished
+	 */
+	std::uint64_t length = 0;
+	/* when it was finished, in nanoseconds since epoch, 0 if not yet */
+	std::uint64_t finished = 0;
+	/* the slug of the paste it was finished into */
+	std::string slug;
+
+	std::string serialize() const {
+		std::string out;
+		out.reserve(record_size + slug.size());
+		for (auto field : {delay, length, finished})
+			put_be64(out, field);
+		out.append(slug);
+		return out;
+	}
+
+	/* returns false if the record is too short */
+	bool parse(const std::string_view &in) {
+		if (in.size() < short_record_size) return false;
+		delay = get_be64(in);
+		length = get_be64(in.substr(8));
+		finished = 0;
+		slug.clear();
+		if (in.size() >= record_size) {
+			finished = get_be64(in.substr(16));
+			slug = in.substr(record_size);
+		}
+		return true;
+	}
+};
+
+/*
+ * convert the expiry records of older versions, keyed by a zero padded
+ * decimal timestamp in the unnamed database with the slug as value,
+ * into the current ones, in transactions of the given number of records
+ * the unnamed database also holds the names of the named databases, but
+ * those never start with a digit and sort after all the timestamps
+ * returns the number of records converted
+ */
+inline std::size_t migrate_expiry_records(lmdb::env &env,
+                                          const std::size_t batch_size) {
+	std::size_t converted = 0;
+	bool more = true;
+	while (more) {
+		auto wtxn = lmdb::txn::begin(env);
+		auto old_records = lmdb::dbi::open(wtxn, nullptr);
+		auto expiry = lmdb::dbi::open(wtxn, "expiry");
+		auto slugs = lmdb::dbi::open(wtxn, "slugs");
+		auto cursor = lmdb::cursor::open(wtxn, old_records);
+		auto is_timestamp = [](const std::string_view &key) {
+			return !key.empty() &&
+			       std::all_of(key.begin(), key.end(), [](char c) {
+				       return c >= '0' && c <= '9';
+			       });
+		};
+		std::string_view timestamp, slug;
+		std::size_t batch = 0;
+		bool found = cursor.get(timestamp, slug, MDB_FIRST);
+		while (found && is_timestamp(timestamp) && batch < batch_size) {
+			purrito_paste_record record;
+			auto parsed = std::from_chars(
+			    timestamp.data(),
+			    timestamp.data() + timestamp.size(), record.expiry);
+			/* lifetimes too long for the new keys never expire */
+			if (parsed.ec != std::errc())
+				record.expiry =
+				    std::numeric_limits<std::uint64_t>::max();
+			expiry.put(wtxn, expiry_key(record.expiry, slug), "");
+			slugs.put(wtxn, slug, record.serialize());
+			cursor.del();
+			batch++;
+			found = cursor.get(timestamp, slug, MDB_FIRST);
+		}
+		more = batch == batch_size;
+		cursor.close();
+		wtxn.commit();
+		converted += batch;
+		if (batch != 0)
+			PLOG(LOG_INFO, "Converted %zu expiry records so far",
+			     converted);
+	}
+	return converted;
+}
+
+#endif  //_PURRITO_RECORDS
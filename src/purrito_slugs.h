@@ -0,0 +1,315 @@
+/*
+ * Copyright (c) 2020-2021 Aisha Tammy <purrito@bsd.ac>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+
+#ifndef _PURRITO_SLUGS
+#define _PURRITO_SLUGS
+
+#include <lmdb++.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include "purrito_writer.h"
+
+/*
+ * keyed permutation of the numbers below the size of the slug space
+ * a balanced feistel network over the smallest even number of bits
+ * covering the space, numbers falling outside of it are walked through
+ * the network again until they land inside, which is a bijection on the
+ * space itself and takes less than four passes on average
+ */
+class purrito_slug_permutation {
+       public:
+	/*
+	 * number of distinct slugs, 0 when there are 2^64 or more of them
+	 * and the whole 64 bit range is used
+	 */
+	const std::uint64_t space;
+
+	purrito_slug_permutation(const std::uint64_t key,
+	                         const std::string::size_type slug_characters,
+	                         const std::string::size_type slug_size)
+	    : space(space_size(slug_characters, slug_size)),
+	      key(key),
+	      half_bits(half_size(space)),
+	      half_mask(half_bits == 32 ? 0xffffffffu
+	                                : (std::uint64_t(1) << half_bits) - 1) {
+	}
+
+	std::uint64_t operator()(std::uint64_t id) const {
+		if (space != 0) id %= space;
+		do
+			id = feistel(id);
+		while (space != 0 && id >= space);
+		return id;
+	}
+
+       private:
+	static constexpr int rounds = 4;
+
+	const std::uint64_t key;
+	const unsigned int half_bits;
+	const std::uint64_t half_mask;
+
+	static std::uint64_t space_size(const std::uint64_t characters,
+	                                const std::string::size_type size) {
+		std::uint64_t space = 1;
+		for (std::string::size_type i = 0; i < size; i++) {
+			if (space > UINT64_MAX / characters) return 0;
+			space *= characters;
+		}
+		return space;
+	}
+
+	static unsigned int half_size(const std::uint64_t space) {
+		if (space == 0) return 32;
+		unsigned int bits = 1;
+		while (bits < 64 && (std::uint64_t(1) << bits) < space) bits++;
+		return (bits + 1) / 2;
+	}
+
+	/* splitmix64 finalizer, keyed by the round */
+	std::uint64_t mix(std::uint64_t x, const int round) const {
+		x ^= key + 0x9e3779b97f4a7c15u * (round + 1);
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9u;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebu;
+		return x ^ (x >> 31);
+	}
+
+	std::uint64_t feistel(const std::uint64_t id) const {
+		std::uint64_t left = (id >> half_bits) & half_mask;
+		std::uint64_t right = id & half_mask;
+		for (int round = 0; round < rounds; round++) {
+			std::uint64_t next =
+			    left ^ (mix(right, round) & half_mask);
+			left = right;
+			right = next;
+		}
+		return (left << half_bits) | right;
+	}
+};
+
+/*
+ * hands out slugs which never collide with each other
+ * every slug is a sequence number passed through a keyed permutation, so
+ * they look random but can only repeat once the whole slug space has been
+ * used up, the numbers are reserved from a counter kept in the database
+ * a block at a time, and the key is stored next to it, so that restarts
+ * never hand out a slug twice either
+ * once half of a block is handed out, the next one is reserved ahead on
+ * the writer thread, so the event loops never begin a write transaction
+ * of their own unless it falls behind
+ * NOTE: slugs are only unique for the same slug characters and size, so
+ *       files are still created exclusively, just in case
+ */
+class purrito_slug_allocator {
+       public:
+	/*
+	 * number of sequence numbers reserved with a single write
+	 * transaction, a crash loses at most this many of them
+	 */
+	static constexpr std::uint64_t block_size = 1024;
+
+	purrito_slug_allocator(MDB_env *env, const std::string &slug_characters,
+	                       const std::string::size_type slug_size)
+	    : env(env),
+	      slug_characters(slug_characters),
+	      slug_size(slug_size),
+	      permutation(load_key(env), slug_characters.size(), slug_size),
+	      next_id(0),
+	      last_id(0),
+	      spare_next(0),
+	      spare_last(0),
+	      reserving(false) {}
+
+	/*
+	 * reserve the next blocks ahead through the given writer, which
+	 * has to stay around for as long as slugs are handed out
+	 */
+	void reserve_ahead(purrito_expiry_writer *writer) {
+		std::lock_guard<std::mutex> guard(lock);
+		ahead = writer;
+	}
+
+	/*
+	 * the next free slug, reserving a new block of sequence numbers in
+	 * its own write transaction if needed
+	 * NOTE: slugs up to 15 characters fit in the small string buffer
+	 *       of std::string, so no memory is allocated for them
+	 */
+	std::string next() {
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			if (next_id != last_id || take_spare()) {
+				auto slug = encode(permutation(next_id++));
+				request_spare(guard);
+				return slug;
+			}
+		}
+		/*
+		 * the write transaction is begun without holding the lock,
+		 * as the writer thread may be waiting for it inside its own
+		 */
+		auto wtxn = lmdb::txn::begin(env);
+		std::lock_guard<std::mutex> guard(lock);
+		bool reserved = next_id == last_id;
+		if (reserved) reserve(wtxn);
+		auto slug = encode(permutation(next_id++));
+		if (reserved)
+			wtxn.commit();
+		else
+			wtxn.abort();
+		return slug;
+	}
+
+	/*
+	 * the same, for callers which are already inside a write
+	 * transaction, as LMDB only allows a single one at a time
+	 */
+	std::string next(lmdb::txn &wtxn) {
+		std::unique_lock<std::mutex> guard(lock);
+		if (next_id == last_id && !take_spare()) reserve(wtxn);
+		auto slug = encode(permutation(next_id++));
+		request_spare(guard);
+		return slug;
+	}
+
+       private:
+	MDB_env *env;
+	const std::string slug_characters;
+	const std::string::size_type slug_size;
+	const purrito_slug_permutation permutation;
+	std::mutex lock;
+	/* the current block of reserved sequence numbers */
+	std::uint64_t next_id, last_id;
+	/* the block reserved ahead, empty while there is none */
+	std::uint64_t spare_next, spare_last;
+	/* whether the writer is reserving the block ahead right now */
+	bool reserving;
+	purrito_expiry_writer *ahead = nullptr;
+
+	static std::uint64_t get_number(lmdb::txn &txn, lmdb::dbi &dbi,
+	                                const std::string_view &name) {
+		std::string_view stored;
+		std::uint64_t number = 0;
+		if (dbi.get(txn, name, stored) &&
+		    stored.size() == sizeof(number))
+			std::memcpy(&number, stored.data(), sizeof(number));
+		return number;
+	}
+
+	static void put_number(lmdb::txn &txn, lmdb::dbi &dbi,
+	                       const std::string_view &name,
+	                       const std::uint64_t number) {
+		dbi.put(txn, name,
+		        std::string_view(
+		            reinterpret_cast<const char *>(&number),
+		            sizeof(number)));
+	}
+
+	/* the permutation key, generated on the very first start */
+	static std::uint64_t load_key(MDB_env *env) {
+		auto wtxn = lmdb::txn::begin(env);
+		auto meta = lmdb::dbi::open(wtxn, "meta", MDB_CREATE);
+		std::uint64_t key = get_number(wtxn, meta, "slug_key");
+		if (key == 0) {
+			std::random_device device;
+			while (key == 0)
+				key = (std::uint64_t(device()) << 32) ^
+				      device();
+			put_number(wtxn, meta, "slug_key", key);
+		}
+		wtxn.commit();
+		return key;
+	}
+
+	/*
+	 * move the stored counter a block ahead, if the transaction is
+	 * aborted the counter stays behind, so it is never trusted to be
+	 * ahead of the numbers already handed out
+	 */
+	void reserve(lmdb::txn &wtxn) {
+		auto meta = lmdb::dbi::open(wtxn, "meta", MDB_CREATE);
+		std::uint64_t stored = get_number(wtxn, meta, "slug_next");
+		next_id = std::max({stored, last_id, spare_last});
+		last_id = next_id + block_size;
+		put_number(wtxn, meta, "slug_next", last_id);
+	}
+
+	/* move on to the block reserved ahead, false if there is none */
+	bool take_spare() {
+		if (spare_next == spare_last) return false;
+		next_id = spare_next;
+		last_id = spare_last;
+		spare_next = spare_last = 0;
+		return true;
+	}
+
+	/*
+	 * once half of the current block is handed out, have the writer
+	 * reserve the next one, it is only used once that is committed
+	 * NOTE: the lock is released before submitting, as the writer
+	 *       takes it inside its own transaction
+	 */
+	void request_spare(std::unique_lock<std::mutex> &guard) {
+		if (!ahead || reserving || spare_next != spare_last ||
+		    last_id - next_id > block_size / 2)
+			return;
+		reserving = true;
+		guard.unlock();
+		auto reserved = std::make_shared<std::uint64_t>(0);
+		ahead->submit(
+		    [this, reserved](lmdb::txn &wtxn) {
+			    std::lock_guard<std::mutex> guard(lock);
+			    auto meta =
+			        lmdb::dbi::open(wtxn, "meta", MDB_CREATE);
+			    *reserved = std::max(
+			        {get_number(wtxn, meta, "slug_next"), last_id,
+			         spare_last});
+			    put_number(wtxn, meta, "slug_next",
+			               *reserved + block_size);
+		    },
+		    [this, reserved](bool committed) {
+			    std::lock_guard<std::mutex> guard(lock);
+			    reserving = false;
+			    /* the current block may have moved past it */
+			    if (committed && *reserved >= last_id) {
+				    spare_next = *reserved;
+				    spare_last = *reserved + block_size;
+			    }
+		    });
+	}
+
+	std::string encode(std::uint64_t id) const {
+		std::string slug(slug_size, slug_characters[0]);
+		for (auto i = slug_size; i > 0 && id != 0; i--) {
+			slug[i - 1] =
+			    slug_characters[id % slug_characters.size()];
+			id /= slug_characters.size();
+		}
+		return slug;
+	}
+};
+
+#endif  //_PURRITO_SLUGS
@@ -0,0 +1,339 @@
+/*
+ * Copyright (c) 2020-2021 Aisha Tammy <purrito@bsd.ac>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#ifndef _PURRITO_TLS
+#define _PURRITO_TLS
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * session resumption shared by all the workers
+ * every worker has a TLS context of its own, so left alone each of them
+ * would encrypt its session tickets with its own random keys and keep
+ * its own session cache, and a client coming back on a connection which
+ * the kernel hands to another worker would go through a full handshake
+ * again, instead they all use the same ticket keys and session cache
+ * the ticket keys are either read from a file, so that they are also
+ * shared with other servers and survive restarts, or made up at start
+ * and rotated every session lifetime, with the previous key kept around
+ * to still decrypt the tickets it made
+ * NOTE: OpenSSL takes the tickets and the cache from the context the
+ *       connection was accepted on, even after the server name callback
+ *       switched it to the context of one of the names, so only the
+ *       default context of every worker has to be set up
+ */
+class purrito_tls {
+       public:
+	/*
+	 * bytes of a ticket key, its name, hmac key and aes key
+	 * the same layout as the ticket keys of nginx
+	 */
+	static constexpr std::size_t key_size = 80;
+
+	/*
+	 * most sessions held in the cache, the oldest are dropped first
+	 */
+	static constexpr std::size_t cache_entries = 20000;
+
+	/*
+	 * file the ticket keys are read from, empty to make them up
+	 */
+	const std::string key_file;
+
+	/*
+	 * seconds a session can be resumed for, 0 to never resume
+	 */
+	const std::uint_fast64_t lifetime;
+
+	/*
+	 * client hellos seen, and handshakes which resumed a session from
+	 * a ticket or from the cache instead of doing a full one
+	 */
+	std::atomic<std::uint_fast64_t> handshakes, ticket_resumptions,
+	    cache_resumptions;
+
+	purrito_tls(const std::string &key_file,
+	            const std::uint_fast64_t lifetime)
+	    : key_file(key_file),
+	      lifetime(lifetime),
+	      handshakes(0),
+	      ticket_resumptions(0),
+	      cache_resumptions(0) {
+		active = this;
+	}
+
+	/*
+	 * read the ticket keys from the file, the first one encrypts new
+	 * tickets and all of them decrypt, without a file a new key is made
+	 * returns a description of what went wrong, empty if nothing did
+	 */
+	std::string load_keys() {
+		std::vector<ticket_key> loaded;
+		if (key_file.empty()) {
+			loaded.resize(1);
+			if (!new_key(loaded[0]))
+				return "could not make a ticket key";
+		} else {
+			std::ifstream input(key_file, std::ios::binary);
+			if (!input) return "could not open the ticket keys";
+			std::string data(
+			    (std::istreambuf_iterator<char>(input)),
+			    std::istreambuf_iterator<char>());
+			if (data.empty() || data.size() % key_size != 0)
+				return "the ticket keys file has to be made "
+				       "of 80 byte keys";
+			loaded.resize(data.size() / key_size);
+			for (std::size_t i = 0; i < loaded.size(); i++)
+				std::memcpy(&loaded[i],
+				            data.data() + i * key_size,
+				            key_size);
+		}
+		std::lock_guard<std::mutex> guard(key_lock);
+		keys = std::move(loaded);
+		made = std::chrono::steady_clock::now();
+		return "";
+	}
+
+	/*
+	 * set up the default TLS context of a worker
+	 */
+	void attach(SSL_CTX *ctx) {
+		SSL_CTX_set_client_hello_cb(ctx, client_hello, this);
+		if (lifetime == 0) {
+			SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+			SSL_CTX_set_session_cache_mode(ctx,
+			                               SSL_SESS_CACHE_OFF);
+			return;
+		}
+		SSL_CTX_set_timeout(ctx, lifetime);
+		SSL_CTX_set_session_cache_mode(
+		    ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+		SSL_CTX_sess_set_new_cb(ctx, new_session);
+		SSL_CTX_sess_set_get_cb(ctx, get_session);
+		SSL_CTX_sess_set_remove_cb(ctx, remove_session);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_callback);
+#else
+		SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticket_callback);
+#endif
+	}
+
+       private:
+	struct ticket_key {
+		unsigned char name[16], hmac[32], aes[32];
+	};
+	static_assert(sizeof(ticket_key) == key_size,
+	              "ticket keys are not padded");
+
+	/*
+	 * the callbacks for the tickets and the cache only get the
+	 * connection, there is only ever one of these in a process
+	 */
+	static inline purrito_tls *active = nullptr;
+
+	std::mutex key_lock;
+	std::vector<ticket_key> keys;
+	std::chrono::steady_clock::time_point made;
+
+	/*
+	 * a cached session, with its place in the order they were added,
+	 * so that it leaves the order along with the cache
+	 */
+	struct cached_session {
+		std::string data;
+		std::list<std::string>::iterator order;
+	};
+
+	std::mutex cache_lock;
+	std::unordered_map<std::string, cached_session> sessions;
+	std::list<std::string> session_order;
+
+	static bool new_key(ticket_key &key) {
+		return RAND_bytes(reinterpret_cast<unsigned char *>(&key),
+		                  key_size) == 1;
+	}
+
+	static int client_hello(SSL *, int *, void *arg) {
+		static_cast<purrito_tls *>(arg)->handshakes++;
+		return SSL_CLIENT_HELLO_SUCCESS;
+	}
+
+	/*
+	 * pick the key of a ticket and set up its cipher, handing back its
+	 * hmac key, the result is the one the ticket callbacks return
+	 * -1 on errors, 0 for an unknown key, 1 if it can be used and 2
+	 * if the ticket should be replaced by one with the current key
+	 * NOTE: TLS 1.3 clients use a ticket only once, without a new one
+	 *       they would do a full handshake on their next connection
+	 */
+	int ticket(SSL *ssl, unsigned char *name, unsigned char *iv,
+	           EVP_CIPHER_CTX *cipher, unsigned char *hmac,
+	           const int encrypt) {
+		std::lock_guard<std::mutex> guard(key_lock);
+		if (keys.empty()) return -1;
+		if (encrypt) {
+			/* made up keys are rotated, ones from a file never */
+			auto now = std::chrono::steady_clock::now();
+			if (key_file.empty() &&
+			    now - made >= std::chrono::seconds(lifetime)) {
+				ticket_key key;
+				if (new_key(key)) {
+					keys.insert(keys.begin(), key);
+					keys.resize(2);
+					made = now;
+				}
+			}
+			if (RAND_bytes(iv, EVP_CIPHER_iv_length(
+			                       EVP_aes_256_cbc())) != 1)
+				return -1;
+			std::memcpy(name, keys[0].name, sizeof(keys[0].name));
+			std::memcpy(hmac, keys[0].hmac, sizeof(keys[0].hmac));
+			return EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(),
+			                          nullptr, keys[0].aes,
+			                          iv) == 1
+			           ? 1
+			           : -1;
+		}
+		for (std::size_t i = 0; i < keys.size(); i++) {
+			if (std::memcmp(name, keys[i].name,
+			                sizeof(keys[i].name)) != 0)
+				continue;
+			std::memcpy(hmac, keys[i].hmac, sizeof(keys[i].hmac));
+			if (EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(),
+			                       nullptr, keys[i].aes, iv) != 1)
+				return -1;
+			ticket_resumptions++;
+			return i == 0 && SSL_version(ssl) < TLS1_3_VERSION ? 1
+			                                                   : 2;
+		}
+		return 0;
+	}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	static int ticket_callback(SSL *ssl, unsigned char *name,
+	                           unsigned char *iv, EVP_CIPHER_CTX *cipher,
+	                           EVP_MAC_CTX *mac, int encrypt) {
+		unsigned char hmac[32];
+		int result =
+		    active->ticket(ssl, name, iv, cipher, hmac, encrypt);
+		if (result <= 0) return result;
+		OSSL_PARAM params[] = {
+		    OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, hmac,
+		                                      sizeof(hmac)),
+		    OSSL_PARAM_construct_utf8_string(
+		        OSSL_MAC_PARAM_DIGEST, const_cast<char *>("SHA256"), 0),
+		    OSSL_PARAM_construct_end()};
+		return EVP_MAC_CTX_set_params(mac, params) == 1 ? result : -1;
+	}
+#else
+	static int ticket_callback(SSL *ssl, unsigned char *name,
+	                           unsigned char *iv, EVP_CIPHER_CTX *cipher,
+	                           HMAC_CTX *mac, int encrypt) {
+		unsigned char hmac[32];
+		int result =
+		    active->ticket(ssl, name, iv, cipher, hmac, encrypt);
+		if (result <= 0) return result;
+		return HMAC_Init_ex(mac, hmac, sizeof(hmac), EVP_sha256(),
+		                    nullptr) == 1
+		           ? result
+		           : -1;
+	}
+#endif
+
+	static std::string session_key(const SSL_SESSION *session) {
+		unsigned int length;
+		auto id = SSL_SESSION_get_id(session, &length);
+		return std::string(reinterpret_cast<const char *>(id), length);
+	}
+
+	/*
+	 * sessions are kept serialized, the cache does not hold on to any
+	 * TLS 1.3 resumes from tickets only, its sessions are not looked up
+	 */
+	static int new_session(SSL *ssl, SSL_SESSION *session) {
+		if (SSL_version(ssl) >= TLS1_3_VERSION) return 0;
+		int length = i2d_SSL_SESSION(session, nullptr);
+		if (length <= 0) return 0;
+		std::string data(length, '\0');
+		auto out = reinterpret_cast<unsigned char *>(&data[0]);
+		i2d_SSL_SESSION(session, &out);
+		auto key = session_key(session);
+		std::lock_guard<std::mutex> guard(active->cache_lock);
+		/* a session added again moves to the back of the order */
+		active->erase_session(key);
+		while (active->session_order.size() >= cache_entries) {
+			active->sessions.erase(active->session_order.front());
+			active->session_order.pop_front();
+		}
+		auto order = active->session_order.insert(
+		    active->session_order.end(), key);
+		active->sessions.emplace(
+		    std::move(key), cached_session{std::move(data), order});
+		return 0;
+	}
+
+	static SSL_SESSION *get_session(SSL *, const unsigned char *id,
+	                                int length, int *copy) {
+		*copy = 0;
+		std::string data;
+		{
+			std::lock_guard<std::mutex> guard(active->cache_lock);
+			auto found = active->sessions.find(std::string(
+			    reinterpret_cast<const char *>(id), length));
+			if (found == active->sessions.end()) return nullptr;
+			data = found->second.data;
+		}
+		auto in = reinterpret_cast<const unsigned char *>(data.data());
+		auto session = d2i_SSL_SESSION(nullptr, &in, data.size());
+		if (session) active->cache_resumptions++;
+		return session;
+	}
+
+	static void remove_session(SSL_CTX *, SSL_SESSION *session) {
+		std::lock_guard<std::mutex> guard(active->cache_lock);
+		active->erase_session(session_key(session));
+	}
+
+	/* drop a session from the cache and the order, the lock is held */
+	void erase_session(const std::string &key) {
+		auto found = sessions.find(key);
+		if (found == sessions.end()) return;
+		session_order.erase(found->second.order);
+		sessions.erase(found);
+	}
+};
+
+#endif  //_PURRITO_TLS
@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2020-2021 Aisha Tammy <purrito@bsd.ac>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+
+#ifndef _PURRITO_WRITER
+#define _PURRITO_WRITER
+
+#include <lmdb++.h>
+#include <syslog.h>
+
+#include "purrito_log.h"
+#include "purrito_metrics.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/*
+ * group commit writer for the database updates of new pastes
+ * operations from all the workers are queued up and applied together in
+ * a single LMDB write transaction, either once enough of them are
+ * pending or once the oldest one has waited for the commit interval
+ * NOTE: the completion callbacks are run on the writer thread, callers
+ *       have to get back to their own event loop themselves
+ */
+class purrito_expiry_writer {
+       public:
+	/*
+	 * database updates of a single submission, applied inside the
+	 * shared write transaction, an exception fails the whole batch
+	 */
+	typedef std::function<void(lmdb::txn &)> operation;
+
+	/*
+	 * called once the batch containing the operation was committed,
+	 * with false if the transaction failed
+	 */
+	typedef std::function<void(bool)> completion;
+
+	purrito_expiry_writer(MDB_env *env,
+	                      const std::chrono::microseconds interval,
+	                      const std::size_t batch_size,
+	                      purrito_histogram *commit_seconds = nullptr)
+	    : env(env),
+	      interval(interval),
+	      batch_size(batch_size),
+	      commit_seconds(commit_seconds),
+	      stopping(false),
+	      writer([this]() { run(); }) {}
+
+	~purrito_expiry_writer() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		wakeup.notify_one();
+		writer.join();
+	}
+
+	/*
+	 * queue an operation to be committed
+	 */
+	void submit(operation op, completion done) {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			queue.emplace_back(std::move(op), std::move(done));
+		}
+		wakeup.notify_one();
+	}
+
+       private:
+	MDB_env *env;
+	const std::chrono::microseconds interval;
+	const std::size_t batch_size;
+	/* where the time taken by every commit is recorded, if anywhere */
+	purrito_histogram *const commit_seconds;
+
+	std::mutex lock;
+	std::condition_variable wakeup;
+	std::vector<std::pair<operation, completion>> queue;
+	bool stopping;
+	std::thread writer;
+
+	void run() {
+		std::vector<std::pair<operation, completion>> batch;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				wakeup.wait(guard, [this]() {
+					return stopping || !queue.empty();
+				});
+				if (queue.empty()) return;
+				/* give the others a chance to join the batch */
+				wakeup.wait_for(guard, interval, [this]() {
+					return stopping ||
+					       queue.size() >= batch_size;
+				});
+				batch.swap(queue);
+			}
+
+			bool committed = true;
+			auto start = std::chrono::steady_clock::now();
+			try {
+				auto wtxn = lmdb::txn::begin(env);
+				for (auto &entry : batch) entry.first(wtxn);
+				wtxn.commit();
+				if (commit_seconds)
+					commit_seconds->observe(
+					    std::chrono::steady_clock::now() -
+					    start);
+			} catch (lmdb::error &ex) {
+				PLOG(LOG_WARNING,
+				     "(writer) Caught an error while "
+				     "committing %zu submissions - "
+				     "{ %d, %s }",
+				     batch.size(), ex.code(), ex.what());
+				committed = false;
+			} catch (std::exception &ex) {
+				PLOG(LOG_WARNING,
+				     "(writer) Caught an error while "
+				     "committing %zu submissions - %s",
+				     batch.size(), ex.what());
+				committed = false;
+			}
+
+			/* nothing thrown may ever leave the writer thread */
+			for (auto &entry : batch) {
+				try {
+					entry.second(committed);
+				} catch (std::exception &ex) {
+					PLOG(LOG_WARNING,
+					     "(writer) Caught an error while "
+					     "completing a submission - %s",
+					     ex.what());
+				}
+			}
+			batch.clear();
+		}
+	}
+};
+
+#endif  //_PURRITO_WRITER
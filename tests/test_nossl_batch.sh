@@ -0,0 +1,62 @@
+#!/bin/sh
+
+. ./common.sh
+. ./common_functions.sh
+
+set -e
+
+P_RACING=1
+${PURRITO} -d "http://localhost:${P_PORT}/" -s "${P_TMPDIR}" -z "${P_TMPDBDIR}" -i 127.0.0.1 -p "${P_PORT}" -t -I 64 &
+P_ID=$!
+P_RACING=
+
+# should be enough
+sleep 2
+
+# small ones are stored inline, the large one as a file
+printf %s\\n "FIRST_PASTE" > "${P_TMPDIR}/first"
+head -c 4096 /dev/urandom > "${P_TMPDIR}/second"
+printf %s\\n "THIRD_PASTE" > "${P_TMPDIR}/third"
+
+for part in first second third; do
+    wc -c < "${P_TMPDIR}/${part}" | tr -d ' '
+    cat "${P_TMPDIR}/${part}"
+done | curl --silent --fail --data-binary "@-" "localhost:${P_PORT}/batch/day" > "${P_TMPDIR}/urls"
+
+[ "$(wc -l < "${P_TMPDIR}/urls")" -eq 3 ]
+for part in first second third; do
+    P_PASTE=$(head -n 1 "${P_TMPDIR}/urls")
+    sed -i.bak 1d "${P_TMPDIR}/urls"
+    curl --silent --fail "${P_PASTE}" | cmp "${P_TMPDIR}/${part}" -
+done
+
+# a paste cut short, or a size which is not one, stores nothing
+for batch in '12\nSHORT' 'SIZE\nDATA' '0\n'; do
+    P_STATUS=$(printf "${batch}" | curl --silent --output /dev/null --write-out '%{http_code}' --data-binary "@-" "localhost:${P_PORT}/batch")
+    [ "${P_STATUS}" -eq 400 ]
+done
+
+# with a burst of two, the third paste of a batch is turned away
+kill "${P_ID}"
+wait "${P_ID}" || true
+P_RACING=1
+${PURRITO} -d "http://localhost:${P_PORT}/" -s "${P_TMPDIR}" -z "${P_TMPDBDIR}" -i 127.0.0.1 -p "${P_PORT}" -t -I 64 -R 1 -B 2 &
+P_ID=$!
+P_RACING=
+
+# should be enough
+sleep 2
+
+P_COUNT=$(ls "${P_TMPDIR}" | wc -l)
+P_STATUS=$(for part in second second second; do
+    wc -c < "${P_TMPDIR}/${part}" | tr -d ' '
+    cat "${P_TMPDIR}/${part}"
+done | curl --silent --dump-header "${P_TMPDIR}/headers" --output /dev/null --write-out '%{http_code}' --data-binary "@-" "localhost:${P_PORT}/batch")
+[ "${P_STATUS}" -eq 429 ]
+grep -qi '^retry-after: ' "${P_TMPDIR}/headers"
+rm -f "${P_TMPDIR}/headers"
+# and nothing of it is stored
+[ "$(ls "${P_TMPDIR}" | wc -l)" -eq "${P_COUNT}" ]
+
+set +e
+pinfo "${0}: success"
@@ -0,0 +1,44 @@
+#!/bin/sh
+
+. ./common.sh
+. ./common_functions.sh
+
+set -e
+
+# a stored copy left behind with nothing referring to it
+P_ORPHAN="${P_TMPDIR}/.dedup/$(printf %064d 0)"
+mkdir -p "${P_TMPDIR}/.dedup"
+printf %s\\n "ORPHANED_DATA" > "${P_ORPHAN}"
+
+P_RACING=1
+${PURRITO} -d "${P_TMPDIR}/" -s "${P_TMPDIR}" -z "${P_TMPDBDIR}" -i 127.0.0.1 -p "${P_PORT}" -U -j 1 &
+P_ID=$!
+P_RACING=
+
+# should be enough
+sleep 2
+
+P_DATA="SOME_RANDOM_TEST_DATA"
+
+P_PASTE_1=$(printf %s\\n "${P_DATA}" | purr)
+P_PASTE_2=$(printf %s\\n "${P_DATA}" | purr)
+
+if [ -z "${P_PASTE_1}" ] || [ ! -f "${P_PASTE_1}" ] || \
+   [ -z "${P_PASTE_2}" ] || [ ! -f "${P_PASTE_2}" ] || \
+   [ "${P_PASTE_1}" = "${P_PASTE_2}" ]; then
+    exit 1
+fi
+
+printf %s\\n "${P_DATA}" | diff "${P_PASTE_1}" -
+printf %s\\n "${P_DATA}" | diff "${P_PASTE_2}" -
+
+# both pastes should be the same stored copy
+[ "${P_PASTE_1}" -ef "${P_PASTE_2}" ]
+
+# the cleaner removes the orphan, and keeps the copy in use
+sleep 2
+[ ! -e "${P_ORPHAN}" ]
+[ "$(ls "${P_TMPDIR}/.dedup" | wc -l)" -eq 1 ]
+
+set +e
+pinfo "${0}: success"
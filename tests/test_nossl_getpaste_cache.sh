@@ -0,0 +1,34 @@
+#!/bin/sh
+
+. ./common.sh
+. ./common_functions.sh
+
+set -e
+
+P_RACING=1
+${PURRITO} -d "http://localhost:${P_PORT}/" -s "${P_TMPDIR}" -z "${P_TMPDBDIR}" -i 127.0.0.1 -p "${P_PORT}" -t -C 1048576 &
+P_ID=$!
+P_RACING=
+
+# should be enough
+sleep 2
+
+printf %s\\n "THISISACACHEDPASTE" > "${P_TMPDIR}/paste"
+P_PASTE=$(purr "${P_TMPDIR}/paste")
+if [ -z "${P_PASTE}" ]; then
+    exit 1
+fi
+
+# the first GET fills the cache, the second one never opens the file
+curl --silent --fail "${P_PASTE}" | diff "${P_TMPDIR}/paste" -
+rm "${P_TMPDIR}/${P_PASTE##*/}"
+curl --silent --fail "${P_PASTE}" | diff "${P_TMPDIR}/paste" -
+
+# files which are not pastes are always read from the file
+printf %s\\n "THISISRANDOMFILE" > "${P_TMPDIR}/somethingrandom"
+curl --silent --fail "localhost:${P_PORT}/somethingrandom" | diff "${P_TMPDIR}/somethingrandom" -
+printf %s\\n "THISISCHANGEDFILE" > "${P_TMPDIR}/somethingrandom"
+curl --silent --fail "localhost:${P_PORT}/somethingrandom" | diff "${P_TMPDIR}/somethingrandom" -
+
+set +e
+pinfo "${0}: success"
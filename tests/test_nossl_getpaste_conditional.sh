@@ -0,0 +1,51 @@
+#!/bin/sh
+
+. ./common.sh
+. ./common_functions.sh
+
+set -e
+
+P_RACING=1
+${PURRITO} -d "http://localhost:${P_PORT}/" -s "${P_TMPDIR}" -z "${P_TMPDBDIR}" -i 127.0.0.1 -p "${P_PORT}" -t &
+P_ID=$!
+P_RACING=
+
+# should be enough
+sleep 2
+
+${SEQ} 1 10000 > "${P_DATA}"
+
+P_PASTE=$(purr "${P_DATA}")
+if [ -z "${P_PASTE}" ]; then
+    exit 1
+fi
+
+curl --silent --fail --dump-header "${P_TMPDIR}/headers" "${P_PASTE}" > /dev/null
+P_ETAG=$(sed -n 's/^etag: *\([^\r]*\).*$/\1/ip' "${P_TMPDIR}/headers")
+P_MODIFIED=$(sed -n 's/^last-modified: *\([^\r]*\).*$/\1/ip' "${P_TMPDIR}/headers")
+if [ -z "${P_ETAG}" ] || [ -z "${P_MODIFIED}" ]; then
+    exit 1
+fi
+grep -qi '^cache-control: .*immutable' "${P_TMPDIR}/headers"
+
+# an unchanged paste is not sent again
+P_STATUS=$(curl --silent --output /dev/null --write-out '%{http_code}' --header "If-None-Match: ${P_ETAG}" "${P_PASTE}")
+[ "${P_STATUS}" = 304 ]
+P_STATUS=$(curl --silent --output /dev/null --write-out '%{http_code}' --header "If-Modified-Since: ${P_MODIFIED}" "${P_PASTE}")
+[ "${P_STATUS}" = 304 ]
+P_STATUS=$(curl --silent --output /dev/null --write-out '%{http_code}' --header 'If-None-Match: "doesnotmatch"' "${P_PASTE}")
+[ "${P_STATUS}" = 200 ]
+
+# single ranges
+curl --silent --fail --range 100-199 "${P_PASTE}" > "${P_TMPDIR}/fetched"
+tail -c +101 "${P_DATA}" | head -c 100 | diff "${P_TMPDIR}/fetched" -
+curl --silent --fail --range -50 "${P_PASTE}" > "${P_TMPDIR}/fetched"
+tail -c 50 "${P_DATA}" | diff "${P_TMPDIR}/fetched" -
+P_STATUS=$(curl --silent --output /dev/null --write-out '%{http_code}' --range 1000000- "${P_PASTE}")
+[ "${P_STATUS}" = 416 ]
+
+# a stale If-Range gets the whole paste
+curl --silent --fail --range 0-9 --header 'If-Range: "stale"' "${P_PASTE}" | diff "${P_DATA}" -
+
+set +e
+pinfo "${0}: success"
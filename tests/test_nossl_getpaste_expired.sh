@@ -0,0 +1,35 @@
+#!/bin/sh
+
+. ./common.sh
+. ./common_functions.sh
+
+set -e
+
+# pastes live for one second, and the cleaner does not get to them
+P_RACING=1
+${PURRITO} -d "http://localhost:${P_PORT}/" -s "${P_TMPDIR}" -z "${P_TMPDBDIR}" -i 127.0.0.1 -p "${P_PORT}" -t -I 1024 -q 1 -j 3600 &
+P_ID=$!
+P_RACING=
+
+# should be enough
+sleep 2
+
+${SEQ} 1 10000 > "${P_DATA}"
+
+P_PASTE=$(curl --silent --data-binary "@${P_DATA}" "localhost:${P_PORT}/")
+P_INLINE=$(printf %s\\n "SOME_RANDOM_TEST_DATA" | curl --silent --data-binary @- "localhost:${P_PORT}/")
+if [ -z "${P_PASTE}" ] || [ -z "${P_INLINE}" ]; then
+    exit 1
+fi
+
+sleep 2
+
+# the file is still there, but the paste is gone
+[ -e "${P_TMPDIR}/${P_PASTE##*/}" ]
+P_STATUS=$(curl --silent --output /dev/null --write-out '%{http_code}' "${P_PASTE}")
+[ "${P_STATUS}" = 410 ]
+P_STATUS=$(curl --silent --output /dev/null --write-out '%{http_code}' "${P_INLINE}")
+[ "${P_STATUS}" = 410 ]
+
+set +e
+pinfo "${0}: success"
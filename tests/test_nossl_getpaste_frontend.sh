@@ -0,0 +1,40 @@
+#!/bin/sh
+
+. ./common.sh
+. ./common_functions.sh
+
+set -e
+
+# large enough to be worth compressing
+${SEQ} 1 1000 | sed 's/.*/<p>&<\/p>/' > "${P_TMPDIR}/index.html"
+printf %s\\n "body { color: black; }" > "${P_TMPDIR}/style.css"
+
+P_RACING=1
+${PURRITO} -d "http://localhost:${P_PORT}/" -s "${P_TMPDIR}" -z "${P_TMPDBDIR}" -i 127.0.0.1 -p "${P_PORT}" -t &
+P_ID=$!
+P_RACING=
+
+# should be enough
+sleep 2
+
+curl --silent --fail --dump-header "${P_TMPDIR}/headers" "localhost:${P_PORT}/" | diff "${P_TMPDIR}/index.html" -
+grep -qi '^content-type: text/html' "${P_TMPDIR}/headers"
+curl --silent --fail --dump-header "${P_TMPDIR}/headers" "localhost:${P_PORT}/style.css" | diff "${P_TMPDIR}/style.css" -
+grep -qi '^content-type: text/css' "${P_TMPDIR}/headers"
+
+# compressed for the clients which take it
+curl --silent --fail --compressed --dump-header "${P_TMPDIR}/headers" "localhost:${P_PORT}/index.html" | diff "${P_TMPDIR}/index.html" -
+grep -qi '^content-encoding: gzip' "${P_TMPDIR}/headers"
+P_ETAG=$(sed -n 's/^etag: *\([^\r]*\).*$/\1/ip' "${P_TMPDIR}/headers")
+P_STATUS=$(curl --silent --output /dev/null --write-out '%{http_code}' --compressed --header "If-None-Match: ${P_ETAG}" "localhost:${P_PORT}/index.html")
+[ "${P_STATUS}" = 304 ]
+
+# changes are only picked up once reloaded
+printf %s\\n "THISISINDEX" > "${P_TMPDIR}/index.html"
+curl --silent --fail "localhost:${P_PORT}/" | grep -q '<p>1</p>'
+kill -HUP "${P_ID}"
+sleep 1
+curl --silent --fail "localhost:${P_PORT}/" | diff "${P_TMPDIR}/index.html" -
+
+set +e
+pinfo "${0}: success"
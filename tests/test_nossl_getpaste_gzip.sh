@@ -0,0 +1,42 @@
+#!/bin/sh
+
+. ./common.sh
+. ./common_functions.sh
+
+set -e
+
+P_RACING=1
+${PURRITO} -d "http://localhost:${P_PORT}/" -s "${P_TMPDIR}" -z "${P_TMPDBDIR}" -i 127.0.0.1 -p "${P_PORT}" -t -Z 6 &
+P_ID=$!
+P_RACING=
+
+# should be enough
+sleep 2
+
+${SEQ} 1 10000 > "${P_DATA}"
+
+P_PASTE=$(purr "${P_DATA}")
+
+# P_PASTE is not set or empty
+# OR
+# P_PASTE was not stored compressed
+if [ -z "${P_PASTE}" ] || [ ! -f "${P_TMPDIR}/${P_PASTE##*/}.gz" ]; then
+    exit 1
+fi
+
+# clients not accepting gzip get it decompressed on the fly
+curl --silent --fail "${P_PASTE}" > "${P_TMPDIR}/fetched"
+diff "${P_TMPDIR}/fetched" "${P_DATA}"
+
+# so neither GET nor HEAD can tell their length
+curl --silent --fail --head "${P_PASTE}" > "${P_TMPDIR}/headers"
+if grep -qi '^content-length:' "${P_TMPDIR}/headers"; then
+    exit 1
+fi
+
+# clients accepting gzip get the stored file as is
+curl --silent --fail --compressed "${P_PASTE}" > "${P_TMPDIR}/fetched"
+diff "${P_TMPDIR}/fetched" "${P_DATA}"
+
+set +e
+pinfo "${0}: success"
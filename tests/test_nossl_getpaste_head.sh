@@ -0,0 +1,42 @@
+#!/bin/sh
+
+. ./common.sh
+. ./common_functions.sh
+
+set -e
+
+P_RACING=1
+${PURRITO} -d "http://localhost:${P_PORT}/" -s "${P_TMPDIR}" -z "${P_TMPDBDIR}" -i 127.0.0.1 -p "${P_PORT}" -t &
+P_ID=$!
+P_RACING=
+
+# should be enough
+sleep 2
+
+${SEQ} 1 10000 > "${P_DATA}"
+P_SIZE=$(wc -c < "${P_DATA}" | tr -d ' ')
+
+P_PASTE=$(purr "${P_DATA}")
+if [ -z "${P_PASTE}" ]; then
+    exit 1
+fi
+
+curl --silent --fail --head "${P_PASTE}" > "${P_TMPDIR}/headers"
+grep -qi "^content-length: ${P_SIZE}" "${P_TMPDIR}/headers"
+grep -qi '^content-type: text/plain' "${P_TMPDIR}/headers"
+curl --silent --fail --dump-header "${P_TMPDIR}/headers" "${P_PASTE}" | diff "${P_DATA}" -
+grep -qi '^content-type: text/plain' "${P_TMPDIR}/headers"
+
+# anything with a NUL byte is binary
+printf 'a\000b' | purr > "${P_TMPDIR}/binary"
+curl --silent --fail --head "$(cat "${P_TMPDIR}/binary")" | grep -qi '^content-type: application/octet-stream'
+
+# HEAD does not even look at the file
+rm "${P_TMPDIR}/${P_PASTE##*/}"
+P_STATUS=$(curl --silent --output /dev/null --write-out '%{http_code}' --head "${P_PASTE}")
+[ "${P_STATUS}" = 200 ]
+P_STATUS=$(curl --silent --output /dev/null --write-out '%{http_code}' "${P_PASTE}")
+[ "${P_STATUS}" = 404 ]
+
+set +e
+pinfo "${0}: success"
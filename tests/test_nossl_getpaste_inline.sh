@@ -0,0 +1,31 @@
+#!/bin/sh
+
+. ./common.sh
+. ./common_functions.sh
+
+set -e
+
+P_RACING=1
+${PURRITO} -d "http://localhost:${P_PORT}/" -s "${P_TMPDIR}" -z "${P_TMPDBDIR}" -i 127.0.0.1 -p "${P_PORT}" -t -I 1024 &
+P_ID=$!
+P_RACING=
+
+# should be enough
+sleep 2
+
+P_DATA="SOME_RANDOM_TEST_DATA"
+
+P_PASTE=$(printf %s\\n "${P_DATA}" | purr)
+
+# P_PASTE is not set or empty
+# OR
+# P_PASTE was stored as a file
+if [ -z "${P_PASTE}" ] || [ -e "${P_TMPDIR}/${P_PASTE##*/}" ]; then
+    exit 1
+fi
+
+curl --silent --fail "${P_PASTE}" > "${P_TMPDIR}/fetched"
+printf %s\\n "${P_DATA}" | diff "${P_TMPDIR}/fetched" -
+
+set +e
+pinfo "${0}: success"
@@ -0,0 +1,29 @@
+#!/bin/sh
+
+. ./common.sh
+. ./common_functions.sh
+
+set -e
+
+P_LOG="${P_TMPDBDIR}/purrito.log"
+
+P_RACING=1
+${PURRITO} -d "${P_TMPDIR}/" -s "${P_TMPDIR}" -z "${P_TMPDBDIR}" -i 127.0.0.1 -p "${P_PORT}" -L info -E "${P_LOG}" &
+P_ID=$!
+P_RACING=
+
+# should be enough
+sleep 2
+
+P_PASTE=$(printf %s\\n "SOME_RANDOM_TEST_DATA" | purr)
+if [ -z "${P_PASTE}" ] || [ ! -f "${P_PASTE}" ]; then
+    exit 1
+fi
+
+# messages are written out in the background
+sleep 1
+
+grep -q "Sending paste url back: ${P_PASTE}" "${P_LOG}"
+
+set +e
+pinfo "${0}: success"
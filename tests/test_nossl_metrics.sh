@@ -0,0 +1,35 @@
+#!/bin/sh
+
+. ./common.sh
+. ./common_functions.sh
+
+set -e
+
+: ${P_METRICS_PORT=$(${SHUF} -i 1500-65535 -n 1)}
+
+P_RACING=1
+${PURRITO} -d "http://localhost:${P_PORT}/" -s "${P_TMPDIR}" -z "${P_TMPDBDIR}" -i 127.0.0.1 -p "${P_PORT}" -t -M "${P_METRICS_PORT}" &
+P_ID=$!
+P_RACING=
+
+# should be enough
+sleep 2
+
+P_PASTE=$(printf %s\\n "SOME_RANDOM_TEST_DATA" | purr)
+if [ -z "${P_PASTE}" ]; then
+    exit 1
+fi
+curl --silent --fail "${P_PASTE}" > /dev/null
+curl --silent "http://localhost:${P_PORT}/doesnotexist" > /dev/null
+
+curl --silent --fail "http://127.0.0.1:${P_METRICS_PORT}/metrics" > "${P_TMPDIR}/metrics"
+
+grep -qx 'purrito_requests_total{method="POST",status="200"} 1' "${P_TMPDIR}/metrics"
+grep -qx 'purrito_requests_total{method="GET",status="200"} 1' "${P_TMPDIR}/metrics"
+grep -qx 'purrito_requests_total{method="GET",status="404"} 1' "${P_TMPDIR}/metrics"
+grep -qx 'purrito_upload_bytes_count 1' "${P_TMPDIR}/metrics"
+grep -qx 'purrito_upload_bytes_sum 22' "${P_TMPDIR}/metrics"
+grep -qx 'purrito_log_dropped_total [0-9]*' "${P_TMPDIR}/metrics"
+
+set +e
+pinfo "${0}: success"
@@ -0,0 +1,31 @@
+#!/bin/sh
+
+. ./common.sh
+. ./common_functions.sh
+
+set -e
+
+P_RACING=1
+${PURRITO} -d "http://localhost:${P_PORT}/" -s "${P_TMPDIR}" -z "${P_TMPDBDIR}" -i 127.0.0.1 -p "${P_PORT}" -R 1 -B 3 &
+P_ID=$!
+P_RACING=
+
+# should be enough
+sleep 2
+
+# the burst goes through
+for i in 1 2 3; do
+    P_PASTE=$(printf %s\\n "SOME_RANDOM_TEST_DATA_${i}" | purr)
+    if [ -z "${P_PASTE}" ] || [ ! -f "${P_TMPDIR}/${P_PASTE##*/}" ]; then
+        exit 1
+    fi
+done
+
+# and the next one is turned away, without storing anything
+P_COUNT=$(ls "${P_TMPDIR}" | wc -l)
+P_STATUS=$(printf %s\\n "SOME_RANDOM_TEST_DATA" | curl --silent --output /dev/null --write-out '%{http_code}' --data-binary @- "localhost:${P_PORT}/day")
+[ "${P_STATUS}" = 429 ]
+[ "$(ls "${P_TMPDIR}" | wc -l)" = "${P_COUNT}" ]
+
+set +e
+pinfo "${0}: success"
@@ -0,0 +1,40 @@
+#!/bin/sh
+
+. ./common.sh
+. ./common_functions.sh
+
+set -e
+
+P_RACING=1
+${PURRITO} -d "http://localhost:${P_PORT}/" -s "${P_TMPDIR}" -z "${P_TMPDBDIR}" -i 127.0.0.1 -p "${P_PORT}" -t &
+P_ID=$!
+P_RACING=
+
+# should be enough
+sleep 2
+
+${SEQ} 1 10000 > "${P_DATA}"
+
+P_PASTE=$(purr "${P_DATA}")
+if [ -z "${P_PASTE}" ]; then
+    exit 1
+fi
+
+# the new copy takes over and the old one exits
+P_OLD="${P_ID}"
+kill -USR2 "${P_OLD}"
+sleep 1
+P_ID=$(pgrep -P "${P_OLD}" || true)
+if [ -z "${P_ID}" ]; then
+    P_ID="${P_OLD}"
+    exit 1
+fi
+# drained without anything left open, so it exits cleanly
+wait "${P_OLD}"
+
+curl --silent --fail "${P_PASTE}" | diff "${P_DATA}" -
+P_PASTE=$(purr "${P_DATA}")
+curl --silent --fail "${P_PASTE}" | diff "${P_DATA}" -
+
+set +e
+pinfo "${0}: success"
@@ -0,0 +1,58 @@
+#!/bin/sh
+
+. ./common.sh
+. ./common_functions.sh
+
+set -e
+
+P_RACING=1
+${PURRITO} -d "http://localhost:${P_PORT}/" -s "${P_TMPDIR}" -z "${P_TMPDBDIR}" -i 127.0.0.1 -p "${P_PORT}" -m $((${P_MAXSIZE} * 1024 * 1024)) -W 2 &
+P_ID=$!
+P_RACING=
+
+# should be enough
+sleep 2
+
+${SEQ} 1 100000 > "${P_DATA}"
+P_SMALL=$(mktemp -p "${P_TMPDIR}")
+${SEQ} 1 100 > "${P_SMALL}"
+
+# a slow upload, still in flight while the new copy takes over
+P_SLOW=$(mktemp -p "${P_TMPDIR}")
+curl --max-time 60 --silent --limit-rate 100K --data-binary "@${P_DATA}" "localhost:${P_PORT}/day" > "${P_SLOW}" &
+P_UPLOAD=$!
+
+# and a steady stream of new connections across the handover
+P_FAILED=$(mktemp -p "${P_TMPDIR}")
+(
+    while kill -0 "${P_UPLOAD}" 2> /dev/null; do
+        P_PASTE=$(purr "${P_SMALL}" || true)
+        curl --silent --fail "${P_PASTE}" | diff -q "${P_SMALL}" - > /dev/null || echo "${P_PASTE}" >> "${P_FAILED}"
+    done
+) &
+P_STREAM=$!
+
+sleep 1
+P_OLD="${P_ID}"
+kill -USR2 "${P_OLD}"
+sleep 1
+P_ID=$(pgrep -P "${P_OLD}" || true)
+if [ -z "${P_ID}" ]; then
+    P_ID="${P_OLD}"
+    exit 1
+fi
+
+# the old one only exits once the upload is done
+wait "${P_UPLOAD}"
+wait "${P_STREAM}"
+wait "${P_OLD}"
+
+if [ -s "${P_FAILED}" ]; then
+    exit 1
+fi
+curl --silent --fail "$(cat "${P_SLOW}")" | diff "${P_DATA}" -
+P_PASTE=$(purr "${P_DATA}")
+curl --silent --fail "${P_PASTE}" | diff "${P_DATA}" -
+
+set +e
+pinfo "${0}: success"
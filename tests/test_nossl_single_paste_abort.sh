@@ -15,12 +15,10 @@ sleep 2
 
 P_DATA="SOME_RANDOM_TEST_DATA"
 
-set +e
-P_PASTE=$(printf %s\\n "${P_DATA}" | purr)
-set -e
+P_STATUS=$(printf %s\\n "${P_DATA}" | curl --silent --output /dev/null --write-out '%{http_code}' --data-binary @- "localhost:${P_PORT}/day")
 
-# P_PASTE should be blank
-if [ ! -z "${P_PASTE}" ]; then
+# the paste is larger than allowed
+if [ "${P_STATUS}" != 413 ]; then
     exit 1
 fi
 
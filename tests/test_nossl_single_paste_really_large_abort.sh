@@ -15,13 +15,23 @@ sleep 2
 
 dd if=/dev/urandom of="${P_DATA}" bs=1M count=$((${P_MAXSIZE} + 1)) ${P_DD_FLAGS}
 
+# with a Content-Length it is turned away before anything is stored
+P_STATUS=$(curl --silent --output /dev/null --write-out '%{http_code}' --data-binary "@${P_DATA}" "localhost:${P_PORT}/day")
+[ "${P_STATUS}" = 413 ]
+
+# chunked uploads are only cut off once they get too large
 set +e
-P_PASTE=$(purr "${P_DATA}")
+P_PASTE=$(curl --silent --header "Transfer-Encoding: chunked" --data-binary "@${P_DATA}" "localhost:${P_PORT}/day")
 set -e
 
 if [ ! -z "${P_PASTE}" ]; then
     exit 1
 fi
 
+# and neither leaves a file behind
+if [ "$(ls "${P_TMPDIR}")" != "${P_DATA##*/}" ]; then
+    exit 1
+fi
+
 set +e
 pinfo "${0}: success"
@@ -0,0 +1,50 @@
+#!/bin/sh
+
+. ./common.sh
+. ./common_functions.sh
+
+set -e
+
+P_RACING=1
+${PURRITO} -d "http://localhost:${P_PORT}/" -s "${P_TMPDIR}" -z "${P_TMPDBDIR}" -i 127.0.0.1 -p "${P_PORT}" -t &
+P_ID=$!
+P_RACING=
+
+# should be enough
+sleep 2
+
+P_OLD=$(printf %s\\n "SOME_OLD_TEST_DATA" | purr)
+P_OLD=${P_OLD##*/}
+if [ -z "${P_OLD}" ] || [ ! -f "${P_TMPDIR}/${P_OLD}" ]; then
+    exit 1
+fi
+
+kill "${P_ID}"
+wait "${P_ID}" || true
+
+# restart with two levels, the old paste gets moved over
+P_RACING=1
+${PURRITO} -d "http://localhost:${P_PORT}/" -s "${P_TMPDIR}" -z "${P_TMPDBDIR}" -i 127.0.0.1 -p "${P_PORT}" -t -S 2 &
+P_ID=$!
+P_RACING=
+
+# should be enough
+sleep 2
+
+P_SHARD=$(printf %s "${P_OLD}" | cut -c 1-2)/$(printf %s "${P_OLD}" | cut -c 3-4)
+if [ -f "${P_TMPDIR}/${P_OLD}" ] || [ ! -f "${P_TMPDIR}/${P_SHARD}/${P_OLD}" ]; then
+    exit 1
+fi
+curl --silent --fail "localhost:${P_PORT}/${P_OLD}" | grep -qx "SOME_OLD_TEST_DATA"
+
+# and new pastes go straight into their shard
+P_NEW=$(printf %s\\n "SOME_NEW_TEST_DATA" | purr)
+P_NEW=${P_NEW##*/}
+P_SHARD=$(printf %s "${P_NEW}" | cut -c 1-2)/$(printf %s "${P_NEW}" | cut -c 3-4)
+if [ -z "${P_NEW}" ] || [ ! -f "${P_TMPDIR}/${P_SHARD}/${P_NEW}" ]; then
+    exit 1
+fi
+curl --silent --fail "localhost:${P_PORT}/${P_NEW}" | grep -qx "SOME_NEW_TEST_DATA"
+
+set +e
+pinfo "${0}: success"
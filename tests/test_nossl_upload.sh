@@ -0,0 +1,57 @@
+#!/bin/sh
+
+. ./common.sh
+. ./common_functions.sh
+
+set -e
+
+P_RACING=1
+${PURRITO} -d "http://localhost:${P_PORT}/" -s "${P_TMPDIR}" -z "${P_TMPDBDIR}" -i 127.0.0.1 -p "${P_PORT}" -t -m 1048576 -j 1 -Y 3 &
+P_ID=$!
+P_RACING=
+
+# should be enough
+sleep 2
+
+head -c 200000 /dev/urandom > "${P_TMPDIR}/paste"
+head -c 120000 "${P_TMPDIR}/paste" > "${P_TMPDIR}/first"
+tail -c +120001 "${P_TMPDIR}/paste" > "${P_TMPDIR}/second"
+
+patch_upload() {
+    curl --silent --output /dev/null --write-out '%{http_code}' -X PATCH -H "Upload-Offset: ${2}" --data-binary "@${3}" "${1}"
+}
+
+P_UPLOAD=$(curl --silent --fail -X POST -H "Upload-Length: 200000" "localhost:${P_PORT}/upload/day")
+
+# the parts have to come in order, and all of them before finishing
+[ "$(patch_upload "${P_UPLOAD}" 0 "${P_TMPDIR}/first")" -eq 204 ]
+[ "$(patch_upload "${P_UPLOAD}" 0 "${P_TMPDIR}/second")" -eq 409 ]
+curl --silent --fail --head "${P_UPLOAD}" | grep -qi '^upload-offset: 120000'
+P_STATUS=$(curl --silent --output /dev/null --write-out '%{http_code}' -X POST "${P_UPLOAD}")
+[ "${P_STATUS}" -eq 409 ]
+[ "$(patch_upload "${P_UPLOAD}" 120000 "${P_TMPDIR}/second")" -eq 204 ]
+
+P_PASTE=$(curl --silent --fail -X POST "${P_UPLOAD}")
+curl --silent --fail "${P_PASTE}" | cmp "${P_TMPDIR}/paste" -
+
+# finishing it again gives the same paste, and nothing more can be added
+[ "$(curl --silent --fail -X POST "${P_UPLOAD}")" = "${P_PASTE}" ]
+[ "$(patch_upload "${P_UPLOAD}" 200000 "${P_TMPDIR}/second")" -eq 409 ]
+curl --silent --fail --head "${P_UPLOAD}" | grep -qi '^upload-offset: 200000'
+P_FINISHED="${P_UPLOAD}"
+
+# nothing added for longer than the timeout, the cleaner removes it
+P_UPLOAD=$(curl --silent --fail -X POST "localhost:${P_PORT}/upload")
+[ "$(patch_upload "${P_UPLOAD}" 0 "${P_TMPDIR}/first")" -eq 204 ]
+sleep 6
+P_STATUS=$(curl --silent --output /dev/null --write-out '%{http_code}' --head "${P_UPLOAD}")
+[ "${P_STATUS}" -eq 404 ]
+[ -z "$(ls "${P_TMPDIR}/.uploads")" ]
+
+# as is the finished one, while its paste stays
+P_STATUS=$(curl --silent --output /dev/null --write-out '%{http_code}' --head "${P_FINISHED}")
+[ "${P_STATUS}" -eq 404 ]
+curl --silent --fail "${P_PASTE}" | cmp "${P_TMPDIR}/paste" -
+
+set +e
+pinfo "${0}: success"
@@ -0,0 +1,39 @@
+#!/bin/sh
+
+. ./common.sh
+. ./common_functions.sh
+
+set -e
+
+cp "${P_CRT}" "${P_TMPDIR}/PB.crt"
+cp "${P_KEY}" "${P_TMPDIR}/PB.key"
+
+P_RACING=1
+${PURRITO} -d "https://localhost:${P_PORT}/" -s "${P_TMPDIR}" -z "${P_TMPDBDIR}" -i 127.0.0.1 -p "${P_PORT}" -t -n localhost -k "${P_TMPDIR}/PB.key" -c "${P_TMPDIR}/PB.crt" -l &
+P_ID=$!
+P_RACING=
+
+# should be enough
+sleep 2
+
+printf %s\\n "THISISINDEX" > "${P_TMPDIR}/index.html"
+curl --silent --cacert "${P_CRT}" --fail "https://localhost:${P_PORT}/" | diff "${P_TMPDIR}/index.html" -
+
+# a key which does not belong to the certificate is not taken
+openssl genrsa -out "${P_TMPDIR}/other.key" 2048 2> /dev/null
+cp "${P_TMPDIR}/other.key" "${P_TMPDIR}/PB.key"
+kill -HUP "${P_ID}"
+sleep 1
+curl --silent --cacert "${P_CRT}" --fail "https://localhost:${P_PORT}/" | diff "${P_TMPDIR}/index.html" -
+
+# a new certificate is picked up without a restart
+openssl req -x509 -out "${P_TMPDIR}/PB.crt" -keyout "${P_TMPDIR}/PB.key" -newkey rsa:2048 -nodes -sha256 -subj '/CN=localhost' -extensions EXT -config PB.conf 2> /dev/null
+kill -HUP "${P_ID}"
+sleep 1
+curl --silent --cacert "${P_TMPDIR}/PB.crt" --fail "https://localhost:${P_PORT}/" | diff "${P_TMPDIR}/index.html" -
+if curl --silent --cacert "${P_CRT}" --fail "https://localhost:${P_PORT}/" > /dev/null; then
+    exit 1
+fi
+
+set +e
+pinfo "${0}: success"
@@ -0,0 +1,42 @@
+#!/bin/sh
+
+. ./common.sh
+. ./common_functions.sh
+
+set -e
+
+: ${P_METRICS_PORT=$(${SHUF} -i 1500-65535 -n 1)}
+
+# a second name with a certificate of its own
+openssl req -x509 -out "${P_TMPDIR}/other.crt" -keyout "${P_TMPDIR}/other.key" -newkey rsa:2048 -nodes -sha256 -subj '/CN=other.localhost' 2> /dev/null
+openssl rand 80 > "${P_TMPDIR}/ticket.key"
+
+P_RACING=1
+${PURRITO} -d "https://localhost:${P_PORT}/" -s "${P_TMPDIR}" -z "${P_TMPDBDIR}" -i 127.0.0.1 -p "${P_PORT}" -W 4 -M "${P_METRICS_PORT}" -T "${P_TMPDIR}/ticket.key" -n localhost -c "${P_CRT}" -k "${P_KEY}" -n other.localhost -c "${P_TMPDIR}/other.crt" -k "${P_TMPDIR}/other.key" -l &
+P_ID=$!
+P_RACING=
+
+# should be enough
+sleep 2
+
+P_PASTE=$(printf %s\\n "SOME_RANDOM_TEST_DATA" | spurr)
+if [ -z "${P_PASTE}" ]; then
+    exit 1
+fi
+
+# every name gets its own certificate
+openssl s_client -connect "127.0.0.1:${P_PORT}" -servername other.localhost < /dev/null 2> /dev/null | grep -q 'subject=CN *= *other.localhost'
+
+# sessions are resumed whichever worker the connection lands on
+for tls in -tls1_2 -tls1_3; do
+    openssl s_client -connect "127.0.0.1:${P_PORT}" -servername localhost "${tls}" -sess_out "${P_TMPDIR}/session" < /dev/null > /dev/null 2>&1
+    for i in $(${SEQ} 8); do
+        openssl s_client -connect "127.0.0.1:${P_PORT}" -servername localhost "${tls}" -sess_in "${P_TMPDIR}/session" -sess_out "${P_TMPDIR}/session" < /dev/null 2> /dev/null | grep -q '^Reused'
+    done
+done
+
+curl --silent --fail "http://127.0.0.1:${P_METRICS_PORT}/metrics" > "${P_TMPDIR}/metrics"
+grep -q '^purrito_tls_resumptions_total{from="ticket"} [1-9]' "${P_TMPDIR}/metrics"
+
+set +e
+pinfo "${0}: success"